@@ -0,0 +1,243 @@
+//
+//  bench.cpp
+//  safe-append-cpp
+//
+//  Throughput of the library's CPU-bound pieces. Build with optimization
+//  (CMAKE_BUILD_TYPE=Release) for meaningful numbers, and with -march=native
+//  (or at least -mssse3) to enable the wider byte-swap paths.
+//
+
+#include <array>
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "byte_utils.h"
+#include "lz_codec.h"
+#include "basic_appender.h"
+#include "storage_backend.h"
+#include "crash_harness.h"
+#include "epoch_journal.h"
+#include "fd_cache.h"
+#include "safe_append.h"
+#include "safe_append_internals.h"
+
+static volatile byte sink;
+
+static void report(char const * name, size_t bytes_per_run, std::function<void()> run) {
+    run();
+    size_t runs = 0;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    double elapsed = 0;
+    do {
+        run();
+        ++runs;
+        elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count();
+    } while(elapsed<0.5);
+    std::printf("%-36s %8.2f GB/s\n", name, (double)bytes_per_run*runs/elapsed/1e9);
+}
+
+static void report_rate(char const * name, std::function<void()> run) {
+    run();
+    size_t runs = 0;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    double elapsed = 0;
+    do {
+        run();
+        ++runs;
+        elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count();
+    } while(elapsed<0.5);
+    std::printf("%-36s %8.0f ops/s\n", name, runs/elapsed);
+}
+
+static void byte_utils_bench() {
+    const size_t n = 1<<20;
+    std::vector<uint32_t> values32(n);
+    std::vector<uint64_t> values64(n/2);
+    std::vector<byte> bytes(4*n);
+    std::vector<char> hex(8*n);
+    for(size_t i=0; i<n; ++i) {
+        values32[i] = (uint32_t)(i*2654435761u);
+    }
+    
+    report("encode_big_endian (scalar, 32-bit)", bytes.size(), [&]() {
+        for(size_t i=0; i<n; ++i) {
+            encode_big_endian(bytes.begin()+4*i, values32[i]);
+        }
+        sink = bytes[0];
+    });
+    report("encode_big_endian_array (32-bit)", bytes.size(), [&]() {
+        encode_big_endian_array(values32.data(), n, bytes.data());
+        sink = bytes[0];
+    });
+    report("extract_big_endian (scalar, 32-bit)", bytes.size(), [&]() {
+        for(size_t i=0; i<n; ++i) {
+            std::vector<byte>::iterator it = bytes.begin()+4*i;
+            values32[i] = extract_big_endian(it);
+        }
+        sink = (byte)values32[0];
+    });
+    report("extract_big_endian_array (64-bit)", bytes.size(), [&]() {
+        extract_big_endian_array(bytes.data(), n/2, values64.data());
+        sink = (byte)values64[0];
+    });
+    report("bytes_to_hex (back_inserter)", bytes.size(), [&]() {
+        std::string s;
+        std::back_insert_iterator<std::string> it = std::back_inserter(s);
+        bytes_to_hex(bytes.begin(), bytes.end(), it);
+        sink = (byte)s[0];
+    });
+    report("bytes_to_hex (preallocated)", bytes.size(), [&]() {
+        bytes_to_hex(bytes.data(), bytes.size(), hex.data());
+        sink = (byte)hex[0];
+    });
+    report("hex_to_bytes (preallocated)", bytes.size(), [&]() {
+        hex_to_bytes(hex.data(), hex.size(), bytes.data());
+        sink = bytes[0];
+    });
+}
+
+static void lz_codec_bench() {
+    std::string text;
+    for(int i=0; text.size()<(1<<22); ++i) {
+        text += "series=cpu,host=db" + std::to_string(i%7) + " value=" + std::to_string(i*31%1000) + "\n";
+    }
+    const size_t block = 64*1024;
+    size_t blocks = text.size()/block;
+    std::vector<byte> packed(blocks*lz_compress_bound(block));
+    std::vector<size_t> sizes(blocks);
+    std::vector<byte> out(blocks*block);
+    byte const * in = reinterpret_cast<byte const *>(text.data());
+    
+    report("lz_compress (64 KiB blocks)", blocks*block, [&]() {
+        for(size_t i=0; i<blocks; ++i) {
+            sizes[i] = lz_compress(in+i*block, block, packed.data()+i*lz_compress_bound(block));
+        }
+        sink = packed[0];
+    });
+    report("lz_decompress (64 KiB blocks)", blocks*block, [&]() {
+        for(size_t i=0; i<blocks; ++i) {
+            lz_decompress(packed.data()+i*lz_compress_bound(block), sizes[i], out.data()+i*block, block);
+        }
+        sink = out[0];
+    });
+    size_t total = 0;
+    for(size_t n : sizes) {
+        total += n;
+    }
+    std::printf("%-36s %8.2fx\n", "lz ratio (sample series text)", (double)(blocks*block)/total);
+}
+
+// One start/append/commit cycle per run. In memory, this is the engine's
+// own CPU cost; on disk, it includes the file system.
+template<typename T_backend>
+static void transaction_bench(char const * name, std::string const & fname) {
+    typedef sa::basic_appender<sa::sha512_checksum, sa::no_sync, sa::sibling_journal, sa::no_lock, T_backend> appender;
+    std::array<byte, 64> record;
+    record.fill(0x5a);
+    int fd = T_backend::open(fname, O_WRONLY | O_CREAT | O_TRUNC);
+    T_backend::close(fd);
+    report_rate(name, [&]() {
+        appender::start(fname);
+        int fd = T_backend::open(fname, O_WRONLY);
+        uint64_t size = 0;
+        T_backend::size(fd, size);
+        T_backend::pwrite_all(fd, record.data(), record.size(), size);
+        T_backend::close(fd);
+        appender::commit(fname);
+    });
+    T_backend::unlink(fname);
+}
+
+template<typename T_sync>
+static void crash_bench(char const * name) {
+    typedef sa::basic_appender<sa::sha512_checksum, T_sync, sa::sibling_journal, sa::no_lock, sa::memory_backend> appender;
+    std::vector<byte> initial(4096, 'i');
+    std::vector<std::vector<byte>> appends(16, std::vector<byte>(1000, 'a'));
+    sa::crash_report r = sa::crash_every_operation<appender>("mem/crash.dat", initial, appends, 0.5);
+    std::printf("%-36s %5zu crashes, %zu torn, %zu lost, %zu unrecovered, max recovery %.1f us\n", name,
+                r.crash_points, r.not_a_prefix, r.lost_commits, r.failed_recoveries, r.max_recovery_seconds*1e6);
+}
+
+// Recovery on disk: files each interrupted mid-append, found with
+// status_many and rolled back.
+static void recovery_bench(size_t files, size_t size) {
+    mk_dir("bench_recovery/");
+    std::vector<std::string> paths;
+    std::vector<byte> contents(size, 'd');
+    std::vector<byte> torn(100, 't');
+    for(size_t i=0; i<files; ++i) {
+        paths.push_back("bench_recovery/f" + std::to_string(i));
+        splatfile<byte>(paths.back(), contents);
+        sa::start(paths.back());
+        splatfile<byte>(paths.back(), torn, true);
+    }
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::vector<sa::status_value> status = sa::status_many(paths);
+    for(size_t i=0; i<files; ++i) {
+        if(status[i]==sa::hot) {
+            sa::rollback(paths[i]);
+        }
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count();
+    std::printf("recovery, %5zu files of %8zu bytes %8.2f ms\n", files, size, seconds*1e3);
+    rm_dir("bench_recovery/");
+}
+
+// One small append to each of many files, made durable either per file
+// (a data_sync transaction each) or once for the whole epoch.
+static void epoch_bench(size_t files) {
+    typedef sa::basic_appender<sa::sha512_checksum, sa::data_sync, sa::sibling_journal, sa::no_lock> appender;
+    mk_dir("bench_epoch/");
+    std::vector<std::string> paths;
+    std::vector<byte> record(64, 'r');
+    for(size_t i=0; i<files; ++i) {
+        paths.push_back("bench_epoch/s" + std::to_string(i));
+        splatfile<std::string>(paths.back(), "");
+    }
+    
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for(size_t i=0; i<files; ++i) {
+        appender::start(paths[i]);
+        splatfile<byte>(paths[i], record, true);
+        appender::commit(paths[i]);
+    }
+    double per_file = std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count();
+    
+    double epochs[2];
+    for(int b=0; b<2; ++b) {
+        sa::epoch_options opts;
+        opts.barrier = b==0 ? sa::epoch_options::syncfs_barrier : sa::epoch_options::per_file_barrier;
+        sa::epoch_journal journal("bench_epoch/epochs.jrn", opts);
+        start = std::chrono::steady_clock::now();
+        journal.touch(paths);
+        for(size_t i=0; i<files; ++i) {
+            splatfile<byte>(paths[i], record, true);
+        }
+        journal.close();
+        epochs[b] = std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count();
+    }
+    std::printf("epoch, %5zu files: per-file sync %8.2f ms, syncfs %8.2f ms, batched fdatasync %8.2f ms\n",
+                files, per_file*1e3, epochs[0]*1e3, epochs[1]*1e3);
+    rm_dir("bench_epoch/");
+}
+
+int main() {
+    byte_utils_bench();
+    lz_codec_bench();
+    transaction_bench<sa::memory_backend>("transaction (memory backend)", "bench.dat");
+    transaction_bench<sa::posix_backend>("transaction (posix backend, no sync)", "bench.dat");
+    transaction_bench<sa::cached_posix_backend>("transaction (cached fds, no sync)", "bench.dat");
+    crash_bench<sa::no_sync>("crash injection (no_sync)");
+    crash_bench<sa::data_sync>("crash injection (data_sync)");
+    crash_bench<sa::full_sync>("crash injection (full_sync)");
+    recovery_bench(1, 1<<20);
+    recovery_bench(100, 1<<20);
+    recovery_bench(1000, 1<<16);
+    recovery_bench(10, 1<<26);
+    epoch_bench(100);
+    epoch_bench(2000);
+    return 0;
+}
@@ -0,0 +1,124 @@
+//
+//  async_append.h
+//  safe-append-cpp
+//
+//  Awaitable start, append, commit and rollback for C++20 coroutines:
+//
+//      sa::io_pool pool(4);
+//      sa::async_appender appender(pool);
+//      if(co_await appender.start(path)) {
+//          bool written = co_await appender.append(path, bytes);
+//          co_await (written ? appender.commit(path) : appender.rollback(path));
+//      }
+//
+//  Each operation runs the synchronous call on an io_pool worker while the
+//  coroutine is suspended, so its own thread is free to run other
+//  coroutines. The coroutine resumes on the worker that did the I/O;
+//  schedule back onto your executor after co_await if that matters.
+//
+//  The synchronous API is unchanged, and without coroutine support (before
+//  C++20) this header only provides io_pool.
+//
+
+#ifndef safe_append_cpp_async_append_h
+#define safe_append_cpp_async_append_h
+
+#include "io_pool.h"
+
+#if defined(__cpp_impl_coroutine) && defined(__has_include)
+#  if __has_include(<coroutine>)
+#    define SA_HAS_COROUTINES 1
+#  endif
+#endif
+
+#ifdef SA_HAS_COROUTINES
+
+#include <coroutine>
+#include <functional>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "basic_appender.h"
+
+namespace sa {
+
+    // One blocking call, run on a pool worker when awaited. The result is
+    // what the call returned.
+    template<typename T>
+    class io_operation {
+    public:
+        io_operation(io_pool & pool, std::function<T()> work)
+            : m_pool(pool), m_work(std::move(work)), m_result() {}
+
+        bool await_ready() const noexcept { return false; }
+
+        void await_suspend(std::coroutine_handle<> caller) {
+            // Once submitted, the worker may resume (and so destroy) this
+            // object before submit returns: touch nothing afterwards.
+            m_pool.submit([this, caller]() {
+                m_result = m_work();
+                caller.resume();
+            });
+        }
+
+        T await_resume() { return std::move(m_result); }
+
+    private:
+        io_pool & m_pool;
+        std::function<T()> m_work;
+        T m_result;
+    };
+
+    // T_appender is a basic_appender instantiation.
+    template<typename T_appender>
+    class basic_async_appender {
+    public:
+        typedef typename T_appender::backend backend;
+
+        explicit basic_async_appender(io_pool & pool) : m_pool(pool) {}
+
+        io_operation<bool> start(std::string filepath) {
+            return io_operation<bool>(m_pool, [filepath]() { return T_appender::start(filepath); });
+        }
+
+        // Write bytes at the end of the file.
+        io_operation<bool> append(std::string filepath, std::vector<byte> bytes) {
+            return io_operation<bool>(m_pool, [filepath, bytes]() {
+                return append_now(filepath, bytes.data(), bytes.size());
+            });
+        }
+
+        io_operation<bool> commit(std::string filepath) {
+            return io_operation<bool>(m_pool, [filepath]() { return T_appender::commit(filepath); });
+        }
+
+        io_operation<bool> rollback(std::string filepath) {
+            return io_operation<bool>(m_pool, [filepath]() { return T_appender::rollback(filepath); });
+        }
+
+        io_operation<status_value> status(std::string filepath) {
+            return io_operation<status_value>(m_pool, [filepath]() { return T_appender::status(filepath); });
+        }
+
+    private:
+        static bool append_now(std::string const & filepath, byte const * bytes, size_t length) {
+            int fd = backend::open(filepath, O_WRONLY);
+            if(fd<0) {
+                return false;
+            }
+            uint64_t size = 0;
+            bool written = backend::size(fd, size) && backend::pwrite_all(fd, bytes, length, size);
+            SA_PROBE3(append, filepath.c_str(), current_transaction(filepath), length);
+            return backend::close(fd) && written;
+        }
+
+        io_pool & m_pool;
+    };
+
+    typedef basic_async_appender<default_appender> async_appender;
+}
+
+#endif
+
+#endif
@@ -0,0 +1,372 @@
+//
+//  basic_appender.h
+//  safe-append-cpp
+//
+//  The append engine, specialized at compile time. The checksum used for
+//  journals, how hard the engine syncs, where journals live, how
+//  cooperating writers are kept apart and the storage underneath are all
+//  template policies. So each configuration compiles down to just the calls
+//  it needs: no virtual calls, and no runtime branches on configuration.
+//
+//  sa::start, sa::commit and friends are default_appender, the
+//  instantiation that matches the library's original behavior and journal
+//  format.
+//
+
+#ifndef safe_append_cpp_basic_appender_h
+#define safe_append_cpp_basic_appender_h
+
+#include <array>
+#include <cerrno>
+#include <cstdint>
+#include <string>
+
+#include <fcntl.h>
+
+#include "safe_append.h"
+#include "safe_append_internals.h"
+#include "storage_backend.h"
+#include "probes.h"
+
+namespace sa {
+
+    // Checksum policies: the digest stored at the head of a journal.
+
+    struct sha512_checksum {
+        static constexpr size_t digest_size = SHA512::DIGEST_SIZE;
+        static void digest(byte const * data, size_t length, byte * out) {
+            sha512(data, length, out);
+        }
+    };
+
+    struct sha1_checksum {
+        static constexpr size_t digest_size = SHA1::DIGEST_SIZE;
+        static void digest(byte const * data, size_t length, byte * out) {
+            internal_sha1<byte>(data, length, out);
+        }
+    };
+
+    // Sync policies: what reaches stable storage before start and commit
+    // return. no_sync leaves it to the operating system (the original
+    // behavior). data_sync makes the journal, and its directory entry,
+    // durable before any data is appended, and the data durable before the
+    // journal's removal, itself made durable. It syncs files with
+    // fdatasync; full_sync uses fsync, which also flushes metadata such as
+    // timestamps.
+
+    struct no_sync {
+        static constexpr bool needs_data_fd = false;
+        template<typename B> static bool journal(int) { return true; }
+        template<typename B> static bool data(int) { return true; }
+        template<typename B> static bool directory(std::string const &) { return true; }
+    };
+
+    struct data_sync {
+        static constexpr bool needs_data_fd = true;
+        template<typename B> static bool journal(int fd) { return B::datasync(fd); }
+        template<typename B> static bool data(int fd) { return B::datasync(fd); }
+        template<typename B> static bool directory(std::string const & path) { return B::sync_directory(path); }
+    };
+
+    struct full_sync {
+        static constexpr bool needs_data_fd = true;
+        template<typename B> static bool journal(int fd) { return B::sync(fd); }
+        template<typename B> static bool data(int fd) { return B::sync(fd); }
+        template<typename B> static bool directory(std::string const & path) { return B::sync_directory(path); }
+    };
+
+    // Journal policies: where the journal lives and how wide the journaled
+    // length is. sibling_journal is the original j_<sha1>.jrn format, with a
+    // 32-bit length; sibling_journal64 lifts the 4 GiB limit.
+
+    struct sibling_journal {
+        static constexpr size_t length_size = 4;
+        static void name(std::string const & filepath, std::string & out_name) {
+            sidecar_name(filepath, "j_", ".jrn", out_name);
+        }
+    };
+
+    struct sibling_journal64 {
+        static constexpr size_t length_size = 8;
+        static void name(std::string const & filepath, std::string & out_name) {
+            sidecar_name(filepath, "j_", ".jr8", out_name);
+        }
+    };
+
+    // Lock policies: flock_lock holds an exclusive advisory lock on the data
+    // file while a journal is checked and created or removed, so cooperating
+    // writers cannot both start a transaction on the same file.
+
+    struct no_lock {
+        static constexpr bool needs_data_fd = false;
+        template<typename B> static bool lock(int) { return true; }
+        template<typename B> static void unlock(int) {}
+    };
+
+    struct flock_lock {
+        static constexpr bool needs_data_fd = true;
+        template<typename B> static bool lock(int fd) { return B::lock(fd); }
+        template<typename B> static void unlock(int fd) { B::unlock(fd); }
+    };
+
+    // T_backend is a storage backend from storage_backend.h.
+    template<typename T_checksum, typename T_sync, typename T_journal, typename T_lock,
+             typename T_backend=posix_backend>
+    class basic_appender {
+        static_assert(!T_lock::needs_data_fd || !T_backend::shares_descriptors,
+                      "a lock on a shared descriptor does not exclude other threads");
+        
+    public:
+        typedef T_backend backend;
+        
+        // A journal is the digest of the record followed by the record,
+        // which is the big-endian length of the data file at start.
+        static constexpr size_t record_size = T_journal::length_size;
+        static constexpr size_t journal_size = T_checksum::digest_size + record_size;
+        static constexpr uint64_t max_length = (record_size>=8) ? UINT64_MAX : ((uint64_t)1<<(8*record_size))-1;
+
+        static status_value status(std::string const & filepath) {
+            long unused;
+            return status(filepath, unused);
+        }
+
+        // out_length is the journaled length if the journal is hot, else -1.
+        static status_value status(std::string const & filepath, long & out_length) {
+            std::string & jname = name_buffer();
+            T_journal::name(filepath, jname);
+            return read_journal(jname, out_length);
+        }
+
+        static bool start(std::string const & filepath) {
+            uint64_t seq = begin_transaction(filepath);
+            SA_PROBE2(start_begin, filepath.c_str(), seq);
+            bool ok = start_journal(filepath, seq);
+            if(ok && !T_backend::hold(filepath)) {
+                // Nothing was appended yet: undo the start.
+                delete_journal(filepath);
+                ok = false;
+            }
+            SA_PROBE3(start_end, filepath.c_str(), seq, ok);
+            if(!ok) {
+                end_transaction(filepath);
+            }
+            return ok;
+        }
+
+        static bool commit(std::string const & filepath) {
+            uint64_t seq = current_transaction(filepath);
+            SA_PROBE2(commit_begin, filepath.c_str(), seq);
+            bool ok = commit_journal(filepath, seq);
+            SA_PROBE3(commit_end, filepath.c_str(), seq, ok);
+            if(ok) {
+                end_transaction(filepath);
+                T_backend::release(filepath);
+            }
+            return ok;
+        }
+
+        static bool cleanup(std::string const & filepath) {
+            std::string & jname = name_buffer();
+            T_journal::name(filepath, jname);
+            long unused;
+            bool ok = read_journal(jname, unused)==dirty && remove_journal(jname);
+            SA_PROBE3(cleanup, filepath.c_str(), current_transaction(filepath), ok);
+            if(ok) {
+                end_transaction(filepath);
+                T_backend::release(filepath);
+            }
+            return ok;
+        }
+
+        static bool rollback(std::string const & filepath) {
+            uint64_t seq = current_transaction(filepath);
+            long valid_length = -1;
+            SA_PROBE2(rollback_begin, filepath.c_str(), seq);
+            bool ok = rollback_journal(filepath, valid_length, seq);
+            SA_PROBE4(rollback_end, filepath.c_str(), seq, valid_length, ok);
+            if(ok) {
+                end_transaction(filepath);
+                T_backend::release(filepath);
+            }
+            return ok;
+        }
+
+        // Write (or overwrite) the journal for the file's current length,
+        // without checking for an existing transaction.
+        static bool create_journal(std::string const & filepath) {
+            std::string & jname = name_buffer();
+            T_journal::name(filepath, jname);
+            uint64_t seq = begin_transaction(filepath);
+            data_file f(filepath, O_RDONLY);
+            return f.ok() && write_journal(f, jname, seq) && T_backend::hold(filepath);
+        }
+
+        // Remove the journal, if any, without checking its state.
+        static bool delete_journal(std::string const & filepath) {
+            end_transaction(filepath);
+            T_backend::release(filepath);
+            std::string & jname = name_buffer();
+            T_journal::name(filepath, jname);
+            if(!T_backend::exists(jname)) return true;
+            return remove_journal(jname);
+        }
+
+    private:
+        static bool start_journal(std::string const & filepath, uint64_t seq) {
+            std::string & jname = name_buffer();
+            T_journal::name(filepath, jname);
+            data_file f(filepath, O_RDONLY);
+            if(!f.ok()) return false;
+            long unused;
+            if(read_journal(jname, unused)!=clean) {
+                return false;
+            }
+            return write_journal(f, jname, seq);
+        }
+
+        static bool commit_journal(std::string const & filepath, uint64_t seq) {
+            std::string & jname = name_buffer();
+            T_journal::name(filepath, jname);
+            data_file f(filepath, O_RDONLY);
+            if(!f.ok()) return false;
+            long unused;
+            if(read_journal(jname, unused)!=hot || !sync_data(f, seq)) {
+                return false;
+            }
+            return remove_journal(jname);
+        }
+
+        static bool rollback_journal(std::string const & filepath, long & valid_length, uint64_t seq) {
+            std::string & jname = name_buffer();
+            T_journal::name(filepath, jname);
+            data_file f(filepath, O_RDWR, true);
+            if(!f.ok()) return false;
+            if(read_journal(jname, valid_length)!=hot || valid_length<0) {
+                return false;
+            }
+            uint64_t size = 0;
+            if(!T_backend::size(f.fd, size) || (uint64_t)valid_length>=size) {
+                // Do not touch file. We do not want to expand the already bad data!
+                // Valid length should have been less than the current length.
+                return false;
+            }
+            if(!T_backend::truncate(f.fd, valid_length) || !sync_data(f, seq)) {
+                return false;
+            }
+            return remove_journal(jname);
+        }
+
+        static constexpr bool needs_data_fd = T_sync::needs_data_fd || T_lock::needs_data_fd;
+
+        // The data file, opened (and locked) only if a policy needs it.
+        struct data_file {
+            data_file(std::string const & filepath, int flags, bool always_open=false)
+                : path(filepath), fd(-1), required(needs_data_fd || always_open), locked(false) {
+                if(required) {
+                    fd = T_backend::open(filepath, flags);
+                    locked = (fd>=0) && T_lock::template lock<T_backend>(fd);
+                }
+            }
+            ~data_file() {
+                if(fd>=0) {
+                    if(locked) T_lock::template unlock<T_backend>(fd);
+                    T_backend::close(fd);
+                }
+            }
+            bool ok() const { return !required || locked; }
+            long length() const {
+                if(fd<0) return T_backend::length(path);
+                uint64_t size = 0;
+                return T_backend::size(fd, size) ? (long)size : -1;
+            }
+
+            std::string const & path;
+            int fd;
+            bool required;
+            bool locked;
+        };
+
+        static std::string & name_buffer() {
+            static thread_local std::string buf;
+            return buf;
+        }
+
+        // seq is the transaction's number for the probes.
+        static bool sync_data(data_file const & f, uint64_t seq) {
+            SA_PROBE2(sync_begin, f.path.c_str(), seq);
+            bool ok = T_sync::template data<T_backend>(f.fd);
+            SA_PROBE3(sync_end, f.path.c_str(), seq, ok);
+            return ok;
+        }
+
+        static bool write_journal(data_file const & f, std::string const & jname, uint64_t seq) {
+            long curlen = f.length();
+            SA_PROBE2(journal_begin, f.path.c_str(), seq);
+            bool success = curlen>=0 && (uint64_t)curlen<=max_length && write_journal(f, jname, (uint64_t)curlen, seq);
+            SA_PROBE4(journal_end, f.path.c_str(), seq, curlen, success);
+            return success;
+        }
+
+        static bool write_journal(data_file const & f, std::string const & jname, uint64_t curlen, uint64_t seq) {
+            std::array<byte, journal_size> journal;
+            byte * record = journal.data()+T_checksum::digest_size;
+            for(size_t i=0; i<record_size; ++i) {
+                record[record_size-1-i] = (byte)(curlen>>(8*i));
+            }
+            SA_PROBE3(checksum, f.path.c_str(), seq, record_size);
+            T_checksum::digest(record, record_size, journal.data());
+
+            int fd = T_backend::open(jname, O_WRONLY | O_CREAT | O_TRUNC);
+            if(fd<0) {
+                return false;
+            }
+            SA_PROBE2(sync_begin, f.path.c_str(), seq);
+            bool success = T_backend::pwrite_all(fd, journal.data(), journal.size(), 0)
+                           && T_sync::template journal<T_backend>(fd);
+            success = T_backend::close(fd) && success && T_sync::template directory<T_backend>(jname);
+            SA_PROBE3(sync_end, f.path.c_str(), seq, success);
+            return success;
+        }
+
+        static status_value read_journal(std::string const & jname, long & out_length) {
+            out_length = -1;
+            int fd = T_backend::open(jname, O_RDONLY);
+            if(fd<0) {
+                return (errno==ENOENT) ? clean : dirty;
+            }
+            std::array<byte, journal_size> journal;
+            uint64_t size = 0;
+            bool read = T_backend::size(fd, size) && size==journal_size
+                        && T_backend::pread_all(fd, journal.data(), journal.size(), 0);
+            T_backend::close(fd);
+            if(!read) {
+                return dirty;
+            }
+
+            byte const * record = journal.data()+T_checksum::digest_size;
+            std::array<byte, T_checksum::digest_size> computed;
+            T_checksum::digest(record, record_size, computed.data());
+            if(!std::equal(computed.begin(), computed.end(), journal.begin())) {
+                return dirty;
+            }
+            uint64_t length = 0;
+            for(size_t i=0; i<record_size; ++i) {
+                length = (length<<8) | record[i];
+            }
+            out_length = (long)length;
+            return hot;
+        }
+
+        static bool remove_journal(std::string const & jname) {
+            return T_backend::unlink(jname) && T_sync::template directory<T_backend>(jname);
+        }
+    };
+
+    template<typename C, typename S, typename J, typename L, typename B> constexpr size_t basic_appender<C, S, J, L, B>::record_size;
+    template<typename C, typename S, typename J, typename L, typename B> constexpr size_t basic_appender<C, S, J, L, B>::journal_size;
+    template<typename C, typename S, typename J, typename L, typename B> constexpr uint64_t basic_appender<C, S, J, L, B>::max_length;
+
+    typedef basic_appender<sha512_checksum, no_sync, sibling_journal, no_lock> default_appender;
+}
+
+#endif
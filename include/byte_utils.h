@@ -9,8 +9,50 @@
 #ifndef safe_append_cpp_byte_utils_h
 #define safe_append_cpp_byte_utils_h
 
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <string>
+#include <type_traits>
+#include <vector>
+#include <algorithm>
+#include <cstring>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__SSSE3__)
+#include <tmmintrin.h>
+#endif
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 typedef unsigned char byte;
 
+/**
+ * A non-owning view of a contiguous run of bytes.
+ */
+
+struct byte_span {
+    typedef byte const * iterator;
+    typedef byte const * const_iterator;
+    
+    byte_span() : m_data(nullptr), m_size(0) {}
+    byte_span(byte const * data, size_t size) : m_data(data), m_size(size) {}
+    
+    byte const * data() const { return m_data; }
+    size_t size() const { return m_size; }
+    bool empty() const { return m_size==0; }
+    iterator begin() const { return m_data; }
+    iterator end() const { return m_data+m_size; }
+    byte operator[](size_t i) const { return m_data[i]; }
+    
+private:
+    byte const * m_data;
+    size_t m_size;
+};
+
 template<typename T_iter>
 inline uint32_t extract_little_endian(T_iter & data) {
     static_assert(std::is_same<typename std::iterator_traits<T_iter>::iterator_category,
@@ -27,6 +69,12 @@ inline uint32_t extract_big_endian(T_iter & data) {
     return (data[3]<<0) | (data[2]<<8) | (data[1]<<16) | (data[0]<<24);
 }
 
+template<typename T_iter>
+inline uint64_t extract_big_endian64(T_iter & data) {
+    T_iter lo = data+4;
+    return ((uint64_t)extract_big_endian(data)<<32) | extract_big_endian(lo);
+}
+
 template<typename T_iter>
 inline void encode_little_endian(T_iter const & data, uint32_t value) {
     static_assert(std::is_same<typename std::iterator_traits<T_iter>::iterator_category,
@@ -49,6 +97,77 @@ inline void encode_big_endian(T_iter const & data, uint32_t value) {
     data[3]=(byte)((0x000000FF&value)>>0);
 }
 
+template<typename T_iter>
+inline void encode_big_endian64(T_iter const & data, uint64_t value) {
+    encode_big_endian(data, (uint32_t)(value>>32));
+    encode_big_endian(data+4, (uint32_t)value);
+}
+
+
+// Bulk conversion between arrays of native integers and big-endian bytes,
+// for record encoders that convert whole arrays of samples per append.
+// Converting in either direction is a per-element byte swap on little-endian
+// hosts (a plain copy on big-endian ones); it runs 16 bytes at a time with
+// pshufb (SSSE3) or rev (NEON) when the compiler targets them.
+
+template<size_t N>
+inline void swap_bytes_array(byte const * in, byte * out, size_t count) {
+    static_assert(N==2 || N==4 || N==8, "element size must be 2, 4 or 8 bytes");
+    size_t bytes = count*N;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__==__ORDER_BIG_ENDIAN__
+    std::memmove(out, in, bytes);
+#else
+    size_t i = 0;
+#if defined(__SSSE3__)
+    const __m128i mask = (N==2) ? _mm_setr_epi8(1,0,3,2,5,4,7,6,9,8,11,10,13,12,15,14)
+                       : (N==4) ? _mm_setr_epi8(3,2,1,0,7,6,5,4,11,10,9,8,15,14,13,12)
+                       :          _mm_setr_epi8(7,6,5,4,3,2,1,0,15,14,13,12,11,10,9,8);
+    for(; i+16<=bytes; i+=16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<__m128i const *>(in+i));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out+i), _mm_shuffle_epi8(v, mask));
+    }
+#elif defined(__ARM_NEON)
+    for(; i+16<=bytes; i+=16) {
+        uint8x16_t v = vld1q_u8(in+i);
+        v = (N==2) ? vrev16q_u8(v) : (N==4) ? vrev32q_u8(v) : vrev64q_u8(v);
+        vst1q_u8(out+i, v);
+    }
+#endif
+    for(; i<bytes; i+=N) {
+        if(N==2) {
+            uint16_t v;
+            std::memcpy(&v, in+i, 2);
+            v = __builtin_bswap16(v);
+            std::memcpy(out+i, &v, 2);
+        } else if(N==4) {
+            uint32_t v;
+            std::memcpy(&v, in+i, 4);
+            v = __builtin_bswap32(v);
+            std::memcpy(out+i, &v, 4);
+        } else {
+            uint64_t v;
+            std::memcpy(&v, in+i, 8);
+            v = __builtin_bswap64(v);
+            std::memcpy(out+i, &v, 8);
+        }
+    }
+#endif
+}
+
+// out must have room for count*sizeof(T) bytes.
+template<typename T>
+inline void encode_big_endian_array(T const * values, size_t count, byte * out) {
+    static_assert(std::is_integral<T>::value, "values must be integers");
+    swap_bytes_array<sizeof(T)>(reinterpret_cast<byte const *>(values), out, count);
+}
+
+// in must hold count*sizeof(T) bytes.
+template<typename T>
+inline void extract_big_endian_array(byte const * in, size_t count, T * values) {
+    static_assert(std::is_integral<T>::value, "values must be integers");
+    swap_bytes_array<sizeof(T)>(in, reinterpret_cast<byte *>(values), count);
+}
+
 inline char nibble_to_hex(byte b) {
     b&=0x0F;
     return (b<10) ? ('0'+b) : ('a'+(b-10));
@@ -98,6 +217,126 @@ inline std::vector<byte> hex_to_bytes(std::string const & str) {
     return bv;
 }
 
+/**
+ * True if every byte in [data, data+length) is zero. Used to spot blocks
+ * that were allocated but never written, so it is vectorized where SSE2 is
+ * available and otherwise works a word at a time.
+ */
+
+inline bool all_zero(byte const * data, size_t length) {
+    size_t i = 0;
+#if defined(__SSE2__)
+    __m128i acc = _mm_setzero_si128();
+    for(; i+64<=length; i+=64) {
+        __m128i a = _mm_or_si128(_mm_loadu_si128(reinterpret_cast<__m128i const *>(data+i)),
+                                 _mm_loadu_si128(reinterpret_cast<__m128i const *>(data+i+16)));
+        __m128i b = _mm_or_si128(_mm_loadu_si128(reinterpret_cast<__m128i const *>(data+i+32)),
+                                 _mm_loadu_si128(reinterpret_cast<__m128i const *>(data+i+48)));
+        acc = _mm_or_si128(acc, _mm_or_si128(a, b));
+        if(_mm_movemask_epi8(_mm_cmpeq_epi8(acc, _mm_setzero_si128()))!=0xFFFF) {
+            return false;
+        }
+    }
+#endif
+    uint64_t word_acc = 0;
+    for(; i+8<=length; i+=8) {
+        uint64_t w;
+        std::memcpy(&w, data+i, sizeof(w));
+        word_acc |= w;
+    }
+    for(; i<length; ++i) {
+        word_acc |= data[i];
+    }
+    return word_acc==0;
+}
+
+/**
+ * Write the lowercase hex form of length bytes to out, which must have room
+ * for 2*length chars. Sixteen bytes at a time with SSE2.
+ */
+
+inline void bytes_to_hex(byte const * in, size_t length, char * out) {
+    size_t i = 0;
+#if defined(__SSE2__)
+    const __m128i low_mask = _mm_set1_epi8(0x0F);
+    const __m128i nine = _mm_set1_epi8(9);
+    const __m128i zero_char = _mm_set1_epi8('0');
+    const __m128i letter_gap = _mm_set1_epi8('a'-'0'-10);
+    for(; i+16<=length; i+=16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<__m128i const *>(in+i));
+        __m128i hi = _mm_and_si128(_mm_srli_epi16(v, 4), low_mask);
+        __m128i lo = _mm_and_si128(v, low_mask);
+        hi = _mm_add_epi8(_mm_add_epi8(hi, zero_char), _mm_and_si128(_mm_cmpgt_epi8(hi, nine), letter_gap));
+        lo = _mm_add_epi8(_mm_add_epi8(lo, zero_char), _mm_and_si128(_mm_cmpgt_epi8(lo, nine), letter_gap));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out+2*i), _mm_unpacklo_epi8(hi, lo));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out+2*i+16), _mm_unpackhi_epi8(hi, lo));
+    }
+#endif
+    for(; i<length; ++i) {
+        out[2*i] = hinibble(in[i]);
+        out[2*i+1] = lonibble(in[i]);
+    }
+}
+
+inline int hex_value(char c) {
+    if('0' <= c && c <= '9') {
+        return (c-'0');
+    } else if('a' <= c && c <= 'f') {
+        return (c-'a')+10;
+    } else if('A' <= c && c <= 'F') {
+        return (c-'A')+10;
+    } else {
+        return -1;
+    }
+}
+
+/**
+ * Decode length hex chars (upper or lower case) into length/2 bytes at out.
+ * Unlike the string form above, malformed input is reported: returns false
+ * for an odd length or any non-hex char.
+ */
+
+inline bool hex_to_bytes(char const * in, size_t length, byte * out) {
+    if(length%2!=0) {
+        return false;
+    }
+    size_t i = 0;
+#if defined(__SSE2__)
+    const __m128i case_bit = _mm_set1_epi8(0x20);
+    const __m128i below_0 = _mm_set1_epi8('0'-1);
+    const __m128i above_9 = _mm_set1_epi8('9'+1);
+    const __m128i below_a = _mm_set1_epi8('a'-1);
+    const __m128i above_f = _mm_set1_epi8('f'+1);
+    const __m128i low_byte = _mm_set1_epi16(0x00FF);
+    for(; i+16<=length; i+=16) {
+        __m128i c = _mm_loadu_si128(reinterpret_cast<__m128i const *>(in+i));
+        __m128i is_digit = _mm_and_si128(_mm_cmpgt_epi8(c, below_0), _mm_cmplt_epi8(c, above_9));
+        __m128i lc = _mm_or_si128(c, case_bit);
+        __m128i is_letter = _mm_and_si128(_mm_cmpgt_epi8(lc, below_a), _mm_cmplt_epi8(lc, above_f));
+        if(_mm_movemask_epi8(_mm_or_si128(is_digit, is_letter))!=0xFFFF) {
+            return false;
+        }
+        __m128i digits = _mm_and_si128(is_digit, _mm_sub_epi8(c, _mm_set1_epi8('0')));
+        __m128i letters = _mm_and_si128(is_letter, _mm_sub_epi8(lc, _mm_set1_epi8('a'-10)));
+        __m128i nibbles = _mm_or_si128(digits, letters);
+        // Each 16-bit lane holds (high nibble, low nibble) in memory order.
+        __m128i pairs = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(nibbles, low_byte), 4),
+                                     _mm_srli_epi16(nibbles, 8));
+        __m128i packed = _mm_packus_epi16(pairs, pairs);
+        _mm_storel_epi64(reinterpret_cast<__m128i *>(out+i/2), packed);
+    }
+#endif
+    for(; i<length; i+=2) {
+        int hi = hex_value(in[i]);
+        int lo = hex_value(in[i+1]);
+        if(hi<0 || lo<0) {
+            return false;
+        }
+        out[i/2] = (byte)((hi<<4) | lo);
+    }
+    return true;
+}
+
 template<typename T_cont, typename U_cont>
 inline bool bytes_equal(T_cont const & b1, U_cont const & b2) {
     static_assert(std::is_same<typename std::iterator_traits<typename T_cont::iterator>::iterator_category,
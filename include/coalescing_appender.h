@@ -0,0 +1,102 @@
+//
+//  coalescing_appender.h
+//  safe-append-cpp
+//
+//  A bounded write-behind buffer in front of a safe-append session. Small
+//  records are gathered in memory and flushed as one journaled transaction
+//  (sa::start, a single write, sa::commit) when the buffer passes a size
+//  threshold, when the oldest buffered record reaches a time deadline, or on
+//  an explicit flush. Each flush is all-or-nothing: a crash or failed write
+//  during a flush rolls back to the previous flush.
+//
+//  When the buffer is full, try_append reports it instead of growing, and
+//  append waits for the background flush to make room.
+//
+
+#ifndef safe_append_cpp_coalescing_appender_h
+#define safe_append_cpp_coalescing_appender_h
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "byte_utils.h"
+
+namespace sa {
+    
+    class coalescing_appender {
+    public:
+        struct options {
+            options() : capacity(1024*1024), flush_threshold(256*1024), max_delay(100), sync(true) {}
+            
+            size_t capacity;                     // most bytes buffered before back-pressure
+            size_t flush_threshold;              // flush once this many bytes are buffered
+            std::chrono::milliseconds max_delay; // flush once the oldest record is this old
+            bool sync;                           // fdatasync the data before each commit
+        };
+        
+        enum append_result {
+            accepted,
+            full,      // no room right now; retry after a flush
+            too_large  // the record can never fit in the buffer
+        };
+        
+        explicit coalescing_appender(std::string const & filepath, options const & opts=options());
+        // Calls close(), dropping its result.
+        ~coalescing_appender();
+        
+        // Stop the background flusher and flush what is left. False if the
+        // last records could not be committed; they stay buffered, and
+        // flush() may be retried.
+        bool close();
+        
+        // Buffer a record without blocking.
+        append_result try_append(byte const * data, size_t length);
+        
+        // Buffer a record, waiting up to timeout for room. False on timeout
+        // or if the record is larger than the buffer.
+        bool append(byte const * data, size_t length, std::chrono::milliseconds timeout);
+        
+        // Flush everything buffered so far and wait for it to commit.
+        bool flush();
+        
+        size_t buffered() const;
+        uint64_t flush_count() const;
+        uint64_t failed_flush_count() const;
+        
+    private:
+        coalescing_appender(coalescing_appender const &);
+        coalescing_appender & operator=(coalescing_appender const &);
+        
+        bool flush_once();
+        bool undo();
+        bool write_batch(std::vector<byte> const & batch);
+        void run();
+        
+        std::string m_filepath;
+        options m_options;
+        
+        mutable std::mutex m_mutex;
+        std::condition_variable m_work;
+        std::condition_variable m_space;
+        std::vector<byte> m_active;   // records accepted since the last swap
+        std::chrono::steady_clock::time_point m_oldest;
+        bool m_flush_requested;
+        bool m_stop;
+        uint64_t m_flushes;
+        uint64_t m_failed_flushes;
+        
+        // Serializes flushes, so batches reach the file in the order they
+        // were accepted. m_flushing is only touched while holding it.
+        std::mutex m_io_mutex;
+        std::vector<byte> m_flushing;
+        
+        std::thread m_thread;
+    };
+}
+
+#endif
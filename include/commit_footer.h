@@ -0,0 +1,71 @@
+//
+//  commit_footer.h
+//  safe-append-cpp
+//
+//  Journal-less commits. Instead of a journal file per transaction, each
+//  commit appends a small footer directly after its data in the data file:
+//
+//      magic "SAFOOTR1" | data begin (8) | data end (8) | sequence (8) |
+//      digest of [data begin, data end) (32) | digest of the above (16)
+//
+//  so a commit is one sequential write and one sync, with no metadata
+//  operations on other files. Recovery scans backwards from the end of the
+//  file to the last footer whose data is intact and truncates after it.
+//
+//  The process remembers where each file's last footer ends, so a commit
+//  checks only that footer's framing instead of re-hashing its data; the
+//  first commit to a file in a process finds and verifies it once. A commit
+//  never seals bytes it did not write: if anything follows the last footer
+//  (say, a torn append left by a crash), footer_append and footer_start
+//  refuse until footer_recover has dropped it. A file enters footer mode
+//  empty.
+//
+//  A file is either in footer mode or journal mode; do not mix sa::start and
+//  sa::commit with the functions below on the same file. Readers of a file
+//  in footer mode must skip the footers (see footer_ranges).
+//
+
+#ifndef safe_append_cpp_commit_footer_h
+#define safe_append_cpp_commit_footer_h
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "byte_utils.h"
+
+namespace sa {
+    
+    const size_t footer_size = 80;
+    
+    struct footer_info {
+        uint64_t data_begin; // first byte of the data sealed by this footer
+        uint64_t data_end;   // one past the last byte; the footer starts here
+        uint64_t sequence;   // 1 for the first commit, then increasing by one
+    };
+    
+    // Append bytes and a footer sealing them (along with anything appended
+    // since the last footer) in a single write.
+    bool footer_append(std::string const & filepath, byte const * bytes, size_t length, bool sync=true);
+    bool footer_append(std::string const & filepath, std::vector<byte> const & bytes, bool sync=true);
+    
+    // Write data by hand between footer_start and footer_commit; the commit
+    // seals everything appended since the start. footer_start fails if
+    // anything already follows the last footer.
+    bool footer_start(std::string const & filepath);
+    bool footer_commit(std::string const & filepath, bool sync=true);
+    
+    // The last footer whose sealed data is intact. False if there is none.
+    bool last_footer(std::string const & filepath, footer_info & out_footer);
+    
+    // Truncate the file after its last intact footer, which also abandons a
+    // footer_start. A file that ends in an intact footer is left alone; a
+    // file with no footer at all is not touched and false is returned.
+    bool footer_recover(std::string const & filepath);
+    
+    // The committed data ranges, oldest first, following the chain of
+    // footers back from the last intact one.
+    bool footer_ranges(std::string const & filepath, std::vector<footer_info> & out_ranges);
+}
+
+#endif
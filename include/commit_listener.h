@@ -0,0 +1,47 @@
+//
+//  commit_listener.h
+//  safe-append-cpp
+//
+//  In-process hooks on finished transactions. After sa::commit or
+//  sa::rollback succeeds, every registered listener is called with the
+//  file path as the caller spelled it and the file's new length. With no
+//  listeners registered, the hooks cost one atomic load per transaction.
+//  safe_modify's commit and rollback notify too, with the first byte they
+//  changed in place, so that listeners can resend that range.
+//
+//  Listeners run on the committing thread and must not add or remove
+//  listeners themselves.
+//
+
+#ifndef safe_append_cpp_commit_listener_h
+#define safe_append_cpp_commit_listener_h
+
+#include <cstdint>
+#include <functional>
+#include <string>
+
+namespace sa {
+    
+    enum commit_event_kind {
+        committed,
+        rolled_back
+    };
+    
+    struct commit_event {
+        commit_event_kind kind;
+        std::string const & filepath;
+        uint64_t length; // of the data file once the transaction finished
+        uint64_t rewritten_from; // first byte changed in place; UINT64_MAX if none
+    };
+    
+    typedef std::function<void(commit_event const &)> commit_listener;
+    
+    // Returns an id for remove_commit_listener.
+    uint64_t add_commit_listener(commit_listener listener);
+    void remove_commit_listener(uint64_t id);
+    
+    void notify_commit_listeners(commit_event_kind kind, std::string const & filepath,
+                                 uint64_t rewritten_from=UINT64_MAX);
+}
+
+#endif
@@ -0,0 +1,73 @@
+//
+//  committed_length.h
+//  safe-append-cpp
+//
+//  Publishes a file's committed length to readers in other threads and
+//  processes. flen counts bytes appended by a transaction in progress, and
+//  only the writer can interpret its journal. A length_publisher instead
+//  keeps the committed length in a small sidecar, c_<sha1>.len, that both
+//  sides map shared. Every sa::commit and sa::rollback in the publishing
+//  process updates it with one atomic store and wakes waiting readers with
+//  a futex (readers poll once a millisecond where futexes are unavailable).
+//
+//  Readers that stop at the published length never see a torn tail, and
+//  need no stat calls or journal reads to follow the file.
+//
+//  Commits are matched to a publisher by path, exactly as the caller
+//  spells it. The sidecar is left in place when the publisher goes away,
+//  holding the last length it published.
+//
+
+#ifndef safe_append_cpp_committed_length_h
+#define safe_append_cpp_committed_length_h
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+namespace sa {
+    
+    struct published_length;
+    
+    class length_publisher {
+    public:
+        // Creates (or reopens) the sidecar and publishes the current
+        // committed length: the journaled length if a transaction is in
+        // progress, else the file length.
+        explicit length_publisher(std::string const & filepath);
+        ~length_publisher();
+        
+        bool ok() const { return m_table!=nullptr; }
+        void publish(uint64_t length);
+        
+    private:
+        length_publisher(length_publisher const &);
+        length_publisher & operator=(length_publisher const &);
+        
+        std::string m_filepath;
+        published_length * m_table;
+        uint64_t m_listener;
+    };
+    
+    class committed_length_reader {
+    public:
+        // ok() is false if nothing has published a length for the file.
+        explicit committed_length_reader(std::string const & filepath);
+        ~committed_length_reader();
+        
+        bool ok() const { return m_table!=nullptr; }
+        uint64_t committed() const;
+        
+        // Wait until the committed length exceeds `known`, or until the
+        // timeout passes. Returns the committed length either way.
+        uint64_t wait_for_growth(uint64_t known, std::chrono::milliseconds timeout) const;
+        
+    private:
+        committed_length_reader(committed_length_reader const &);
+        committed_length_reader & operator=(committed_length_reader const &);
+        
+        published_length * m_table;
+    };
+}
+
+#endif
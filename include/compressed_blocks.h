@@ -0,0 +1,71 @@
+//
+//  compressed_blocks.h
+//  safe-append-cpp
+//
+//  An optional compression stage for appends. A batch is split into blocks
+//  of at most block_size bytes, each compressed with lz_codec and written
+//  as a self-delimiting frame:
+//
+//      magic "SALZ" | codec (1) | reserved (3) | raw length (4) |
+//      stored length (4) | check (8) | stored bytes
+//
+//  The codec is 0 for blocks stored as-is (when compression would not
+//  shrink them) and 1 for lz blocks. The check is the first 8 bytes of the
+//  sha512 of the first 16 header bytes and the stored bytes. Integers are
+//  big-endian.
+//
+//  compressed_append runs the whole batch as one sa::start/sa::commit
+//  transaction. The journal holds the file length before the batch, which
+//  is always a frame boundary, so sa::rollback never leaves half a frame.
+//
+
+#ifndef safe_append_cpp_compressed_blocks_h
+#define safe_append_cpp_compressed_blocks_h
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "byte_utils.h"
+
+namespace sa {
+    
+    const size_t compressed_frame_header_size = 24;
+    const uint32_t default_compressed_block_size = 64*1024;
+    // Larger blocks are refused when writing, and treated as corrupt when
+    // reading, so a bad header cannot force a huge allocation.
+    const uint32_t max_compressed_block_size = 4*1024*1024;
+    
+    struct compressed_block {
+        uint64_t offset;        // of the frame in the file
+        uint64_t raw_offset;    // of the block in the uncompressed stream
+        uint32_t raw_length;
+        uint32_t stored_length;
+    };
+    
+    // Append frames for bytes at the current end of the file. The caller is
+    // responsible for the transaction (sa::start before, sa::commit after).
+    bool write_compressed_blocks(std::string const & filepath, byte const * bytes, size_t length,
+                                 uint32_t block_size=default_compressed_block_size, unsigned threads=1);
+    
+    // Append bytes as compressed frames in one journaled transaction,
+    // rolling back if the write fails.
+    bool compressed_append(std::string const & filepath, byte const * bytes, size_t length,
+                           uint32_t block_size=default_compressed_block_size, unsigned threads=1);
+    bool compressed_append(std::string const & filepath, std::vector<byte> const & bytes,
+                           uint32_t block_size=default_compressed_block_size, unsigned threads=1);
+    
+    // Walk the frame headers. False if the file does not consist of whole
+    // frames; out_blocks then holds the frames before the first bad one.
+    bool index_compressed_blocks(std::string const & filepath, std::vector<compressed_block> & out_blocks);
+    
+    // Decompress the whole file, verifying and decoding blocks in parallel.
+    bool read_compressed_file(std::string const & filepath, std::vector<byte> & out_contents, unsigned threads=0);
+    
+    // Decompress only the blocks overlapping [raw_offset, raw_offset+length)
+    // of the uncompressed stream. The range is clipped to the stream.
+    bool read_compressed_range(std::string const & filepath, uint64_t raw_offset, uint64_t length,
+                               std::vector<byte> & out_contents, unsigned threads=0);
+}
+
+#endif
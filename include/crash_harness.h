@@ -0,0 +1,118 @@
+//
+//  crash_harness.h
+//  safe-append-cpp
+//
+//  Power-loss testing for an appender running on memory_backend. The
+//  harness replays a workload of appends, each a start, write and commit,
+//  once per operation, and cuts power right before that operation. It then
+//  recovers the file the way an application would on restart, and checks
+//  two things. First, the file must equal the initial contents plus some
+//  whole number of appends. Second, no append whose commit returned true
+//  may be missing. Recovery is timed as well.
+//
+//  How much survives depends on the appender's sync policy: with no_sync,
+//  journals are not guaranteed to outlive a power loss, and the harness
+//  shows it.
+//
+
+#ifndef safe_append_cpp_crash_harness_h
+#define safe_append_cpp_crash_harness_h
+
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include <fcntl.h>
+
+#include "basic_appender.h"
+#include "storage_backend.h"
+
+namespace sa {
+    
+    struct crash_report {
+        size_t crash_points;           // operations at which power was cut
+        size_t not_a_prefix;           // recoveries that left anything but whole appends
+        size_t lost_commits;           // recoveries missing an acknowledged append
+        size_t failed_recoveries;      // recoveries that could not finish
+        double total_recovery_seconds;
+        double max_recovery_seconds;
+    };
+    
+    // What an application does on restart: roll back a hot journal, and drop
+    // one that is dirty (never completely written, so no data followed it)
+    // or that has nothing to roll back.
+    template<typename T_appender>
+    bool recover_after_crash(std::string const & filepath) {
+        long journaled = -1;
+        switch(T_appender::status(filepath, journaled)) {
+            case clean:
+                return true;
+            case dirty:
+                return T_appender::delete_journal(filepath);
+            case hot:
+                return T_appender::rollback(filepath) || T_appender::delete_journal(filepath);
+        }
+        return false;
+    }
+    
+    template<typename T_appender>
+    crash_report crash_every_operation(std::string const & filepath, std::vector<byte> const & initial,
+                                       std::vector<std::vector<byte>> const & appends, double keep_unsynced=0.5) {
+        typedef typename T_appender::backend mem;
+        static_assert(std::is_same<mem, memory_backend>::value, "the crash harness needs memory_backend");
+        
+        crash_report report = { 0, 0, 0, 0, 0.0, 0.0 };
+        for(uint64_t crash_at=0; ; ++crash_at) {
+            mem::reset();
+            mem::write_file(filepath, initial.data(), initial.size());
+            mem::crash_after(crash_at);
+            
+            size_t acknowledged = 0;
+            for(std::vector<byte> const & a : appends) {
+                if(!T_appender::start(filepath)) break;
+                int fd = mem::open(filepath, O_WRONLY);
+                uint64_t size = 0;
+                bool written = fd>=0 && mem::size(fd, size) && mem::pwrite_all(fd, a.data(), a.size(), size);
+                written = fd>=0 && mem::close(fd) && written;
+                if(!written || !T_appender::commit(filepath)) break;
+                ++acknowledged;
+            }
+            bool finished = !mem::crashed();
+            mem::power_loss(keep_unsynced);
+            
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            bool recovered = recover_after_crash<T_appender>(filepath);
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count();
+            
+            ++report.crash_points;
+            report.total_recovery_seconds += seconds;
+            report.max_recovery_seconds = std::max(report.max_recovery_seconds, seconds);
+            report.failed_recoveries += recovered ? 0 : 1;
+            
+            // Which whole number of appends, if any, is the file now?
+            std::vector<byte> contents;
+            mem::read_file(filepath, contents);
+            std::vector<byte> expected(initial);
+            bool prefix = contents==expected;
+            size_t whole = 0;
+            for(size_t i=0; i<appends.size() && !prefix; ++i) {
+                expected.insert(expected.end(), appends[i].begin(), appends[i].end());
+                if(contents==expected) {
+                    prefix = true;
+                    whole = i+1;
+                }
+            }
+            report.not_a_prefix += prefix ? 0 : 1;
+            report.lost_commits += (prefix && whole<acknowledged) ? 1 : 0;
+            if(finished) {
+                break;
+            }
+        }
+        mem::reset();
+        return report;
+    }
+}
+
+#endif
@@ -0,0 +1,123 @@
+//
+//  epoch_journal.h
+//  safe-append-cpp
+//
+//  Commit appends to many files at once, paying for durability once per
+//  epoch instead of once per file. Before appending to a file, touch() it:
+//  the first touch in an epoch records the file's length in the epoch
+//  journal. close() then makes every touched file durable with a single
+//  syncfs (or a batched sync_file_range pass followed by fdatasync), and
+//  retires the journal by cutting it back to a header naming the next
+//  epoch, so epoch numbers keep rising across reopens. Opening a journal
+//  left over from an open epoch rolls back every file it names, so after a
+//  crash the files are as they were when the last epoch closed.
+//
+//  close() and rollback() must not run while another thread is appending
+//  to a touched file. Appends made between begin_append and end_append (or
+//  within an append_guard) are waited for; touch() alone does not pin.
+//
+//  Files in an epoch should not also use sa::start/sa::commit, and with the
+//  syncfs barrier they must be on the same file system as the journal.
+//
+//  Journal: "SAEJ" | epoch (8) | check (8), then one record per touched
+//  file: path length (2) | length (8) | check (8) | path. A retired
+//  journal is the header alone. Each check is the
+//  first 8 bytes of the sha512 of the epoch number and everything else in
+//  the header or record. Recovery stops at the first record that fails it.
+//
+
+#ifndef safe_append_cpp_epoch_journal_h
+#define safe_append_cpp_epoch_journal_h
+
+#include <condition_variable>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace sa {
+
+    struct epoch_options {
+        enum barrier_kind {
+            syncfs_barrier,  // one syncfs of the journal's file system
+            per_file_barrier // sync_file_range on every file, then fdatasync each
+        };
+
+        epoch_options() : barrier(syncfs_barrier) {}
+
+        barrier_kind barrier;
+    };
+
+    class epoch_journal {
+    public:
+        // Open (or create) the journal and roll back any epoch left open.
+        explicit epoch_journal(std::string const & journal_path, epoch_options const & opts=epoch_options());
+        // Leaves an open epoch open, to be rolled back by the next open.
+        ~epoch_journal();
+
+        bool ok() const { return m_fd>=0; }
+
+        // Record the files' lengths in the journal, durably, unless they
+        // were already touched this epoch. Call before appending to them.
+        bool touch(std::string const & filepath);
+        bool touch(std::vector<std::string> const & filepaths);
+        
+        // touch, and hold off close and rollback until end_append.
+        bool begin_append(std::string const & filepath);
+        bool begin_append(std::vector<std::string> const & filepaths);
+        void end_append();
+        
+        class append_guard {
+        public:
+            append_guard(epoch_journal & journal, std::string const & filepath)
+                : m_journal(journal), m_ok(journal.begin_append(filepath)) {}
+            ~append_guard() { if(m_ok) m_journal.end_append(); }
+            
+            bool ok() const { return m_ok; }
+            
+        private:
+            append_guard(append_guard const &);
+            append_guard & operator=(append_guard const &);
+            
+            epoch_journal & m_journal;
+            bool m_ok;
+        };
+
+        // Make every touched file durable, then retire the journal. Waits
+        // for appends begun with begin_append.
+        bool close();
+
+        // Truncate every touched file to its length at touch, then retire
+        // the journal. Waits for appends begun with begin_append.
+        bool rollback();
+
+        uint64_t epoch() const;         // the current epoch, from 1, rising across reopens
+        size_t touched_count() const;   // files touched this epoch
+        size_t recovered_file_count() const { return m_recovered; }
+
+    private:
+        epoch_journal(epoch_journal const &);
+        epoch_journal & operator=(epoch_journal const &);
+
+        bool recover();
+        bool touch_locked(std::vector<std::string> const & filepaths);
+        bool barrier();
+        bool retire(uint64_t next_epoch);
+        bool truncate_touched();
+
+        std::string m_journal_path;
+        epoch_options m_options;
+        int m_fd;
+        size_t m_recovered;
+
+        mutable std::mutex m_mutex;
+        std::condition_variable m_idle;
+        uint64_t m_epoch;
+        uint64_t m_head; // where the next record goes; 0 before the header
+        std::map<std::string, uint64_t> m_touched; // path to length at touch
+        unsigned m_appending; // appends between begin_append and end_append
+    };
+}
+
+#endif
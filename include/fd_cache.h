@@ -0,0 +1,160 @@
+//
+//  fd_cache.h
+//  safe-append-cpp
+//
+//  A bounded cache of open file descriptors, so that a process touching
+//  more files than RLIMIT_NOFILE allows can keep its hot files open and
+//  reopen cold ones transparently. Entries are kept in LRU order, in
+//  shards selected by path hash, so threads working on different files
+//  rarely share a lock.
+//
+//  open() hands out the cached descriptor and pins it; close() unpins it.
+//  A hit costs one fstat of the cached descriptor, and is only taken while
+//  the file still has a link, so a file unlinked or renamed over without
+//  going through the library is reopened, never written through its old
+//  descriptor. The library's own unlinks and renames (delete_file,
+//  replace_checksummed_file) invalidate the path in the global cache.
+//  A pinned descriptor is never evicted, so holding one from sa::start to
+//  sa::commit keeps the file open for the whole transaction. When every
+//  entry in a shard is pinned, the shard grows past its share of the
+//  capacity rather than evict one.
+//
+//  Cached descriptors are opened O_RDWR (O_RDONLY where that is all the
+//  file allows) and shared, so use pread/pwrite, not the file offset.
+//  Opens with O_CREAT, O_TRUNC, O_EXCL or O_APPEND bypass the cache, and
+//  their descriptors are closed by close() as usual. flock locks belong to
+//  the shared descriptor, so they do not keep threads of one process apart,
+//  and basic_appender refuses flock_lock with cached_posix_backend.
+//
+//  cached_posix_backend is posix_backend with open and close routed
+//  through the process-wide cache, for use as basic_appender's backend.
+//  It holds each file from sa::start until the transaction ends, so a file
+//  with an open transaction is never evicted.
+//
+
+#ifndef safe_append_cpp_fd_cache_h
+#define safe_append_cpp_fd_cache_h
+
+#include <atomic>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "storage_backend.h"
+
+namespace sa {
+
+    struct fd_cache_options {
+        fd_cache_options() : capacity(1024), shards(16) {}
+
+        size_t capacity; // descriptors kept open, beyond those pinned
+        size_t shards;
+    };
+
+    struct fd_cache_stats {
+        uint64_t hits;
+        uint64_t misses;    // opened a file (bypassed opens not counted)
+        uint64_t evictions;
+        uint64_t bypassed;
+        size_t open_count;  // descriptors held by the cache
+        size_t pinned_count;
+
+        double hit_rate() const { return hits+misses ? (double)hits/(hits+misses) : 0.0; }
+    };
+
+    class fd_cache {
+    public:
+        explicit fd_cache(fd_cache_options const & opts=fd_cache_options());
+        // Closes every cached descriptor, pinned or not.
+        ~fd_cache();
+
+        // The cache behind cached_posix_backend. Its capacity defaults to
+        // the smaller of 1024 and half of RLIMIT_NOFILE.
+        static fd_cache & global();
+
+        // Like ::open (errno is set on failure), but pinned in the cache.
+        int open(std::string const & path, int flags);
+
+        // Unpin a descriptor from open(); closes it if it was not cached.
+        bool close(int fd);
+        
+        // Keep the path pinned until release(path), e.g. for the length of
+        // a transaction. Holding a path already held does nothing.
+        bool hold(std::string const & path);
+        void release(std::string const & path);
+
+        // Drop the path's entry, e.g. before it is unlinked or renamed, to
+        // release the old file promptly. A pinned entry is dropped when its
+        // last pin is released.
+        void invalidate(std::string const & path);
+        // invalidate() on the global cache, if it has been used at all.
+        static void invalidate_global(std::string const & path);
+
+        // Evicts unpinned entries down to the new capacity.
+        void set_capacity(size_t capacity);
+
+        fd_cache_stats stats() const;
+        void reset_stats();
+
+    private:
+        fd_cache(fd_cache const &);
+        fd_cache & operator=(fd_cache const &);
+
+        struct entry {
+            std::string path;
+            int fd;
+            bool writable;
+            bool stale; // invalidated while pinned
+            bool held;  // one of the pins is hold()'s
+            unsigned pins;
+        };
+
+        struct shard {
+            shard() : stale_held(0) {}
+
+            std::mutex mutex;
+            std::list<entry> lru; // most recently used first
+            std::unordered_map<std::string, std::list<entry>::iterator> index;
+            size_t stale_held; // held entries no longer in the index
+        };
+
+        // Which path a cached descriptor belongs to, for close(fd).
+        struct fd_shard {
+            std::mutex mutex;
+            std::unordered_map<int, std::string> paths;
+        };
+
+        shard & shard_for(std::string const & path);
+        fd_shard & fd_shard_for(int fd);
+        std::list<entry>::iterator find_entry(shard & s, std::string const & path, int fd);
+        void drop(shard & s, std::list<entry>::iterator it, std::vector<int> & out_fds);
+        void unpin(shard & s, std::list<entry>::iterator it, std::vector<int> & out_fds);
+        void evict(shard & s, std::vector<int> & out_fds);
+        void forget(std::vector<int> const & fds);
+
+        std::vector<std::unique_ptr<shard> > m_shards;
+        std::vector<std::unique_ptr<fd_shard> > m_fd_shards;
+        std::atomic<size_t> m_shard_capacity;
+        std::atomic<uint64_t> m_hits;
+        std::atomic<uint64_t> m_misses;
+        std::atomic<uint64_t> m_evictions;
+        std::atomic<uint64_t> m_bypassed;
+    };
+
+    struct cached_posix_backend : posix_backend {
+        // Threads share one description per file, so flock_lock is refused.
+        static constexpr bool shares_descriptors = true;
+        
+        static int open(std::string const & path, int flags) { return fd_cache::global().open(path, flags); }
+        static bool close(int fd) { return fd_cache::global().close(fd); }
+        // A file with an open transaction stays open and is never evicted.
+        static bool hold(std::string const & path) { return fd_cache::global().hold(path); }
+        static void release(std::string const & path) { fd_cache::global().release(path); }
+    };
+}
+
+#endif
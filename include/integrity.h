@@ -0,0 +1,42 @@
+//
+//  integrity.h
+//  safe-append-cpp
+//
+//  An optional per-file integrity sidecar. The data file is divided into
+//  fixed-size chunks; the sidecar keeps the digest of every complete chunk
+//  and a chained root over those digests, plus the running digest of the
+//  partial chunk at the end. Each sa::commit extends the sidecar by hashing
+//  only the newly committed bytes, and verification can check the whole
+//  file or any byte range, one chunk per thread. Chunks that reach below
+//  the logical start (see retention.h) are skipped, since retention has
+//  released their bytes.
+//
+
+#ifndef safe_append_cpp_integrity_h
+#define safe_append_cpp_integrity_h
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace sa {
+    
+    const uint64_t default_integrity_chunk_size = 4*1024*1024;
+    
+    struct integrity_report {
+        bool valid;                       // sidecar intact and every checked chunk matched
+        uint64_t covered_length;          // bytes of the data file covered by the sidecar
+        std::vector<uint64_t> bad_chunks; // chunks whose contents no longer match
+    };
+    
+    bool enable_integrity(std::string const & filepath, uint64_t chunk_size=default_integrity_chunk_size);
+    bool disable_integrity(std::string const & filepath);
+    bool has_integrity(std::string const & filepath);
+    bool extend_integrity(std::string const & filepath);
+    // Rehash the chunks a change in place touched, then extend.
+    bool refresh_integrity(std::string const & filepath, uint64_t offset, uint64_t length);
+    integrity_report verify_integrity(std::string const & filepath, unsigned threads=0);
+    integrity_report verify_integrity(std::string const & filepath, uint64_t offset, uint64_t length, unsigned threads=0);
+}
+
+#endif
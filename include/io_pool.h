@@ -0,0 +1,54 @@
+//
+//  io_pool.h
+//  safe-append-cpp
+//
+//  A fixed set of worker threads that run blocking file work (journal
+//  writes, appends, syncs) handed to them from elsewhere. It is the reactor
+//  behind the awaitable interface in async_append.h, and is usable on its
+//  own from C++11 code.
+//
+
+#ifndef safe_append_cpp_io_pool_h
+#define safe_append_cpp_io_pool_h
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace sa {
+    
+    class io_pool {
+    public:
+        // 0 threads means one per hardware thread.
+        explicit io_pool(unsigned threads=0);
+        
+        // Runs every job already submitted, then joins the workers.
+        ~io_pool();
+        
+        // Queue a job to run on one of the workers, in submission order.
+        void submit(std::function<void()> job);
+        
+        unsigned thread_count() const;
+        size_t pending() const;
+        uint64_t completed() const;
+        
+    private:
+        io_pool(io_pool const &);
+        io_pool & operator=(io_pool const &);
+        
+        void run();
+        
+        mutable std::mutex m_mutex;
+        std::condition_variable m_work;
+        std::deque<std::function<void()> > m_jobs;
+        bool m_stop;
+        uint64_t m_completed;
+        std::vector<std::thread> m_threads;
+    };
+}
+
+#endif
@@ -0,0 +1,33 @@
+//
+//  lz_codec.h
+//  safe-append-cpp
+//
+//  A small LZ77 block codec that produces the LZ4 block format: sequences
+//  of a token, literals, a 16-bit back-reference offset and a match length.
+//  It favors speed over ratio and keeps its hash table per thread, so
+//  compressing allocates nothing. Decompression checks every length and
+//  offset against the buffers, so corrupt input fails instead of
+//  overrunning.
+//
+
+#ifndef safe_append_cpp_lz_codec_h
+#define safe_append_cpp_lz_codec_h
+
+#include <cstddef>
+
+#include "byte_utils.h"
+
+// Largest compressed size of `length` input bytes.
+inline size_t lz_compress_bound(size_t length) {
+    return length + length/255 + 16;
+}
+
+// Compress into out, which must hold lz_compress_bound(length) bytes.
+// Returns the compressed size.
+size_t lz_compress(byte const * in, size_t length, byte * out);
+
+// Decompress exactly out_length bytes. False if the input is malformed or
+// does not decode to exactly out_length bytes.
+bool lz_decompress(byte const * in, size_t length, byte * out, size_t out_length);
+
+#endif
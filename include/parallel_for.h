@@ -0,0 +1,58 @@
+//
+//  parallel_for.h
+//  safe-append-cpp
+//
+//  Run independent pieces of work (hashing chunks, verifying journals) across
+//  a handful of threads.
+//
+
+#ifndef safe_append_cpp_parallel_for_h
+#define safe_append_cpp_parallel_for_h
+
+#include <atomic>
+#include <cstddef>
+#include <thread>
+#include <vector>
+
+/**
+ * Call fn(i) for every i in [0, count), spread over at most `threads`
+ * threads (0 means one per hardware thread). The calling thread takes part
+ * in the work, and the call returns once every index has been processed.
+ */
+
+template<typename F>
+void parallel_for(size_t count, unsigned threads, F fn) {
+    if(threads==0) {
+        threads = std::thread::hardware_concurrency();
+    }
+    if(threads==0) {
+        threads = 1;
+    }
+    if(threads>count) {
+        threads = (unsigned)count;
+    }
+    if(threads<=1) {
+        for(size_t i=0; i<count; ++i) {
+            fn(i);
+        }
+        return;
+    }
+    
+    std::atomic<size_t> next(0);
+    auto worker = [&]() {
+        for(size_t i=next++; i<count; i=next++) {
+            fn(i);
+        }
+    };
+    std::vector<std::thread> pool;
+    pool.reserve(threads-1);
+    for(unsigned t=1; t<threads; ++t) {
+        pool.push_back(std::thread(worker));
+    }
+    worker();
+    for(std::thread & th : pool) {
+        th.join();
+    }
+}
+
+#endif
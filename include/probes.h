@@ -0,0 +1,185 @@
+//
+//  probes.h
+//  safe-append-cpp
+//
+//  Static tracepoints (USDT) on each phase of a transaction, for tools such
+//  as bpftrace, perf and SystemTap. Where <sys/sdt.h> is available, each
+//  probe compiles to a single nop plus a note in the binary, so an
+//  untraced probe costs next to nothing. Elsewhere, or with SA_NO_PROBES
+//  defined, the probes disappear entirely.
+//
+//  Provider "safe_append". Every probe takes the data file path (a C
+//  string) and the transaction sequence number first:
+//
+//      start_begin, start_end(ok)            sa::start and friends
+//      journal_begin, journal_end(length, ok) writing a journal; length is
+//                                             the journaled file length
+//      checksum(bytes)                        hashing a journal record
+//      sync_begin, sync_end(ok)               a sync policy call
+//      append(bytes)                          data written by a helper
+//                                             (coalescing, compressed,
+//                                             segmented or WAL appends)
+//      commit_begin, commit_end(ok)
+//      rollback_begin, rollback_end(length, ok)
+//      cleanup(ok)
+//
+//  Sequence numbers are per transaction, numbered from 1 across the
+//  process, and kept by data file path from start until the commit,
+//  rollback or cleanup that ends it. So a thread may interleave
+//  transactions on several files, or hand one to another thread (as
+//  async_append's coroutines do), and every probe still carries the number
+//  of the transaction on its own file. Within one call the number is passed
+//  down to the probes rather than looked up again.
+//
+//  Each probe has a USDT semaphore, which a tracer raises while it is
+//  attached. The numbers are kept only while some probe is attached, so
+//  transactions started before that carry 0, as do probes on a file with
+//  no transaction in this process. Untraced, keeping them costs a few
+//  plain loads per transaction and takes no lock; without <sys/sdt.h> it
+//  costs nothing at all.
+//
+//      bpftrace -e 'usdt:./satest:safe_append:commit_end { @[arg2] = count(); }'
+//
+
+#ifndef safe_append_cpp_probes_h
+#define safe_append_cpp_probes_h
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+#if !defined(SA_NO_PROBES) && defined(__has_include)
+#  if __has_include(<sys/sdt.h>)
+#    define _SDT_HAS_SEMAPHORES 1
+#    include <sys/sdt.h>
+#    define SA_PROBES_ENABLED 1
+#  endif
+#endif
+
+#ifdef SA_PROBES_ENABLED
+#  define SA_PROBE2(name, a1, a2) STAP_PROBE2(safe_append, name, a1, a2)
+#  define SA_PROBE3(name, a1, a2, a3) STAP_PROBE3(safe_append, name, a1, a2, a3)
+#  define SA_PROBE4(name, a1, a2, a3, a4) STAP_PROBE4(safe_append, name, a1, a2, a3, a4)
+#else
+// sizeof keeps the arguments "used" without evaluating them.
+#  define SA_PROBE2(name, a1, a2) do { (void)sizeof(a1); (void)sizeof(a2); } while(0)
+#  define SA_PROBE3(name, a1, a2, a3) do { (void)sizeof(a1); (void)sizeof(a2); (void)sizeof(a3); } while(0)
+#  define SA_PROBE4(name, a1, a2, a3, a4) do { (void)sizeof(a1); (void)sizeof(a2); (void)sizeof(a3); (void)sizeof(a4); } while(0)
+#endif
+
+#ifdef SA_PROBES_ENABLED
+// Defined in probes.cpp, in the .probes section where tracers look for them.
+extern "C" {
+    extern unsigned short safe_append_start_begin_semaphore;
+    extern unsigned short safe_append_start_end_semaphore;
+    extern unsigned short safe_append_journal_begin_semaphore;
+    extern unsigned short safe_append_journal_end_semaphore;
+    extern unsigned short safe_append_checksum_semaphore;
+    extern unsigned short safe_append_sync_begin_semaphore;
+    extern unsigned short safe_append_sync_end_semaphore;
+    extern unsigned short safe_append_append_semaphore;
+    extern unsigned short safe_append_commit_begin_semaphore;
+    extern unsigned short safe_append_commit_end_semaphore;
+    extern unsigned short safe_append_rollback_begin_semaphore;
+    extern unsigned short safe_append_rollback_end_semaphore;
+    extern unsigned short safe_append_cleanup_semaphore;
+}
+#endif
+
+namespace sa {
+    
+#ifdef SA_PROBES_ENABLED
+    // Whether a tracer is attached to any of the probes.
+    inline bool tracing() {
+        // volatile: the tracer writes these from outside the program.
+        return (*(unsigned short volatile *)&safe_append_start_begin_semaphore
+              | *(unsigned short volatile *)&safe_append_start_end_semaphore
+              | *(unsigned short volatile *)&safe_append_journal_begin_semaphore
+              | *(unsigned short volatile *)&safe_append_journal_end_semaphore
+              | *(unsigned short volatile *)&safe_append_checksum_semaphore
+              | *(unsigned short volatile *)&safe_append_sync_begin_semaphore
+              | *(unsigned short volatile *)&safe_append_sync_end_semaphore
+              | *(unsigned short volatile *)&safe_append_append_semaphore
+              | *(unsigned short volatile *)&safe_append_commit_begin_semaphore
+              | *(unsigned short volatile *)&safe_append_commit_end_semaphore
+              | *(unsigned short volatile *)&safe_append_rollback_begin_semaphore
+              | *(unsigned short volatile *)&safe_append_rollback_end_semaphore
+              | *(unsigned short volatile *)&safe_append_cleanup_semaphore)!=0;
+    }
+    
+    struct transaction_registry {
+        std::mutex mutex;
+        std::unordered_map<std::string, uint64_t> sequences;
+        std::atomic<uint64_t> counter;
+        std::atomic<size_t> open;   // entries not at 0
+        
+        transaction_registry() : counter(0), open(0) {}
+        
+        static transaction_registry & instance() {
+            static transaction_registry r;
+            return r;
+        }
+    };
+    
+    // Number a new transaction on the file, or 0 if nothing is tracing.
+    // Entries of ended transactions are kept, at 0, so a file's next
+    // transaction allocates nothing; they are swept once there are many.
+    inline uint64_t begin_transaction(std::string const & filepath) {
+        if(!tracing()) {
+            return 0;
+        }
+        transaction_registry & r = transaction_registry::instance();
+        uint64_t sequence = ++r.counter;
+        std::lock_guard<std::mutex> lock(r.mutex);
+        std::unordered_map<std::string, uint64_t>::iterator it = r.sequences.find(filepath);
+        if(it!=r.sequences.end()) {
+            if(it->second==0) ++r.open;
+            it->second = sequence;
+            return sequence;
+        }
+        if(r.sequences.size()>=4096) {
+            for(it = r.sequences.begin(); it!=r.sequences.end(); ) {
+                it = it->second==0 ? r.sequences.erase(it) : ++it;
+            }
+        }
+        r.sequences.insert(std::make_pair(filepath, sequence));
+        ++r.open;
+        return sequence;
+    }
+    
+    // The file's open transaction, or 0.
+    inline uint64_t current_transaction(std::string const & filepath) {
+        if(!tracing()) {
+            return 0;
+        }
+        transaction_registry & r = transaction_registry::instance();
+        std::lock_guard<std::mutex> lock(r.mutex);
+        std::unordered_map<std::string, uint64_t>::const_iterator it = r.sequences.find(filepath);
+        return it==r.sequences.end() ? 0 : it->second;
+    }
+    
+    inline void end_transaction(std::string const & filepath) {
+        transaction_registry & r = transaction_registry::instance();
+        // A tracer may have gone since the transaction was numbered.
+        if(r.open.load(std::memory_order_relaxed)==0) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(r.mutex);
+        std::unordered_map<std::string, uint64_t>::iterator it = r.sequences.find(filepath);
+        if(it!=r.sequences.end() && it->second!=0) {
+            it->second = 0;
+            --r.open;
+        }
+    }
+#else
+    inline bool tracing() { return false; }
+    inline uint64_t begin_transaction(std::string const &) { return 0; }
+    inline uint64_t current_transaction(std::string const &) { return 0; }
+    inline void end_transaction(std::string const &) {}
+#endif
+}
+
+#endif
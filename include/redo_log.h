@@ -0,0 +1,120 @@
+//
+//  redo_log.h
+//  safe-append-cpp
+//
+//  Write-ahead (redo) logging for appends. Instead of journaling the data
+//  file's length and appending in place, append writes the payload to a
+//  sequential, preallocated log (ideally on a fast device) and returns once
+//  the log is synced. A background applier later copies committed records
+//  to their data files. It sorts each batch by file and offset, writes
+//  contiguous records in one call, syncs, and then checkpoints. Commits
+//  never touch the data files.
+//
+//  Each record names its data file and the offset its payload belongs at,
+//  so applying a record twice is harmless. Opening a log replays every
+//  record after the last checkpoint, which finishes whatever a crash
+//  interrupted. Once everything is applied, the log starts again from the
+//  beginning.
+//
+//  A file in WAL mode must be appended only through its redo_log, and the
+//  data file lags the log until drain() returns.
+//
+//  If applying a batch fails (a data file removed or unwritable), the
+//  applier keeps retrying, but the failure sticks: drain() and append()
+//  return false from then on. The records stay in the log. Reopening
+//  replays them, and skips those whose data file no longer exists.
+//
+//  Record: "SAWR" | sequence (8) | path length (2) | payload length (4) |
+//          file offset (8) | check (8) | path | payload
+//  The check is the first 8 bytes of the sha512 of everything else.
+//  Checkpoint (<log>.ckpt, a checksummed file): "SAWC" | log offset (8) |
+//  next sequence (8).
+//
+
+#ifndef safe_append_cpp_redo_log_h
+#define safe_append_cpp_redo_log_h
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "byte_utils.h"
+
+namespace sa {
+    
+    struct redo_log_options {
+        redo_log_options() : capacity(64*1024*1024), apply_delay(10) {}
+        
+        uint64_t capacity;                     // preallocated log size
+        std::chrono::milliseconds apply_delay; // batching window for the applier
+    };
+    
+    class redo_log {
+    public:
+        // Open (or create) the log and replay anything not yet applied.
+        explicit redo_log(std::string const & log_path, redo_log_options const & opts=redo_log_options());
+        // Applies everything outstanding before returning.
+        ~redo_log();
+        
+        bool ok() const { return m_fd>=0; }
+        
+        // Durable once this returns true. Waits if the log is full.
+        bool append(std::string const & filepath, byte const * bytes, size_t length);
+        bool append(std::string const & filepath, std::vector<byte> const & bytes);
+        
+        // Wait until every record appended so far is in its data file.
+        // False once applying has failed.
+        bool drain();
+        bool apply_failed() const;
+        
+        uint64_t pending_bytes() const;
+        uint64_t applied_batch_count() const;
+        uint64_t replayed_record_count() const { return m_replayed; }
+        // Replayed records whose data file was gone.
+        uint64_t skipped_record_count() const { return m_skipped; }
+        
+    private:
+        redo_log(redo_log const &);
+        redo_log & operator=(redo_log const &);
+        
+        struct record {
+            std::string filepath;
+            uint64_t file_offset;
+            uint64_t log_offset; // of the payload
+            uint32_t length;
+        };
+        
+        bool replay();
+        bool apply(std::vector<record> & batch, bool skip_missing=false);
+        bool write_checkpoint(uint64_t offset, uint64_t sequence);
+        void run();
+        
+        std::string m_log_path;
+        redo_log_options m_options;
+        int m_fd;
+        uint64_t m_replayed;
+        uint64_t m_skipped;
+        
+        mutable std::mutex m_mutex;
+        std::condition_variable m_work;
+        std::condition_variable m_progress;
+        uint64_t m_head;          // where the next record goes
+        uint64_t m_next_sequence;
+        std::vector<record> m_pending;
+        bool m_applying;
+        bool m_restarting;        // checkpointing a return to the top of the log
+        bool m_apply_failed;      // sticky
+        uint64_t m_pending_bytes;
+        uint64_t m_applied_batches;
+        std::unordered_map<std::string, uint64_t> m_file_lengths; // including unapplied records
+        bool m_stop;
+        std::thread m_thread;
+    };
+}
+
+#endif
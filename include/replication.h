@@ -0,0 +1,85 @@
+//
+//  replication.h
+//  safe-append-cpp
+//
+//  Keeps a mirror copy of a data file, for example on another disk, by
+//  shipping each newly committed byte range as commits happen. A
+//  replicator listens to sa::commit and sa::rollback on the source path
+//  (see commit_listener.h). A background thread copies the range between
+//  the mirror's length and the latest committed length with
+//  copy_file_range, so the data does not pass through user space. It falls
+//  back to pread/pwrite where the kernel cannot copy between the two files.
+//
+//  Commits that arrive within max_delay of each other are shipped as one
+//  batch. Only committed bytes are ever copied. A mirror longer than the
+//  source's committed length, for example left over from before a
+//  rollback, is truncated to match. Ranges rewritten in place by
+//  safe_modify are shipped again.
+//
+
+#ifndef safe_append_cpp_replication_h
+#define safe_append_cpp_replication_h
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+
+namespace sa {
+    
+    struct replication_options {
+        replication_options() : max_delay(5), sync(true) {}
+        
+        std::chrono::milliseconds max_delay; // batching window after a commit
+        bool sync;                           // fdatasync the mirror after each batch
+    };
+    
+    class replicator {
+    public:
+        replicator(std::string const & source, std::string const & mirror,
+                   replication_options const & opts=replication_options());
+        // Ships anything outstanding before returning.
+        ~replicator();
+        
+        bool ok() const { return m_ok; }
+        
+        // Committed bytes not yet on the mirror.
+        uint64_t lag() const;
+        uint64_t shipped_length() const;
+        uint64_t batch_count() const;
+        uint64_t failed_batch_count() const;
+        
+        // Wait until the mirror has caught up, or the timeout passes.
+        bool wait_caught_up(std::chrono::milliseconds timeout) const;
+        
+    private:
+        replicator(replicator const &);
+        replicator & operator=(replicator const &);
+        
+        bool caught_up() const;
+        void run();
+        bool ship(uint64_t from, uint64_t to, uint64_t shipped);
+        
+        std::string m_source;
+        std::string m_mirror;
+        replication_options m_options;
+        bool m_ok;
+        
+        mutable std::mutex m_mutex;
+        std::condition_variable m_work;
+        mutable std::condition_variable m_progress;
+        uint64_t m_target;   // latest committed length of the source
+        uint64_t m_shipped;  // length of the mirror
+        uint64_t m_rewritten; // first byte safe_modify changed since it was shipped
+        uint64_t m_batches;
+        uint64_t m_failed_batches;
+        bool m_stop;
+        
+        uint64_t m_listener;
+        std::thread m_thread;
+    };
+}
+
+#endif
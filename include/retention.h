@@ -0,0 +1,45 @@
+//
+//  retention.h
+//  safe-append-cpp
+//
+//  Dropping old data from the head of a file without rewriting it. The
+//  bytes before the new logical start are released with
+//  fallocate(FALLOC_FL_PUNCH_HOLE). The file keeps its length and offsets,
+//  so journals, footers and readers' positions stay valid. The logical
+//  start is kept in a checksummed header sidecar, s_<sha1>.hdr; readers
+//  should not look before it. verify_integrity skips the chunks it cuts
+//  into, and a replicator leaves a hole in the mirror instead of copying
+//  the released range.
+//
+//  A retention journal, r_<sha1>.rtn, makes the operation crash-safe. Punched
+//  data cannot be restored, so an interrupted retention is rolled forward by
+//  recover_retention rather than rolled back. Appends at the tail proceed
+//  while the head is punched.
+//
+//  FALLOC_FL_COLLAPSE_RANGE is not used: it shifts every later offset,
+//  which would invalidate journals, integrity sidecars and open readers.
+//  Where the file system cannot punch holes, the logical start is still
+//  recorded and the space is reclaimed only when the file is replaced.
+//
+
+#ifndef safe_append_cpp_retention_h
+#define safe_append_cpp_retention_h
+
+#include <cstdint>
+#include <string>
+
+namespace sa {
+    
+    // The first retained byte; 0 if retention was never applied.
+    uint64_t logical_start(std::string const & filepath);
+    
+    // Drop everything before offset, which must not be past the committed
+    // length. Moving the start backwards is refused.
+    bool retain_from(std::string const & filepath, uint64_t offset);
+    
+    // Finish a retention interrupted by a crash. True if there was nothing
+    // to do or the retention completed.
+    bool recover_retention(std::string const & filepath);
+}
+
+#endif
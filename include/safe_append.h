@@ -10,6 +10,7 @@
 #define __safe_append_cpp__safe_append__
 
 #include <string>
+#include <vector>
 
 namespace sa {
     
@@ -24,6 +25,15 @@ namespace sa {
     bool commit(std::string const & filepath);
     bool cleanup(std::string const & filepath);
     bool rollback(std::string const & filepath);
+    
+    // The status of many files at once. Directories are listed once each
+    // and only journals that exist are read, in parallel.
+    std::vector<status_value> status_many(std::vector<std::string> const & filepaths, unsigned threads=0);
+    
+    template<typename T_iter>
+    std::vector<status_value> status_many(T_iter begin, T_iter end, unsigned threads=0) {
+        return status_many(std::vector<std::string>(begin, end), threads);
+    }
 }
 
 #endif /* defined(__safe_append_cpp__safe_append__) */
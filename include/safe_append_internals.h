@@ -5,10 +5,15 @@
 #define safe_append_cpp_safe_append_internals_h
 
 #include <array>
+#include <cstdint>
+#include <string>
 #include <vector>
 #include <type_traits>
 #include <fstream>
 
+#include <sys/uio.h>
+
+#include "safe_append.h"
 #include "sha512.h"
 #include "sha1.h"
 #include "byte_utils.h"
@@ -57,11 +62,25 @@ bool splatfile(std::string const & filepath, std::string const & new_contents, b
 
 typedef std::array<byte, SHA1::DIGEST_SIZE> uchar_sha_array;
 
+// Hashing contexts are reused per thread (reset instead of reconstructed) so
+// that the journal hot path does not construct a fresh context per call.
+
+inline SHA1 & thread_sha1_context() {
+    static thread_local SHA1 ctx;
+    return ctx;
+}
+
+inline SHA512 & thread_sha512_context() {
+    static thread_local SHA512 ctx;
+    return ctx;
+}
+
 template <typename T>
-void internal_sha1(const unsigned char * msg_array, unsigned int length, uchar_sha_array::iterator & output_it)
+void internal_sha1(const unsigned char * msg_array, size_t length, uchar_sha_array::iterator & output_it)
 {
-    SHA1 sha1;
+    SHA1 & sha1 = thread_sha1_context();
     std::array<unsigned int, 5> digest_uint;
+    sha1.Reset();
     sha1.Input( msg_array, length );
     sha1.Result( digest_uint.data() );
     for(unsigned int ui : digest_uint) {
@@ -90,14 +109,19 @@ uchar_sha_array sha1(std::string const & input)
 
 typedef std::array<byte, SHA512::DIGEST_SIZE>          uchar_sha512_array;
 
+inline void sha512(const unsigned char * input, size_t length, unsigned char * digest)
+{
+    SHA512 & ctx = thread_sha512_context();
+    ctx.init();
+    ctx.update(input, length);
+    ctx.final(digest);
+}
+
 template<typename T>
 uchar_sha512_array sha512(std::vector<T> const & input)
 {
     uchar_sha512_array digest;
-    SHA512 ctx = SHA512();
-    ctx.init();
-    ctx.update(reinterpret_cast<const unsigned char *>(input.data()), (input.size()*sizeof(T)));
-    ctx.final(digest.data());
+    sha512(reinterpret_cast<const unsigned char *>(input.data()), (input.size()*sizeof(T)), digest.data());
     return digest;
 }
 
@@ -105,18 +129,48 @@ template<typename T>
 uchar_sha512_array sha512(std::string const & input)
 {
     uchar_sha512_array digest;
-    SHA512 ctx = SHA512();
-    ctx.init();
-    ctx.update(reinterpret_cast<const unsigned char *>(input.data()), input.size());
-    ctx.final(digest.data());
+    sha512(reinterpret_cast<const unsigned char *>(input.data()), input.size(), digest.data());
     return digest;
 }
 
-
+bool file_exists(std::string const & filepath);
+bool pread_all(int fd, byte * out, size_t length, uint64_t offset);
+bool pwrite_all(int fd, byte const * bytes, size_t length, uint64_t offset);
+bool pwritev_all(int fd, struct iovec * iov, int iovcnt, uint64_t offset);
+bool fsync_directory(std::string const & filepath);
+bool write_checksummed_file(std::string const & filename, const byte * bytes, size_t length);
 bool write_checksummed_file(std::string const & filename, std::vector<byte> const & bytes);
-std::tuple<bool, std::vector<byte>, std::vector<byte>> read_checksummed_file(std::string const & filename);
+bool replace_checksummed_file(std::string const & filename, const byte * bytes, size_t length);
+bool replace_checksummed_file(std::string const & filename, std::vector<byte> const & bytes);
+
+/**
+ * The result of reading a checksummed file. The contents are read from disk
+ * once, directly into the vector; callers may move them out or borrow them
+ * through span().
+ */
+
+struct checksummed_contents {
+    bool valid;                  // cksum of contents valid?
+    uchar_sha512_array checksum; // cksum as stored in the file
+    std::vector<byte> contents;
+    
+    byte_span span() const { return byte_span(contents.data(), contents.size()); }
+};
+
+checksummed_contents read_checksummed_file(std::string const & filename);
+
+// Read into caller-provided storage. The vector is resized in place, so a
+// reused vector only allocates when it has to grow. The buffer form fails
+// if the contents are longer than capacity.
+bool read_checksummed_file(std::string const & filename, std::vector<byte> & out_contents,
+                           uchar_sha512_array * out_checksum=nullptr);
+bool read_checksummed_file(std::string const & filename, byte * out_contents, size_t capacity, size_t & out_length,
+                           uchar_sha512_array * out_checksum=nullptr);
+void sidecar_name(std::string const & filepath, char const * prefix, char const * suffix, std::string & out_name);
+void journal_name(std::string const & filepath, std::string & out_name);
 std::string journal_name(std::string const & filepath);
 bool create_append_journal(std::string const & filepath);
 sa::status_value read_append_journal(std::string const & filepath, long & out_length);
+bool delete_append_journal(std::string const & filepath);
 
 #endif
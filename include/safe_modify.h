@@ -0,0 +1,65 @@
+//
+//  safe_modify.h
+//  safe-append-cpp
+//
+//  In-place modification with an undo journal. Before anything is
+//  overwritten, modify_start copies the 4 KiB pages the change will touch,
+//  along with the file's length, into an undo journal, u_<sha1>.und. The
+//  journal is a checksummed file replaced atomically, so it either exists
+//  whole or not at all. After that the caller writes in place, and
+//  modify_commit drops the journal. modify_rollback puts the saved pages
+//  back and truncates to the saved length, and so undoes any partial
+//  write, including one interrupted by a crash.
+//
+//  Commit and rollback rehash the changed chunks of an integrity sidecar
+//  (see integrity.h), and notify commit listeners with the first byte
+//  changed in place, so that a replicator ships it again. A dirty journal
+//  (damaged, not merely hot) cannot be rolled back; modify_cleanup removes
+//  it so that the file can be modified again, and the caller decides what
+//  to make of contents that may be partly changed.
+//
+//  Pages are merged into contiguous runs, and each run is read and restored
+//  with a single call. Pages past the end of the file have no pre-image;
+//  rollback truncates them away.
+//
+//  Journal: "SAUN" | file length (8) | run count (4) |
+//           per run: offset (8), length (8) | pre-images of every run
+//
+
+#ifndef safe_append_cpp_safe_modify_h
+#define safe_append_cpp_safe_modify_h
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "safe_append.h"
+#include "byte_utils.h"
+
+namespace sa {
+    
+    const size_t modify_page_size = 4096;
+    
+    struct modify_range {
+        uint64_t offset;
+        byte const * bytes;
+        size_t length;
+    };
+    
+    status_value modify_status(std::string const & filepath);
+    
+    // Journal the pages covering the ranges. Only the offsets and lengths
+    // are used; the bytes may still be in preparation.
+    bool modify_start(std::string const & filepath, std::vector<modify_range> const & ranges);
+    bool modify_commit(std::string const & filepath);
+    bool modify_rollback(std::string const & filepath);
+    // Remove a dirty journal. False if the journal is not dirty.
+    bool modify_cleanup(std::string const & filepath);
+    
+    // The whole transaction: journal, write every range in place, sync,
+    // commit. Rolls back if any write fails.
+    bool safe_modify(std::string const & filepath, std::vector<modify_range> const & ranges);
+    bool safe_modify(std::string const & filepath, uint64_t offset, byte const * bytes, size_t length);
+}
+
+#endif
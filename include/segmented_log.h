@@ -0,0 +1,89 @@
+//
+//  segmented_log.h
+//  safe-append-cpp
+//
+//  A log stored as a series of segment files instead of one ever-growing
+//  data file. Appends go to the active (last) segment as ordinary
+//  sa::start/sa::commit transactions. Once the active segment reaches
+//  max_segment_size bytes, or is older than max_segment_age, the next
+//  append first rotates to a new segment. Sealed segments are never written
+//  again.
+//
+//  The segment list lives in <base>.manifest, a checksummed file replaced
+//  atomically (written to a temporary file, synced, renamed). Segments are
+//  named <base>.<index>, with the index zero-padded to 12 digits. Opening a
+//  log recovers only the active segment: a hot journal there is rolled
+//  back, and sealed segments are left untouched.
+//
+//  Manifest: "SASM" | segment count (4) | per segment: index (8),
+//            logical offset (8), sealed length (8), creation time (8).
+//  Integers are big-endian. The active segment's length is its file length.
+//
+
+#ifndef safe_append_cpp_segmented_log_h
+#define safe_append_cpp_segmented_log_h
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "byte_utils.h"
+
+namespace sa {
+    
+    struct segment_options {
+        segment_options() : max_segment_size(1024*1024*1024), max_segment_age(0) {}
+        
+        uint64_t max_segment_size;
+        std::chrono::seconds max_segment_age; // 0 disables time-based rotation
+    };
+    
+    struct segment_info {
+        uint64_t index;
+        uint64_t offset;   // logical offset of the segment's first byte
+        uint64_t length;   // committed bytes in the segment
+        int64_t created;   // seconds since the epoch
+        std::string path;
+    };
+    
+    class segmented_log {
+    public:
+        // Open the log at base_path, creating it if it does not exist.
+        explicit segmented_log(std::string const & base_path, segment_options const & opts=segment_options());
+        
+        bool ok() const { return m_ok; }
+        
+        // Append as one transaction on the active segment, rotating first if
+        // a boundary has been reached. A record is never split across
+        // segments.
+        bool append(byte const * bytes, size_t length);
+        bool append(std::vector<byte> const & bytes);
+        
+        // Seal the active segment and start a new one. An empty active
+        // segment is not rotated.
+        bool rotate();
+        
+        // Read [offset, offset+length) of the logical stream, clipped to its
+        // end, crossing segments as needed.
+        bool read(uint64_t offset, uint64_t length, std::vector<byte> & out_contents) const;
+        
+        std::vector<segment_info> const & segments() const { return m_segments; }
+        uint64_t length() const;
+        std::string manifest_path() const;
+        
+    private:
+        std::string segment_path(uint64_t index) const;
+        bool load_manifest();
+        bool write_manifest() const;
+        bool add_segment(uint64_t offset);
+        bool rotation_due(size_t incoming) const;
+        
+        std::string m_base;
+        segment_options m_options;
+        std::vector<segment_info> m_segments;
+        bool m_ok;
+    };
+}
+
+#endif
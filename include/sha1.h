@@ -24,6 +24,7 @@
 #ifndef _SHA1_H_
 #define _SHA1_H_
 
+#include <cstddef>
 #include <vector>
 #include <array>
 
@@ -49,9 +50,9 @@ class SHA1
          *  Provide input to SHA1
          */
         void Input( const unsigned char *message_array,
-                    unsigned            length);
+                    size_t              length);
         void Input( const char  *message_array,
-                    unsigned    length);
+                    size_t      length);
         void Input(unsigned char message_element);
         void Input(char message_element);
         SHA1& operator<<(const char *message_array);
@@ -61,6 +62,14 @@ class SHA1
     
         static const unsigned int DIGEST_SIZE =  ( 160 / 8 ) ;
 
+        /*
+         *  Save or restore the running state, so that a digest can be
+         *  checkpointed and resumed without rehashing the input
+         */
+        static const unsigned int STATE_SIZE = ( 5 * 4 ) + 8 + 1 + 64;
+        bool ExportState(unsigned char *state) const;
+        bool ImportState(const unsigned char *state);
+
     private:
 
         /*
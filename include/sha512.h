@@ -39,6 +39,7 @@
 
 #ifndef SHA512_H
 #define SHA512_H
+#include <cstddef>
 #include <vector>
 #include <array>
 
@@ -54,13 +55,19 @@ protected:
     
 public:
     void init();
-    void update(const unsigned char *message, unsigned int len);
+    void update(const unsigned char *message, size_t len);
     void final(unsigned char *digest);
     static const unsigned int DIGEST_SIZE = ( 512 / 8);
     
+    // Running state (chaining values, total length, partial block), so that
+    // a digest can be checkpointed and resumed without rehashing its input.
+    static const unsigned int STATE_SIZE = (8 * 8) + 8 + 1 + SHA384_512_BLOCK_SIZE;
+    void export_state(unsigned char *state) const;
+    bool import_state(const unsigned char *state);
+    
 protected:
-    void transform(const unsigned char *message, unsigned int block_nb);
-    unsigned int m_tot_len;
+    void transform(const unsigned char *message, size_t block_nb);
+    uint64 m_tot_len;
     unsigned int m_len;
     unsigned char m_block[2 * SHA384_512_BLOCK_SIZE];
     uint64 m_h[8];
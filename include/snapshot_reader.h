@@ -0,0 +1,65 @@
+//
+//  snapshot_reader.h
+//  safe-append-cpp
+//
+//  A read-only view of a data file's committed prefix, mapped into memory.
+//  The committed length comes from the published length sidecar when the
+//  writer runs a length_publisher (see committed_length.h). Otherwise it is
+//  the journaled length while a transaction is hot, and the file length
+//  when none is. Either way it is clamped to the file's size, and checked
+//  again once mapped, so a stale sidecar or a transaction that came and
+//  went while the length was read never leaves a mapping past the end of
+//  the file.
+//
+//  refresh() grows the view as commits advance, remapping only when the
+//  committed length changed. The span returned by data() is valid until
+//  the next refresh or the snapshot's destruction.
+//
+
+#ifndef safe_append_cpp_snapshot_reader_h
+#define safe_append_cpp_snapshot_reader_h
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "byte_utils.h"
+
+namespace sa {
+    
+    class committed_length_reader;
+    
+    class snapshot {
+    public:
+        explicit snapshot(std::string const & filepath);
+        ~snapshot();
+        
+        // False if the file could not be opened or mapped, or its journal
+        // is dirty.
+        bool ok() const { return m_fd>=0; }
+        
+        byte_span data() const { return byte_span(m_data, (size_t)m_length); }
+        uint64_t length() const { return m_length; }
+        
+        // Move the view to the current committed prefix. Returns true if
+        // it grew; it shrinks only if the file was cut short underneath it.
+        bool refresh();
+        
+    private:
+        snapshot(snapshot const &);
+        snapshot & operator=(snapshot const &);
+        
+        bool update();
+        bool committed_length(uint64_t & out_length) const;
+        bool map(uint64_t length);
+        void close();
+        
+        std::string m_filepath;
+        int m_fd;
+        byte * m_data;
+        uint64_t m_length;
+        std::unique_ptr<committed_length_reader> m_published;
+    };
+}
+
+#endif
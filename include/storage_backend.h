@@ -0,0 +1,116 @@
+//
+//  storage_backend.h
+//  safe-append-cpp
+//
+//  The file operations basic_appender is built on, as a template policy.
+//  posix_backend is the real file system. memory_backend keeps files in
+//  memory and models what survives a power loss. Only bytes that were
+//  fsynced, and names whose directory was synced, are kept. So the same
+//  engine can be benchmarked without a disk, and its crash behavior can be
+//  tested without pulling a plug (see crash_harness.h).
+//
+//  A backend is a set of static functions, so the choice costs nothing at
+//  run time. open() takes the usual O_ flags and sets errno on failure
+//  (ENOENT for missing files). hold() and release() bracket a transaction,
+//  from a successful start until it is committed, rolled back or cleaned
+//  up, for backends that keep the data file open meanwhile.
+//
+
+#ifndef safe_append_cpp_storage_backend_h
+#define safe_append_cpp_storage_backend_h
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "safe_append_internals.h"
+
+namespace sa {
+    
+    struct posix_backend {
+        // Whether open() may hand the same open file description to several
+        // callers, so that flock cannot keep them apart.
+        static constexpr bool shares_descriptors = false;
+        
+        static int open(std::string const & path, int flags) {
+            return ::open(path.c_str(), flags | O_CLOEXEC, 0666);
+        }
+        static bool close(int fd) { return ::close(fd)==0; }
+        static bool pread_all(int fd, byte * out, size_t length, uint64_t offset) {
+            return ::pread_all(fd, out, length, offset);
+        }
+        static bool pwrite_all(int fd, byte const * bytes, size_t length, uint64_t offset) {
+            return ::pwrite_all(fd, bytes, length, offset);
+        }
+        static bool size(int fd, uint64_t & out_size) {
+            struct stat st;
+            if(::fstat(fd, &st)!=0) return false;
+            out_size = st.st_size;
+            return true;
+        }
+        static bool truncate(int fd, uint64_t length) { return ::ftruncate(fd, (off_t)length)==0; }
+        static bool sync(int fd) { return ::fsync(fd)==0; }
+        static bool datasync(int fd) { return ::fdatasync(fd)==0; }
+        static bool sync_directory(std::string const & path) { return fsync_directory(path); }
+        static bool unlink(std::string const & path) { return delete_file(path); }
+        static bool exists(std::string const & path) { return file_exists(path); }
+        static long length(std::string const & path) { return flen(path); }
+        static bool lock(int fd) {
+            while(::flock(fd, LOCK_EX)!=0) {
+                if(errno!=EINTR) return false;
+            }
+            return true;
+        }
+        static void unlock(int fd) { ::flock(fd, LOCK_UN); }
+        static bool hold(std::string const &) { return true; }
+        static void release(std::string const &) {}
+    };
+    
+    class memory_backend {
+    public:
+        static constexpr bool shares_descriptors = false;
+        
+        static int open(std::string const & path, int flags);
+        static bool close(int fd);
+        static bool pread_all(int fd, byte * out, size_t length, uint64_t offset);
+        static bool pwrite_all(int fd, byte const * bytes, size_t length, uint64_t offset);
+        static bool size(int fd, uint64_t & out_size);
+        static bool truncate(int fd, uint64_t length);
+        static bool sync(int fd);
+        static bool datasync(int fd);
+        static bool sync_directory(std::string const & path);
+        static bool unlink(std::string const & path);
+        static bool exists(std::string const & path);
+        static long length(std::string const & path);
+        static bool lock(int) { return true; }
+        static void unlock(int) {}
+        static bool hold(std::string const &) { return true; }
+        static void release(std::string const &) {}
+        
+        // Test and benchmark helpers. write_file creates a file that is
+        // already durable, contents and name.
+        static bool write_file(std::string const & path, byte const * bytes, size_t length);
+        static bool read_file(std::string const & path, std::vector<byte> & out_contents);
+        
+        // Crash injection: let `operations` more calls succeed, then fail
+        // every call (with EIO) as if the machine had stopped, until
+        // power_loss().
+        static void crash_after(uint64_t operations);
+        static bool crashed();
+        
+        // Forget every unsynced write and name, close every descriptor and
+        // clear any pending crash. keep_unsynced is the fraction of a
+        // file's unsynced growth that survives anyway, modeling a torn
+        // append.
+        static void power_loss(double keep_unsynced=0.0);
+        // Remove every file.
+        static void reset();
+    };
+}
+
+#endif
@@ -0,0 +1,144 @@
+//
+//  stream_hash.h
+//  safe-append-cpp
+//
+//  Incremental hashing over arbitrarily long inputs. Lengths are accounted
+//  in 64 bits, so a single context can follow a file past 4 GiB, and the
+//  running state can be snapshotted and restored to resume a digest after
+//  a restart without rehashing from byte 0.
+//
+
+#ifndef safe_append_cpp_stream_hash_h
+#define safe_append_cpp_stream_hash_h
+
+#include <array>
+#include <cstdint>
+#include <vector>
+
+#include "sha512.h"
+#include "sha1.h"
+#include "byte_utils.h"
+
+struct sha512_hash_traits {
+    typedef SHA512 context;
+    static const unsigned int digest_size = SHA512::DIGEST_SIZE;
+    static const unsigned int state_size = SHA512::STATE_SIZE;
+    static const byte tag = 0x05;
+    
+    static void reset(context & ctx) { ctx.init(); }
+    static void update(context & ctx, byte const * data, size_t length) { ctx.update(data, length); }
+    static void final(context & ctx, byte * digest) { ctx.final(digest); }
+    static bool save(context const & ctx, byte * state) { ctx.export_state(state); return true; }
+    static bool load(context & ctx, byte const * state) { return ctx.import_state(state); }
+};
+
+struct sha1_hash_traits {
+    typedef SHA1 context;
+    static const unsigned int digest_size = SHA1::DIGEST_SIZE;
+    static const unsigned int state_size = SHA1::STATE_SIZE;
+    static const byte tag = 0x01;
+    
+    static void reset(context & ctx) { ctx.Reset(); }
+    static void update(context & ctx, byte const * data, size_t length) { ctx.Input(data, length); }
+    static void final(context & ctx, byte * digest) {
+        std::array<unsigned int, 5> digest_uint;
+        ctx.Result(digest_uint.data());
+        for(unsigned int ui : digest_uint) {
+            encode_big_endian(digest, ui);
+            digest+=sizeof(uint32_t);
+        }
+    }
+    static bool save(context const & ctx, byte * state) { return ctx.ExportState(state); }
+    static bool load(context & ctx, byte const * state) { return ctx.ImportState(state); }
+};
+
+/**
+ * A running digest. Copying a stream_hash copies its mid-state, and
+ * digest() finalizes a copy, so the stream can keep growing afterwards.
+ *
+ * snapshot() serializes the mid-state into a small byte vector (a tag byte
+ * followed by the algorithm's state); store it with write_checksummed_file
+ * to checkpoint, and restore() it to carry on.
+ */
+
+template<typename T_traits>
+class stream_hash {
+public:
+    typedef std::array<byte, T_traits::digest_size> digest_type;
+    static const size_t snapshot_size = 1 + T_traits::state_size;
+    
+    stream_hash() : m_length(0) { T_traits::reset(m_ctx); }
+    
+    void reset() {
+        T_traits::reset(m_ctx);
+        m_length = 0;
+    }
+    
+    void update(byte const * data, size_t length) {
+        T_traits::update(m_ctx, data, length);
+        m_length += length;
+    }
+    
+    void update(byte_span bytes) { update(bytes.data(), bytes.size()); }
+    
+    // Total number of bytes hashed since the last reset.
+    uint64_t length() const { return m_length; }
+    
+    digest_type digest() const {
+        digest_type rv;
+        typename T_traits::context ctx(m_ctx);
+        T_traits::final(ctx, rv.data());
+        return rv;
+    }
+    
+    std::vector<byte> snapshot() const {
+        std::vector<byte> rv(snapshot_size);
+        rv[0] = T_traits::tag;
+        if(!T_traits::save(m_ctx, rv.data()+1)) {
+            rv.clear();
+        }
+        return rv;
+    }
+    
+    bool restore(byte_span state) {
+        if(state.size()!=snapshot_size || state[0]!=T_traits::tag) {
+            return false;
+        }
+        typename T_traits::context ctx;
+        if(!T_traits::load(ctx, state.data()+1)) {
+            return false;
+        }
+        m_ctx = ctx;
+        m_length = restored_length(state.data()+1);
+        return true;
+    }
+    
+private:
+    static uint64_t restored_length(byte const * state);
+    
+    typename T_traits::context m_ctx;
+    uint64_t m_length;
+};
+
+// Both exported states carry the hashed length as a big-endian count
+// directly after the chaining values: whole blocks in bytes plus a pending
+// byte count (SHA512), or bits (SHA1).
+
+template<>
+inline uint64_t stream_hash<sha512_hash_traits>::restored_length(byte const * state) {
+    byte const * hi = state+64;
+    byte const * lo = state+68;
+    return (((uint64_t)extract_big_endian(hi)<<32) | extract_big_endian(lo)) + state[72];
+}
+
+template<>
+inline uint64_t stream_hash<sha1_hash_traits>::restored_length(byte const * state) {
+    byte const * hi = state+20;
+    byte const * lo = state+24;
+    return (((uint64_t)extract_big_endian(hi)<<32) | extract_big_endian(lo)) >> 3;
+}
+
+typedef stream_hash<sha512_hash_traits> sha512_stream;
+typedef stream_hash<sha1_hash_traits>   sha1_stream;
+
+#endif
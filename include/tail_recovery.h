@@ -0,0 +1,51 @@
+//
+//  tail_recovery.h
+//  safe-append-cpp
+//
+//  Recovery that keeps what it can. sa::rollback truncates a hot file back
+//  to its journaled length, discarding the whole transaction. sa::recover
+//  instead inspects the uncommitted tail and keeps the longest prefix of it
+//  that is verifiably complete: it stops at the first hole (found with
+//  SEEK_HOLE, so holes are never read) and at the first all-zero block, and
+//  then lets the caller's record framing decide how much of the rest holds
+//  whole, valid records.
+//
+//  Without a record size or validator nothing can be verified, and recover
+//  truncates to the journaled length just as rollback does.
+//
+
+#ifndef safe_append_cpp_tail_recovery_h
+#define safe_append_cpp_tail_recovery_h
+
+#include <cstdint>
+#include <functional>
+#include <string>
+
+#include "byte_utils.h"
+
+namespace sa {
+    
+    // Given the candidate tail, return how many of its leading bytes form
+    // complete, valid records.
+    typedef std::function<size_t(byte const * tail, size_t length)> tail_validator;
+    
+    struct recovery_options {
+        recovery_options() : block_size(4096), zero_blocks_are_torn(true), record_size(0) {}
+        
+        size_t block_size;          // granularity of the zero-block scan
+        bool zero_blocks_are_torn;  // stop at the first whole, aligned all-zero block
+        size_t record_size;         // if non-zero, keep only whole records
+        tail_validator validator;   // optional framing/checksum check
+    };
+    
+    struct recovery_result {
+        bool success;
+        uint64_t journaled_length; // length recorded when the transaction started
+        uint64_t original_length;  // length found on disk
+        uint64_t recovered_length; // length after recovery
+    };
+    
+    recovery_result recover(std::string const & filepath, recovery_options const & options=recovery_options());
+}
+
+#endif
@@ -0,0 +1,40 @@
+//
+//  tree_checksum.h
+//  safe-append-cpp
+//
+//  A checksummed file format for large payloads. Where write_checksummed_file
+//  stores one sha512 over the whole payload, a tree-checksummed file splits
+//  the payload into fixed-size chunks, stores the digest of each and a root
+//  digest over the header and chunk digests. Chunks can then be verified
+//  independently: in parallel when the whole file is read, or just the
+//  chunks a reader needs.
+//
+//  Layout: root digest | "SATR" | chunk size (4) | payload length (8) |
+//          chunk digests | payload. Integers are big-endian.
+//
+
+#ifndef safe_append_cpp_tree_checksum_h
+#define safe_append_cpp_tree_checksum_h
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "safe_append_internals.h"
+
+const uint32_t default_tree_chunk_size = 1024*1024;
+
+bool write_tree_checksummed_file(std::string const & filename, const byte * bytes, size_t length,
+                                 uint32_t chunk_size=default_tree_chunk_size, unsigned threads=0);
+bool write_tree_checksummed_file(std::string const & filename, std::vector<byte> const & bytes,
+                                 uint32_t chunk_size=default_tree_chunk_size, unsigned threads=0);
+
+// Read and verify the whole payload; checksum holds the root digest.
+checksummed_contents read_tree_checksummed_file(std::string const & filename, unsigned threads=0);
+
+// Read and verify only the chunks overlapping [offset, offset+length). The
+// range is clipped to the payload; out_contents receives the bytes in it.
+bool read_tree_checksummed_range(std::string const & filename, uint64_t offset, uint64_t length,
+                                 std::vector<byte> & out_contents, unsigned threads=0);
+
+#endif
@@ -5,8 +5,57 @@
 
 #include "safe_append.h"
 #include "safe_append_internals.h"
+#include "stream_hash.h"
+#include "integrity.h"
+#include "tree_checksum.h"
+#include "commit_footer.h"
+#include "tail_recovery.h"
+#include "basic_appender.h"
+#include "coalescing_appender.h"
+#include "lz_codec.h"
+#include "compressed_blocks.h"
+#include "committed_length.h"
+#include "snapshot_reader.h"
+#include "segmented_log.h"
+#include "retention.h"
+#include "replication.h"
+#include "safe_modify.h"
+#include "redo_log.h"
+#include "storage_backend.h"
+#include "crash_harness.h"
+#include "async_append.h"
+#include "commit_listener.h"
+#include "epoch_journal.h"
+#include "fd_cache.h"
 
 #include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <new>
+#include <thread>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+// Every heap allocation made by the test binary is counted, so that tests can
+// assert that a code path does not touch the allocator.
+
+static std::atomic<unsigned long> allocation_count(0);
+
+void * operator new(std::size_t size) {
+    ++allocation_count;
+    void * p = std::malloc(size ? size : 1);
+    if(!p) throw std::bad_alloc();
+    return p;
+}
+
+void operator delete(void * p) noexcept {
+    std::free(p);
+}
+
+void operator delete(void * p, std::size_t) noexcept {
+    operator delete(p);
+}
 
 BOOST_AUTO_TEST_CASE( file_name_path_tests )
 {
@@ -33,6 +82,69 @@ BOOST_AUTO_TEST_CASE( file_name_path_tests )
     
 }
 
+BOOST_AUTO_TEST_CASE( bulk_byte_utils_tests )
+{
+    std::vector<byte> input(300);
+    for(size_t i=0; i<input.size(); ++i) {
+        input[i] = (byte)(i*37+11);
+    }
+    
+    // Every length exercises both the vector and the scalar tail.
+    for(size_t n=0; n<=37; ++n) {
+        std::vector<uint32_t> values(n);
+        for(size_t i=0; i<n; ++i) {
+            std::vector<byte>::iterator it = input.begin()+4*i;
+            values[i] = extract_big_endian(it);
+        }
+        std::vector<byte> encoded(4*n);
+        encode_big_endian_array(values.data(), n, encoded.data());
+        BOOST_CHECK(std::equal(encoded.begin(), encoded.end(), input.begin()));
+        
+        std::vector<uint32_t> decoded(n);
+        extract_big_endian_array(input.data(), n, decoded.data());
+        BOOST_CHECK(decoded==values);
+        
+        std::vector<uint64_t> values64(n);
+        extract_big_endian_array(input.data(), n, values64.data());
+        for(size_t i=0; i<n; ++i) {
+            std::vector<byte>::iterator it = input.begin()+8*i;
+            BOOST_CHECK_EQUAL(values64[i], extract_big_endian64(it));
+        }
+        
+        std::vector<uint16_t> values16(n);
+        extract_big_endian_array(input.data(), n, values16.data());
+        std::vector<byte> encoded16(2*n);
+        encode_big_endian_array(values16.data(), n, encoded16.data());
+        BOOST_CHECK(std::equal(encoded16.begin(), encoded16.end(), input.begin()));
+        for(size_t i=0; i<n; ++i) {
+            BOOST_CHECK_EQUAL(values16[i], (input[2*i]<<8) | input[2*i+1]);
+        }
+    }
+    
+    for(size_t n=0; n<=70; ++n) {
+        std::string scalar;
+        std::back_insert_iterator<std::string> it = std::back_inserter(scalar);
+        bytes_to_hex(input.begin(), input.begin()+n, it);
+        
+        std::string bulk(2*n, ' ');
+        bytes_to_hex(input.data(), n, &bulk[0]);
+        BOOST_CHECK_EQUAL(bulk, scalar);
+        
+        std::string upper(bulk);
+        std::transform(upper.begin(), upper.end(), upper.begin(), ::toupper);
+        std::vector<byte> decoded(n);
+        BOOST_CHECK(hex_to_bytes(upper.data(), upper.size(), decoded.data()));
+        BOOST_CHECK(std::equal(decoded.begin(), decoded.end(), input.begin()));
+        
+        if(n>0) {
+            std::string bad(bulk);
+            bad[(7*n)%bad.size()] = 'g';
+            BOOST_CHECK(!hex_to_bytes(bad.data(), bad.size(), decoded.data()));
+        }
+    }
+    BOOST_CHECK(!hex_to_bytes("abc", 3, input.data()));
+}
+
 BOOST_AUTO_TEST_CASE( sha1_test_cases )
 {
     const int digest_size = SHA1::DIGEST_SIZE;
@@ -134,6 +246,61 @@ BOOST_AUTO_TEST_CASE( sha512_test_cases ) {
     
 }
 
+BOOST_AUTO_TEST_CASE( stream_hash_tests )
+{
+    // One million repetitions of 'a', fed in uneven pieces and carried
+    // across snapshot/restore, must give the reference digests.
+    
+    std::vector<byte> chunk(99991, 'a');
+    
+    {
+        sha512_stream running;
+        size_t remaining = 1000000;
+        while(remaining>0) {
+            size_t n = std::min(remaining, chunk.size());
+            running.update(byte_span(chunk.data(), n));
+            remaining -= n;
+            
+            sha512_stream resumed;
+            BOOST_CHECK(resumed.restore(byte_span(running.snapshot().data(), sha512_stream::snapshot_size)));
+            BOOST_CHECK_EQUAL(resumed.length(), running.length());
+            running = resumed;
+        }
+        BOOST_CHECK_EQUAL(running.length(), 1000000);
+        BOOST_CHECK(bytes_equal(running.digest(), hex_to_bytes("e718483d0ce769644e2e42c7bc15b4638e1f98b1"
+                                                               "3b2044285632a803afa973ebde0ff244877ea60a"
+                                                               "4cb0432ce577c31beb009c5c2c49aa2e4eadb217"
+                                                               "ad8cc09b")));
+        // digest() leaves the running state untouched
+        BOOST_CHECK(bytes_equal(running.digest(), running.digest()));
+    }
+    
+    {
+        sha1_stream running;
+        size_t remaining = 1000000;
+        while(remaining>0) {
+            size_t n = std::min(remaining, chunk.size());
+            running.update(byte_span(chunk.data(), n));
+            remaining -= n;
+            
+            std::vector<byte> state = running.snapshot();
+            sha1_stream resumed;
+            BOOST_CHECK(resumed.restore(byte_span(state.data(), state.size())));
+            BOOST_CHECK_EQUAL(resumed.length(), running.length());
+            running = resumed;
+        }
+        BOOST_CHECK(bytes_equal(running.digest(), hex_to_bytes("34aa973cd4c4daa4f61eeb2bdbad27316534016f")));
+    }
+    
+    {
+        sha512_stream s;
+        std::vector<byte> state = s.snapshot();
+        state[0] = 0;
+        BOOST_CHECK(!s.restore(byte_span(state.data(), state.size())));
+        BOOST_CHECK(!s.restore(byte_span(state.data(), 3)));
+    }
+}
+
 BOOST_AUTO_TEST_CASE( checksummed_file_tests )
 {
     mk_dir("test/");
@@ -151,17 +318,90 @@ BOOST_AUTO_TEST_CASE( checksummed_file_tests )
     BOOST_CHECK(write_checksummed_file(test_file, test_bytes));
     BOOST_CHECK_EQUAL(flen(test_file) , test_bytes.size()+SHA512::DIGEST_SIZE);
     
-    std::tuple<bool, std::vector<byte>, std::vector<byte>> tpl = read_checksummed_file(test_file);
+    checksummed_contents result = read_checksummed_file(test_file);
+    
+    BOOST_CHECK_EQUAL(result.valid, true);
+    BOOST_CHECK(bytes_equal(result.checksum, master_cksum));
+    BOOST_CHECK(bytes_equal(result.contents, test_bytes));
+    BOOST_CHECK(bytes_equal(result.span(), test_bytes));
+    
+    std::vector<byte> moved = std::move(result.contents);
+    BOOST_CHECK(bytes_equal(moved, test_bytes));
+    
+    std::vector<byte> reused;
+    reused.reserve(256);
+    byte const * storage = reused.data();
+    BOOST_CHECK(read_checksummed_file(test_file, reused));
+    BOOST_CHECK(bytes_equal(reused, test_bytes));
+    BOOST_CHECK(storage==reused.data());
     
-    BOOST_CHECK_EQUAL(std::get<0>(tpl), true);
-    BOOST_CHECK(bytes_equal(std::get<1>(tpl), master_cksum));
-    BOOST_CHECK(bytes_equal(std::get<2>(tpl), test_bytes));
+    std::array<byte, 64> small;
+    size_t small_len = 0;
+    BOOST_CHECK(read_checksummed_file(test_file, small.data(), small.size(), small_len));
+    BOOST_CHECK_EQUAL(small_len, test_bytes.size());
+    BOOST_CHECK(read_checksummed_file(test_file, small.data(), 4, small_len)==false);
+    
+    splatfile<std::string>(test_file, "x", true);
+    BOOST_CHECK(read_checksummed_file(test_file).valid==false);
     
     delete_file("test/foo.txt");
     rm_dir("test");
     
 }
 
+BOOST_AUTO_TEST_CASE( tree_checksummed_file_tests )
+{
+    mk_dir("test/");
+    
+    std::vector<byte> payload(100000);
+    for(size_t i=0; i<payload.size(); ++i) {
+        payload[i] = (byte)(i%251);
+    }
+    std::string test_file = make_path("test", "index.tree");
+    
+    BOOST_CHECK(write_tree_checksummed_file(test_file, payload, 4096, 4));
+    
+    checksummed_contents result = read_tree_checksummed_file(test_file, 4);
+    BOOST_CHECK(result.valid);
+    BOOST_CHECK_EQUAL(result.contents.size(), payload.size());
+    BOOST_CHECK(bytes_equal(result.contents, payload));
+    
+    std::vector<byte> range;
+    BOOST_CHECK(read_tree_checksummed_range(test_file, 5000, 10000, range, 2));
+    BOOST_REQUIRE_EQUAL(range.size(), 10000);
+    BOOST_CHECK(std::equal(range.begin(), range.end(), payload.begin()+5000));
+    
+    BOOST_CHECK(read_tree_checksummed_range(test_file, 99990, 100, range));
+    BOOST_CHECK_EQUAL(range.size(), 10);
+    
+    // Corrupt one payload byte in chunk 20 (bytes 81920..86015).
+    long payload_start = flen(test_file)-payload.size();
+    {
+        int fd = ::open(test_file.c_str(), O_WRONLY);
+        BOOST_CHECK_EQUAL(::pwrite(fd, "X", 1, payload_start+82000), 1);
+        ::close(fd);
+    }
+    BOOST_CHECK(!read_tree_checksummed_file(test_file).valid);
+    BOOST_CHECK(read_tree_checksummed_range(test_file, 0, 81920, range));
+    BOOST_CHECK(!read_tree_checksummed_range(test_file, 81000, 1000, range));
+    BOOST_CHECK(range.empty());
+    
+    // A damaged chunk digest invalidates the root.
+    BOOST_CHECK(write_tree_checksummed_file(test_file, payload, 4096));
+    {
+        int fd = ::open(test_file.c_str(), O_WRONLY);
+        BOOST_CHECK_EQUAL(::pwrite(fd, "X", 1, SHA512::DIGEST_SIZE+16+10), 1);
+        ::close(fd);
+    }
+    BOOST_CHECK(!read_tree_checksummed_range(test_file, 0, 10, range));
+    
+    std::vector<byte> empty;
+    BOOST_CHECK(write_tree_checksummed_file(test_file, empty));
+    BOOST_CHECK(read_tree_checksummed_file(test_file).valid);
+    
+    rm_dir("test");
+}
+
 BOOST_AUTO_TEST_CASE( journal_name_tests )
 {
     std::string input("abc");
@@ -281,4 +521,1499 @@ BOOST_AUTO_TEST_CASE( sa_function_tests )
     
 }
 
+BOOST_AUTO_TEST_CASE( integrity_sidecar_tests )
+{
+    mk_dir("test/");
+    
+    std::string fname("test/series.dat");
+    std::string record(50, 'r');
+    splatfile<std::string>(fname, std::string(100, 'h'));
+    
+    BOOST_CHECK(!sa::has_integrity(fname));
+    BOOST_CHECK(sa::enable_integrity(fname, 64));
+    BOOST_CHECK(sa::has_integrity(fname));
+    BOOST_CHECK_EQUAL(sa::verify_integrity(fname).covered_length, 100);
+    
+    for(int i=0; i<10; ++i) {
+        BOOST_CHECK(sa::start(fname));
+        splatfile<std::string>(fname, record, true);
+        BOOST_CHECK(sa::commit(fname));
+    }
+    
+    // Uncommitted bytes are not covered.
+    BOOST_CHECK(sa::start(fname));
+    splatfile<std::string>(fname, record, true);
+    
+    sa::integrity_report report = sa::verify_integrity(fname, 4);
+    BOOST_CHECK(report.valid);
+    BOOST_CHECK_EQUAL(report.covered_length, 600);
+    BOOST_CHECK(report.bad_chunks.empty());
+    
+    BOOST_CHECK(sa::rollback(fname));
+    BOOST_CHECK(sa::verify_integrity(fname).valid);
+    
+    // Corrupt a byte in place inside chunk 3 (bytes 192..255).
+    {
+        int fd = ::open(fname.c_str(), O_WRONLY);
+        BOOST_CHECK_EQUAL(::pwrite(fd, "X", 1, 200), 1);
+        ::close(fd);
+    }
+    report = sa::verify_integrity(fname, 2);
+    BOOST_CHECK(!report.valid);
+    BOOST_REQUIRE_EQUAL(report.bad_chunks.size(), 1);
+    BOOST_CHECK_EQUAL(report.bad_chunks[0], 3);
+    
+    BOOST_CHECK(sa::verify_integrity(fname, 0, 192).valid);
+    BOOST_CHECK(sa::verify_integrity(fname, 256, 1000).valid);
+    BOOST_CHECK(!sa::verify_integrity(fname, 150, 60).valid);
+    
+    // Corrupting the trailing partial chunk is caught too.
+    {
+        int fd = ::open(fname.c_str(), O_WRONLY);
+        BOOST_CHECK_EQUAL(::pwrite(fd, "X", 1, 599), 1);
+        ::close(fd);
+    }
+    report = sa::verify_integrity(fname, 512, 88);
+    BOOST_REQUIRE_EQUAL(report.bad_chunks.size(), 1);
+    BOOST_CHECK_EQUAL(report.bad_chunks[0], 9);
+    
+    BOOST_CHECK(sa::disable_integrity(fname));
+    BOOST_CHECK(!sa::has_integrity(fname));
+    
+    rm_dir("test/");
+}
+
+BOOST_AUTO_TEST_CASE( commit_footer_tests )
+{
+    mk_dir("test/");
+    
+    std::string fname("test/footers.dat");
+    splatfile<std::string>(fname, "");
+    
+    sa::footer_info info;
+    BOOST_CHECK(!sa::last_footer(fname, info));
+    BOOST_CHECK(!sa::footer_recover(fname));
+    
+    std::vector<byte> record(37, 'a');
+    for(int i=0; i<5; ++i) {
+        BOOST_CHECK(sa::footer_append(fname, record, false));
+    }
+    
+    // Bytes written by hand are sealed by footer_commit.
+    BOOST_CHECK(!sa::footer_commit(fname, false));
+    BOOST_CHECK(sa::footer_start(fname));
+    BOOST_CHECK(!sa::footer_start(fname));
+    splatfile<std::string>(fname, "hand written", true);
+    BOOST_CHECK(!sa::footer_append(fname, record, false));
+    BOOST_CHECK(sa::footer_commit(fname, false));
+    
+    long committed = flen(fname);
+    BOOST_CHECK_EQUAL(committed, 5*(37+sa::footer_size)+12+sa::footer_size);
+    BOOST_CHECK(sa::last_footer(fname, info));
+    BOOST_CHECK_EQUAL(info.sequence, 6);
+    BOOST_CHECK_EQUAL(info.data_end, committed-sa::footer_size);
+    BOOST_CHECK_EQUAL(info.data_end-info.data_begin, 12);
+    
+    std::vector<sa::footer_info> ranges;
+    BOOST_CHECK(sa::footer_ranges(fname, ranges));
+    BOOST_REQUIRE_EQUAL(ranges.size(), 6);
+    BOOST_CHECK_EQUAL(ranges[0].data_begin, 0);
+    BOOST_CHECK_EQUAL(ranges[1].data_begin, 37+sa::footer_size);
+    BOOST_CHECK_EQUAL(ranges[5].sequence, 6);
+    
+    // An intact file is left alone by recovery.
+    BOOST_CHECK(sa::footer_recover(fname));
+    BOOST_CHECK_EQUAL(flen(fname), committed);
+    
+    // A torn tail, including a footer whose data never made it, is dropped.
+    BOOST_CHECK(sa::footer_append(fname, record, false));
+    {
+        int fd = ::open(fname.c_str(), O_WRONLY);
+        BOOST_CHECK_EQUAL(::pwrite(fd, "\0\0\0\0", 4, committed+10), 4);
+        ::close(fd);
+    }
+    splatfile<std::string>(fname, std::string(200000, 'g'), true);
+    // Nothing seals the garbage until recovery drops it.
+    BOOST_CHECK(!sa::footer_append(fname, record, false));
+    BOOST_CHECK(!sa::footer_start(fname));
+    BOOST_CHECK(sa::footer_recover(fname));
+    BOOST_CHECK_EQUAL(flen(fname), committed);
+    BOOST_CHECK(sa::last_footer(fname, info));
+    BOOST_CHECK_EQUAL(info.sequence, 6);
+    
+    BOOST_CHECK(sa::footer_append(fname, record, false));
+    BOOST_CHECK(sa::last_footer(fname, info));
+    BOOST_CHECK_EQUAL(info.sequence, 7);
+    
+    rm_dir("test/");
+}
 
+BOOST_AUTO_TEST_CASE( tail_recovery_tests )
+{
+    mk_dir("test/");
+    
+    std::string fname("test/tail.dat");
+    std::string orig(4096, 'o');
+    
+    // Whole records are kept, the torn one is dropped.
+    splatfile<std::string>(fname, orig);
+    BOOST_CHECK(sa::start(fname));
+    splatfile<std::string>(fname, std::string(350, 'r'), true);
+    sa::recovery_options by_record;
+    by_record.record_size = 100;
+    sa::recovery_result r = sa::recover(fname, by_record);
+    BOOST_CHECK(r.success);
+    BOOST_CHECK_EQUAL(r.journaled_length, 4096);
+    BOOST_CHECK_EQUAL(r.original_length, 4096+350);
+    BOOST_CHECK_EQUAL(r.recovered_length, 4096+300);
+    BOOST_CHECK_EQUAL(flen(fname), 4096+300);
+    BOOST_CHECK_EQUAL(sa::status(fname), sa::clean);
+    
+    // Recovery stops at the first all-zero block, and at a hole.
+    splatfile<std::string>(fname, orig);
+    BOOST_CHECK(sa::start(fname));
+    splatfile<std::string>(fname, std::string(8192, 'r'), true);
+    splatfile<std::string>(fname, std::string(4096, '\0'), true);
+    splatfile<std::string>(fname, std::string(100, 'r'), true);
+    sa::recovery_options by_byte;
+    by_byte.record_size = 1;
+    r = sa::recover(fname, by_byte);
+    BOOST_CHECK(r.success);
+    BOOST_CHECK_EQUAL(flen(fname), 4096+8192);
+    
+    BOOST_CHECK(sa::start(fname));
+    {
+        int fd = ::open(fname.c_str(), O_WRONLY);
+        BOOST_CHECK_EQUAL(::pwrite(fd, "r", 1, 4096+8192+65536), 1);
+        ::close(fd);
+    }
+    r = sa::recover(fname, by_byte);
+    BOOST_CHECK(r.success);
+    BOOST_CHECK_EQUAL(flen(fname), 4096+8192);
+    
+    // Zeros in a partial block at an unaligned start are not a torn block.
+    std::string unaligned("test/unaligned.dat");
+    splatfile<std::string>(unaligned, std::string(4000, 'o'));
+    BOOST_CHECK(sa::start(unaligned));
+    splatfile<std::string>(unaligned, std::string(96, '\0') + std::string(8000, 'r'), true);
+    r = sa::recover(unaligned, by_byte);
+    BOOST_CHECK(r.success);
+    BOOST_CHECK_EQUAL(flen(unaligned), 4000+96+8000);
+    
+    // A validator has the last word.
+    BOOST_CHECK(sa::start(fname));
+    splatfile<std::string>(fname, "good|good|bad", true);
+    sa::recovery_options framed;
+    framed.validator = [](byte const * tail, size_t length) -> size_t {
+        size_t keep = 0;
+        for(size_t i=0; i<length; ++i) {
+            if(tail[i]=='|') keep = i+1;
+        }
+        return keep;
+    };
+    r = sa::recover(fname, framed);
+    BOOST_CHECK(r.success);
+    BOOST_CHECK_EQUAL(flen(fname), 4096+8192+10);
+    
+    // Without framing, recover behaves like rollback; with nothing
+    // appended it just removes the journal.
+    BOOST_CHECK(sa::start(fname));
+    splatfile<std::string>(fname, "unframed", true);
+    r = sa::recover(fname);
+    BOOST_CHECK(r.success);
+    BOOST_CHECK_EQUAL(flen(fname), 4096+8192+10);
+    BOOST_CHECK(sa::start(fname));
+    BOOST_CHECK(!sa::rollback(fname));
+    BOOST_CHECK(sa::recover(fname).success);
+    BOOST_CHECK_EQUAL(sa::status(fname), sa::clean);
+    
+    BOOST_CHECK(!sa::recover(fname).success);
+    
+    rm_dir("test/");
+}
+
+BOOST_AUTO_TEST_CASE( basic_appender_tests )
+{
+    typedef sa::basic_appender<sa::sha1_checksum, sa::full_sync, sa::sibling_journal64, sa::flock_lock> durable_appender;
+    
+    static_assert(sa::default_appender::journal_size==SHA512::DIGEST_SIZE+4, "default journal layout changed");
+    static_assert(durable_appender::journal_size==SHA1::DIGEST_SIZE+8, "unexpected journal layout");
+    static_assert(sa::default_appender::max_length==UINT32_MAX, "unexpected length limit");
+    
+    mk_dir("test/");
+    
+    std::string fname("test/policy.txt");
+    splatfile<std::string>(fname, "append test\n");
+    long orig_len = flen(fname);
+    
+    // The default instantiation keeps the original journal format.
+    BOOST_CHECK(sa::start(fname));
+    BOOST_CHECK_EQUAL(flen(journal_name(fname)), sa::default_appender::journal_size);
+    checksummed_contents jrn = read_checksummed_file(journal_name(fname));
+    BOOST_CHECK(jrn.valid);
+    std::vector<byte>::iterator it = jrn.contents.begin();
+    BOOST_CHECK_EQUAL(extract_big_endian(it), orig_len);
+    BOOST_CHECK(sa::commit(fname));
+    
+    long journaled_len = 0;
+    BOOST_CHECK_EQUAL(durable_appender::status(fname), sa::clean);
+    BOOST_CHECK(durable_appender::start(fname));
+    BOOST_CHECK_EQUAL(durable_appender::status(fname, journaled_len), sa::hot);
+    BOOST_CHECK_EQUAL(journaled_len, orig_len);
+    BOOST_CHECK(!durable_appender::start(fname));
+    
+    // The journals of different policies do not collide.
+    BOOST_CHECK_EQUAL(sa::status(fname), sa::clean);
+    
+    splatfile<std::string>(fname, "more", true);
+    BOOST_CHECK(durable_appender::rollback(fname));
+    BOOST_CHECK_EQUAL(flen(fname), orig_len);
+    BOOST_CHECK_EQUAL(durable_appender::status(fname), sa::clean);
+    
+    BOOST_CHECK(durable_appender::start(fname));
+    splatfile<std::string>(fname, "more", true);
+    BOOST_CHECK(durable_appender::commit(fname));
+    BOOST_CHECK_EQUAL(flen(fname), orig_len+4);
+    BOOST_CHECK(!durable_appender::commit(fname));
+    
+    BOOST_CHECK(!durable_appender::start("test/does_not_exist"));
+    
+    // Untraced (and always, without <sys/sdt.h>), transactions are not
+    // numbered and nothing is kept for them.
+    std::string other("test/other.txt");
+    splatfile<std::string>(other, "");
+    BOOST_CHECK(!sa::tracing());
+    BOOST_CHECK(sa::start(fname));
+    BOOST_CHECK_EQUAL(sa::current_transaction(fname), 0);
+    BOOST_CHECK(sa::commit(fname));
+    BOOST_CHECK_EQUAL(sa::current_transaction(fname), 0);
+    
+#ifdef SA_PROBES_ENABLED
+    // With a tracer attached (as far as the semaphores say), every start
+    // numbers a new transaction, kept by file until the transaction ends.
+    ++safe_append_commit_end_semaphore;
+    BOOST_CHECK(sa::tracing());
+    BOOST_CHECK_EQUAL(sa::current_transaction(fname), 0);
+    BOOST_CHECK(sa::start(fname));
+    uint64_t seq = sa::current_transaction(fname);
+    BOOST_CHECK(seq>0);
+    BOOST_CHECK(sa::start(other));
+    BOOST_CHECK(sa::current_transaction(other)>seq);
+    splatfile<std::string>(other, "undone", true);
+    BOOST_CHECK_EQUAL(sa::current_transaction(fname), seq);
+    BOOST_CHECK(sa::commit(fname));
+    BOOST_CHECK_EQUAL(sa::current_transaction(fname), 0);
+    BOOST_CHECK(sa::rollback(other));
+    BOOST_CHECK_EQUAL(sa::current_transaction(other), 0);
+    --safe_append_commit_end_semaphore;
+#endif
+    
+    rm_dir("test/");
+}
+
+BOOST_AUTO_TEST_CASE( memory_backend_tests )
+{
+    typedef sa::memory_backend mem;
+    typedef sa::basic_appender<sa::sha512_checksum, sa::full_sync, sa::sibling_journal, sa::no_lock, mem> durable_appender;
+    typedef sa::basic_appender<sa::sha512_checksum, sa::no_sync, sa::sibling_journal, sa::no_lock, mem> lazy_appender;
+    
+    mem::reset();
+    std::string fname("mem/series.dat");
+    std::string base("base;");
+    BOOST_CHECK(mem::write_file(fname, reinterpret_cast<byte const *>(base.data()), base.size()));
+    BOOST_CHECK(!file_exists(fname));
+    
+    auto append = [&](std::string const & s) {
+        int fd = mem::open(fname, O_WRONLY);
+        uint64_t size = 0;
+        bool success = mem::size(fd, size) && mem::pwrite_all(fd, reinterpret_cast<byte const *>(s.data()), s.size(), size);
+        return mem::close(fd) && success;
+    };
+    
+    // A committed append survives power loss.
+    BOOST_CHECK(durable_appender::start(fname));
+    BOOST_CHECK(append("one;"));
+    BOOST_CHECK(durable_appender::commit(fname));
+    mem::power_loss();
+    BOOST_CHECK_EQUAL(mem::length(fname), 9);
+    BOOST_CHECK_EQUAL(durable_appender::status(fname), sa::clean);
+    
+    // An interrupted one leaves a durable journal for recovery.
+    BOOST_CHECK(durable_appender::start(fname));
+    BOOST_CHECK(append("two;"));
+    int fd = mem::open(fname, O_RDONLY);
+    BOOST_CHECK(mem::datasync(fd));
+    mem::power_loss();
+    BOOST_CHECK_EQUAL(durable_appender::status(fname), sa::hot);
+    BOOST_CHECK(durable_appender::rollback(fname));
+    BOOST_CHECK_EQUAL(mem::length(fname), 9);
+    
+    // Without syncs, neither the journal nor the data is guaranteed.
+    BOOST_CHECK(lazy_appender::start(fname));
+    BOOST_CHECK(append("three;"));
+    BOOST_CHECK(lazy_appender::commit(fname));
+    mem::power_loss();
+    BOOST_CHECK_EQUAL(mem::length(fname), 9);
+    
+    std::vector<byte> contents;
+    BOOST_CHECK(mem::read_file(fname, contents));
+    BOOST_CHECK_EQUAL(std::string(contents.begin(), contents.end()), "base;one;");
+    mem::reset();
+    BOOST_CHECK(!mem::exists(fname));
+}
+
+BOOST_AUTO_TEST_CASE( crash_injection_tests )
+{
+    typedef sa::basic_appender<sa::sha512_checksum, sa::full_sync, sa::sibling_journal, sa::no_lock, sa::memory_backend> durable_appender;
+    
+    std::vector<byte> initial(100, 'i');
+    std::vector<std::vector<byte>> appends;
+    for(int i=0; i<4; ++i) {
+        appends.push_back(std::vector<byte>(50+i, (byte)('a'+i)));
+    }
+    
+    typedef sa::basic_appender<sa::sha512_checksum, sa::data_sync, sa::sibling_journal, sa::no_lock, sa::memory_backend> data_appender;
+    
+    // Whole-or-nothing loss, and torn appends.
+    for(double keep : { 0.0, 0.5, 1.0 }) {
+        sa::crash_report r = sa::crash_every_operation<durable_appender>("mem/crash.dat", initial, appends, keep);
+        BOOST_CHECK(r.crash_points>4*5);
+        BOOST_CHECK_EQUAL(r.not_a_prefix, 0);
+        BOOST_CHECK_EQUAL(r.lost_commits, 0);
+        BOOST_CHECK_EQUAL(r.failed_recoveries, 0);
+        
+        r = sa::crash_every_operation<data_appender>("mem/crash.dat", initial, appends, keep);
+        BOOST_CHECK_EQUAL(r.not_a_prefix, 0);
+        BOOST_CHECK_EQUAL(r.lost_commits, 0);
+        BOOST_CHECK_EQUAL(r.failed_recoveries, 0);
+    }
+}
+
+BOOST_AUTO_TEST_CASE( coalescing_appender_tests )
+{
+    mk_dir("test/");
+    
+    std::string fname("test/samples.dat");
+    splatfile<std::string>(fname, "");
+    
+    std::array<byte, 32> sample;
+    for(size_t i=0; i<sample.size(); ++i) {
+        sample[i] = (byte)i;
+    }
+    
+    {
+        sa::coalescing_appender::options opts;
+        opts.capacity = 1024;
+        opts.flush_threshold = 512;
+        opts.max_delay = std::chrono::milliseconds(20);
+        sa::coalescing_appender buf(fname, opts);
+        
+        std::vector<byte> huge(2048);
+        BOOST_CHECK_EQUAL(buf.try_append(huge.data(), huge.size()), sa::coalescing_appender::too_large);
+        BOOST_CHECK(!buf.append(huge.data(), huge.size(), std::chrono::milliseconds(1)));
+        
+        // Thousands of tiny records become a handful of transactions.
+        for(int i=0; i<1000; ++i) {
+            BOOST_REQUIRE(buf.append(sample.data(), sample.size(), std::chrono::milliseconds(5000)));
+        }
+        BOOST_CHECK(buf.flush());
+        BOOST_CHECK_EQUAL(buf.buffered(), 0);
+        BOOST_CHECK_EQUAL(flen(fname), 1000*32);
+        BOOST_CHECK(buf.flush_count()>=32);
+        BOOST_CHECK(buf.flush_count()<1000);
+        BOOST_CHECK_EQUAL(buf.failed_flush_count(), 0);
+        BOOST_CHECK_EQUAL(sa::status(fname), sa::clean);
+        
+        // A lone record is flushed by the deadline.
+        BOOST_CHECK_EQUAL(buf.try_append(sample.data(), sample.size()), sa::coalescing_appender::accepted);
+        for(int i=0; i<200 && flen(fname)!=1001*32; ++i) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        }
+        BOOST_CHECK_EQUAL(flen(fname), 1001*32);
+        
+        BOOST_CHECK_EQUAL(buf.try_append(sample.data(), sample.size()), sa::coalescing_appender::accepted);
+    }
+    // Destruction flushes what is left.
+    BOOST_CHECK_EQUAL(flen(fname), 1002*32);
+    
+    std::ifstream in(fname, std::ios_base::binary);
+    std::vector<char> contents((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    bool in_order = true;
+    for(size_t i=0; i<contents.size(); ++i) {
+        in_order = in_order && (byte)contents[i]==sample[i%32];
+    }
+    BOOST_CHECK(in_order);
+    
+    // A hot journal with nothing appended (a flush that failed before its
+    // first byte) cannot be rolled back, and must not stall the flusher.
+    BOOST_CHECK(sa::start(fname));
+    {
+        sa::coalescing_appender buf(fname);
+        BOOST_CHECK_EQUAL(buf.try_append(sample.data(), sample.size()), sa::coalescing_appender::accepted);
+        BOOST_CHECK(buf.close());
+        BOOST_CHECK_EQUAL(buf.failed_flush_count(), 0);
+    }
+    BOOST_CHECK_EQUAL(flen(fname), 1003*32);
+    BOOST_CHECK_EQUAL(sa::status(fname), sa::clean);
+    
+    // Nor must a journal torn while it was written.
+    std::string jname;
+    sidecar_name(fname, "j_", ".jrn", jname);
+    splatfile<std::string>(jname, "torn");
+    BOOST_CHECK_EQUAL(sa::status(fname), sa::dirty);
+    {
+        sa::coalescing_appender buf(fname);
+        BOOST_CHECK_EQUAL(buf.try_append(sample.data(), sample.size()), sa::coalescing_appender::accepted);
+        BOOST_CHECK(buf.close());
+    }
+    BOOST_CHECK_EQUAL(flen(fname), 1004*32);
+    BOOST_CHECK_EQUAL(sa::status(fname), sa::clean);
+    
+    rm_dir("test/");
+}
+
+BOOST_AUTO_TEST_CASE( lz_codec_tests )
+{
+    std::vector<std::vector<byte>> inputs;
+    for(size_t n=0; n<40; ++n) {
+        inputs.push_back(std::vector<byte>(n, (byte)'a'));
+    }
+    std::vector<byte> text;
+    for(int i=0; i<5000; ++i) {
+        std::string row = "series=cpu,host=db" + std::to_string(i%7) + " value=" + std::to_string(i*31%1000) + "\n";
+        text.insert(text.end(), row.begin(), row.end());
+    }
+    inputs.push_back(text);
+    std::vector<byte> noise(100000);
+    uint32_t x = 12345;
+    for(byte & b : noise) {
+        x = x*1103515245+12345;
+        b = (byte)(x>>16);
+    }
+    inputs.push_back(noise);
+    
+    for(std::vector<byte> const & in : inputs) {
+        std::vector<byte> packed(lz_compress_bound(in.size()));
+        size_t n = lz_compress(in.data(), in.size(), packed.data());
+        BOOST_REQUIRE(n<=packed.size());
+        std::vector<byte> out(in.size());
+        BOOST_CHECK(lz_decompress(packed.data(), n, out.data(), out.size()));
+        BOOST_CHECK(out==in);
+    }
+    
+    std::vector<byte> packed(lz_compress_bound(text.size()));
+    size_t n = lz_compress(text.data(), text.size(), packed.data());
+    BOOST_CHECK(n<text.size()/4);
+    std::vector<byte> out(text.size());
+    BOOST_CHECK(!lz_decompress(packed.data(), n-1, out.data(), out.size()));
+    BOOST_CHECK(!lz_decompress(packed.data(), n, out.data(), out.size()-1));
+}
+
+BOOST_AUTO_TEST_CASE( compressed_blocks_tests )
+{
+    mk_dir("test/");
+    
+    std::string fname("test/series.lz");
+    splatfile<std::string>(fname, "");
+    
+    std::vector<byte> expected;
+    for(int batch=0; batch<3; ++batch) {
+        std::vector<byte> data;
+        for(int i=0; i<20000; ++i) {
+            std::string row = std::to_string(batch) + ",temp," + std::to_string(i%50) + "\n";
+            data.insert(data.end(), row.begin(), row.end());
+        }
+        BOOST_CHECK(sa::compressed_append(fname, data, 16*1024, 4));
+        expected.insert(expected.end(), data.begin(), data.end());
+    }
+    BOOST_CHECK_EQUAL(sa::status(fname), sa::clean);
+    BOOST_CHECK(flen(fname)<(long)expected.size()/4);
+    
+    std::vector<sa::compressed_block> blocks;
+    BOOST_CHECK(sa::index_compressed_blocks(fname, blocks));
+    BOOST_CHECK(blocks.size()>=expected.size()/(16*1024));
+    BOOST_CHECK_EQUAL(blocks.back().raw_offset+blocks.back().raw_length, expected.size());
+    
+    std::vector<byte> contents;
+    BOOST_CHECK(sa::read_compressed_file(fname, contents, 4));
+    BOOST_CHECK(contents==expected);
+    BOOST_CHECK(sa::read_compressed_range(fname, 40000, 50000, contents));
+    BOOST_CHECK(std::equal(contents.begin(), contents.end(), expected.begin()+40000));
+    BOOST_CHECK_EQUAL(contents.size(), 50000);
+    
+    // An interrupted batch rolls back to the last frame boundary.
+    long committed = flen(fname);
+    BOOST_CHECK(sa::start(fname));
+    BOOST_CHECK(sa::write_compressed_blocks(fname, expected.data(), 100000));
+    BOOST_CHECK_EQUAL(::truncate(fname.c_str(), flen(fname)-10), 0);
+    BOOST_CHECK(!sa::read_compressed_file(fname, contents));
+    BOOST_CHECK(sa::rollback(fname));
+    BOOST_CHECK_EQUAL(flen(fname), committed);
+    BOOST_CHECK(sa::read_compressed_file(fname, contents));
+    BOOST_CHECK(contents==expected);
+    
+    // A flipped bit is caught by the frame check.
+    int fd = ::open(fname.c_str(), O_RDWR);
+    byte b = 0;
+    BOOST_REQUIRE(pread_all(fd, &b, 1, blocks[1].offset+sa::compressed_frame_header_size+3));
+    b ^= 1;
+    BOOST_REQUIRE(pwrite_all(fd, &b, 1, blocks[1].offset+sa::compressed_frame_header_size+3));
+    ::close(fd);
+    BOOST_CHECK(!sa::read_compressed_file(fname, contents));
+    BOOST_CHECK(contents.empty());
+    
+    // A header claiming a huge block is refused before anything is sized
+    // from it.
+    fd = ::open(fname.c_str(), O_RDWR);
+    std::array<byte, 4> huge = {{ 0xff, 0xff, 0xff, 0xf0 }};
+    BOOST_REQUIRE(pwrite_all(fd, huge.data(), huge.size(), blocks[0].offset+8));
+    ::close(fd);
+    BOOST_CHECK(!sa::index_compressed_blocks(fname, blocks));
+    BOOST_CHECK(blocks.empty());
+    BOOST_CHECK(!sa::read_compressed_range(fname, 0, 10, contents));
+    BOOST_CHECK(!sa::compressed_append(fname, expected, sa::max_compressed_block_size+1));
+    BOOST_CHECK_EQUAL(sa::status(fname), sa::clean);
+    
+    rm_dir("test/");
+}
+
+BOOST_AUTO_TEST_CASE( committed_length_tests )
+{
+    mk_dir("test/");
+    
+    std::string fname("test/live.dat");
+    splatfile<std::string>(fname, "0123456789");
+    
+    BOOST_CHECK(!sa::committed_length_reader(fname).ok());
+    {
+        sa::length_publisher publisher(fname);
+        BOOST_REQUIRE(publisher.ok());
+        sa::committed_length_reader reader(fname);
+        BOOST_REQUIRE(reader.ok());
+        BOOST_CHECK_EQUAL(reader.committed(), 10);
+        
+        // Nothing new: the wait times out with the old length.
+        BOOST_CHECK_EQUAL(reader.wait_for_growth(10, std::chrono::milliseconds(10)), 10);
+        
+        uint64_t seen = 0;
+        std::thread tail([&]() { seen = reader.wait_for_growth(10, std::chrono::milliseconds(5000)); });
+        BOOST_CHECK(sa::start(fname));
+        splatfile<std::string>(fname, "abcdef", true);
+        // In-flight bytes are not published.
+        BOOST_CHECK_EQUAL(reader.committed(), 10);
+        BOOST_CHECK(sa::commit(fname));
+        tail.join();
+        BOOST_CHECK_EQUAL(seen, 16);
+        
+        // Rolled back bytes never show up.
+        BOOST_CHECK(sa::start(fname));
+        splatfile<std::string>(fname, "torn", true);
+        BOOST_CHECK(sa::rollback(fname));
+        BOOST_CHECK_EQUAL(reader.committed(), 16);
+    }
+    // The sidecar outlives the publisher, and a new publisher resumes from
+    // the journaled length of a transaction in progress.
+    BOOST_CHECK_EQUAL(sa::committed_length_reader(fname).committed(), 16);
+    BOOST_CHECK(sa::start(fname));
+    splatfile<std::string>(fname, "xyz", true);
+    {
+        sa::length_publisher publisher(fname);
+        BOOST_CHECK_EQUAL(sa::committed_length_reader(fname).committed(), 16);
+        BOOST_CHECK(sa::commit(fname));
+        BOOST_CHECK_EQUAL(sa::committed_length_reader(fname).committed(), 19);
+    }
+    
+    rm_dir("test/");
+}
+
+BOOST_AUTO_TEST_CASE( snapshot_reader_tests )
+{
+    mk_dir("test/");
+    
+    std::string fname("test/scan.dat");
+    BOOST_CHECK(!sa::snapshot(fname).ok());
+    splatfile<std::string>(fname, "");
+    
+    sa::snapshot empty(fname);
+    BOOST_CHECK(empty.ok());
+    BOOST_CHECK(empty.data().empty());
+    
+    splatfile<std::string>(fname, "committed;");
+    BOOST_CHECK(sa::start(fname));
+    splatfile<std::string>(fname, "in flight", true);
+    
+    sa::snapshot snap(fname);
+    BOOST_REQUIRE(snap.ok());
+    BOOST_CHECK_EQUAL(std::string(snap.data().begin(), snap.data().end()), "committed;");
+    BOOST_CHECK(!snap.refresh());
+    
+    BOOST_CHECK(sa::commit(fname));
+    BOOST_CHECK(empty.refresh());
+    BOOST_CHECK(snap.refresh());
+    BOOST_CHECK_EQUAL(std::string(snap.data().begin(), snap.data().end()), "committed;in flight");
+    BOOST_CHECK_EQUAL(empty.length(), snap.length());
+    
+    // Growing past a page remaps the view.
+    std::string big(10000, 'x');
+    BOOST_CHECK(sa::start(fname));
+    splatfile<std::string>(fname, big, true);
+    BOOST_CHECK(sa::commit(fname));
+    BOOST_CHECK(snap.refresh());
+    BOOST_CHECK_EQUAL(snap.length(), 19+big.size());
+    BOOST_CHECK_EQUAL(snap.data()[snap.length()-1], 'x');
+    
+    // With a publisher, the published length is used.
+    {
+        sa::length_publisher publisher(fname);
+        sa::snapshot published(fname);
+        BOOST_CHECK_EQUAL(published.length(), snap.length());
+        BOOST_CHECK(sa::start(fname));
+        splatfile<std::string>(fname, "more", true);
+        BOOST_CHECK(!published.refresh());
+        BOOST_CHECK(sa::commit(fname));
+        BOOST_CHECK(published.refresh());
+        BOOST_CHECK_EQUAL(published.length(), snap.length()+4);
+        
+        // A stale published length never maps past the end of the file.
+        BOOST_REQUIRE_EQUAL(::truncate(fname.c_str(), 5), 0);
+        sa::snapshot truncated(fname);
+        BOOST_REQUIRE(truncated.ok());
+        BOOST_CHECK_EQUAL(truncated.length(), 5);
+        BOOST_CHECK(!published.refresh());
+        BOOST_CHECK_EQUAL(published.length(), 5);
+        BOOST_CHECK_EQUAL(std::string(published.data().begin(), published.data().end()), "commi");
+    }
+    
+    rm_dir("test/");
+}
+
+BOOST_AUTO_TEST_CASE( status_many_tests )
+{
+    mk_dir("test/");
+    mk_dir("test/a/");
+    mk_dir("test/b/");
+    
+    std::vector<std::string> paths;
+    for(int i=0; i<60; ++i) {
+        std::string fname = std::string(i%2 ? "test/a/" : "test/b/") + "series" + std::to_string(i);
+        splatfile<std::string>(fname, "data");
+        if(i%5==0) {
+            BOOST_CHECK(sa::start(fname));
+        } else if(i%7==0) {
+            splatfile<std::string>(journal_name(fname), "garbage");
+        }
+        paths.push_back(fname);
+    }
+    paths.push_back("test/missing/series");
+    paths.push_back("test/a/never-written");
+    
+    std::vector<sa::status_value> many = sa::status_many(paths, 4);
+    BOOST_REQUIRE_EQUAL(many.size(), paths.size());
+    for(size_t i=0; i<paths.size(); ++i) {
+        BOOST_CHECK_EQUAL(many[i], sa::status(paths[i]));
+    }
+    BOOST_CHECK_EQUAL(many[0], sa::hot);
+    BOOST_CHECK_EQUAL(many[7], sa::dirty);
+    BOOST_CHECK_EQUAL(many[1], sa::clean);
+    BOOST_CHECK_EQUAL(many[60], sa::clean);
+    
+    std::vector<sa::status_value> some = sa::status_many(paths.begin(), paths.begin()+6);
+    BOOST_CHECK(std::equal(some.begin(), some.end(), many.begin()));
+    BOOST_CHECK(sa::status_many(std::vector<std::string>()).empty());
+    
+    rm_dir("test/");
+}
+
+BOOST_AUTO_TEST_CASE( segmented_log_tests )
+{
+    mk_dir("test/");
+    
+    sa::segment_options opts;
+    opts.max_segment_size = 100;
+    std::vector<byte> expected;
+    {
+        sa::segmented_log log("test/series", opts);
+        BOOST_REQUIRE(log.ok());
+        BOOST_CHECK(file_exists(log.manifest_path()));
+        BOOST_CHECK_EQUAL(log.segments().size(), 1);
+        
+        for(int i=0; i<25; ++i) {
+            std::vector<byte> record(30, (byte)i);
+            BOOST_CHECK(log.append(record));
+            expected.insert(expected.end(), record.begin(), record.end());
+        }
+        // Three 30-byte records fit in 100 bytes; records are never split.
+        BOOST_CHECK_EQUAL(log.segments().size(), 9);
+        BOOST_CHECK_EQUAL(log.length(), expected.size());
+        BOOST_CHECK_EQUAL(log.segments()[1].offset, 90);
+        BOOST_CHECK_EQUAL(flen(log.segments()[0].path), 90);
+        
+        // An oversized record gets a segment of its own.
+        std::vector<byte> big(250, 0xee);
+        BOOST_CHECK(log.append(big));
+        expected.insert(expected.end(), big.begin(), big.end());
+        BOOST_CHECK_EQUAL(log.segments().back().length, 250);
+        
+        std::vector<byte> contents;
+        BOOST_CHECK(log.read(0, UINT64_MAX, contents));
+        BOOST_CHECK(contents==expected);
+        BOOST_CHECK(log.read(80, 50, contents));
+        BOOST_CHECK(std::equal(contents.begin(), contents.end(), expected.begin()+80));
+        BOOST_CHECK_EQUAL(contents.size(), 50);
+    }
+    
+    // A crash mid-append is rolled back on open, touching only the tail.
+    sa::segmented_log before("test/series", opts);
+    std::string tail = before.segments().back().path;
+    BOOST_CHECK(sa::start(tail));
+    splatfile<std::string>(tail, "torn", true);
+    {
+        sa::segmented_log log("test/series", opts);
+        BOOST_REQUIRE(log.ok());
+        BOOST_CHECK_EQUAL(sa::status(tail), sa::clean);
+        BOOST_CHECK_EQUAL(log.length(), expected.size());
+        BOOST_CHECK_EQUAL(log.segments().size(), 10);
+        
+        std::vector<byte> record(10, 0x11);
+        BOOST_CHECK(log.rotate());
+        BOOST_CHECK(log.rotate());
+        BOOST_CHECK_EQUAL(log.segments().size(), 11);
+        BOOST_CHECK(log.append(record));
+        expected.insert(expected.end(), record.begin(), record.end());
+        
+        // A journal left hot by a failed commit does not block the segment.
+        std::string active = log.segments().back().path;
+        BOOST_CHECK(sa::start(active));
+        splatfile<std::string>(active, "lost", true);
+        BOOST_CHECK(log.append(record));
+        expected.insert(expected.end(), record.begin(), record.end());
+        BOOST_CHECK_EQUAL(sa::status(active), sa::clean);
+        BOOST_CHECK_EQUAL(flen(active), 20);
+        
+        // So does a torn journal.
+        std::string jname;
+        sidecar_name(active, "j_", ".jrn", jname);
+        splatfile<std::string>(jname, "torn");
+        BOOST_CHECK(log.append(record));
+        expected.insert(expected.end(), record.begin(), record.end());
+        BOOST_CHECK_EQUAL(sa::status(active), sa::clean);
+        splatfile<std::string>(jname, "torn");
+    }
+    // Also when the log is opened over it.
+    {
+        sa::segmented_log log("test/series", opts);
+        BOOST_REQUIRE(log.ok());
+        BOOST_CHECK_EQUAL(sa::status(log.segments().back().path), sa::clean);
+        std::vector<byte> record(10, 0x22);
+        BOOST_CHECK(log.append(record));
+        expected.insert(expected.end(), record.begin(), record.end());
+    }
+    sa::segmented_log reopened("test/series", opts);
+    std::vector<byte> contents;
+    BOOST_CHECK(reopened.read(0, UINT64_MAX, contents));
+    BOOST_CHECK(contents==expected);
+    
+    // A damaged manifest is refused rather than guessed at.
+    splatfile<std::string>(reopened.manifest_path(), "garbage");
+    BOOST_CHECK(!sa::segmented_log("test/series", opts).ok());
+    
+    rm_dir("test/");
+}
+
+BOOST_AUTO_TEST_CASE( retention_tests )
+{
+    mk_dir("test/");
+    
+    std::string fname("test/history.dat");
+    std::vector<byte> data(3*65536);
+    for(size_t i=0; i<data.size(); ++i) {
+        data[i] = (byte)(i/4096+1);
+    }
+    splatfile<byte>(fname, data);
+    BOOST_CHECK_EQUAL(sa::logical_start(fname), 0);
+    
+    BOOST_CHECK(sa::retain_from(fname, 65536+100));
+    BOOST_CHECK_EQUAL(sa::logical_start(fname), 65536+100);
+    BOOST_CHECK_EQUAL(flen(fname), data.size());
+    std::ifstream in(fname, std::ios_base::binary);
+    std::vector<char> contents((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    BOOST_CHECK(std::equal(contents.begin()+65536+100, contents.end(), data.begin()+65536+100));
+    // Punched bytes read back as zeros where the file system supports it.
+    BOOST_CHECK(contents[100]==0 || (byte)contents[100]==data[100]);
+    
+    BOOST_CHECK(!sa::retain_from(fname, 100));
+    BOOST_CHECK(!sa::retain_from(fname, data.size()+1));
+    
+    // Bytes of a transaction in progress cannot be dropped yet.
+    BOOST_CHECK(sa::start(fname));
+    splatfile<std::string>(fname, "pending", true);
+    BOOST_CHECK(!sa::retain_from(fname, data.size()+1));
+    BOOST_CHECK(sa::commit(fname));
+    BOOST_CHECK(sa::retain_from(fname, data.size()+1));
+    
+    // A torn retention journal is discarded; an intact one is finished.
+    std::string jname;
+    sidecar_name(fname, "r_", ".rtn", jname);
+    splatfile<std::string>(jname, "torn");
+    BOOST_CHECK(sa::recover_retention(fname));
+    BOOST_CHECK(!file_exists(jname));
+    BOOST_CHECK_EQUAL(sa::logical_start(fname), data.size()+1);
+    
+    std::vector<byte> record = { 'S', 'A', 'R', 'J', 0, 0, 0, 0, 0, 0, 0, 0 };
+    encode_big_endian64(record.begin()+4, (uint64_t)data.size()+5);
+    BOOST_CHECK(replace_checksummed_file(jname, record));
+    BOOST_CHECK(sa::recover_retention(fname));
+    BOOST_CHECK(!file_exists(jname));
+    BOOST_CHECK_EQUAL(sa::logical_start(fname), data.size()+5);
+    
+    // Verification and replication skip the punched head.
+    std::string sname("test/sealed.dat");
+    splatfile<byte>(sname, data);
+    BOOST_REQUIRE(sa::enable_integrity(sname, 65536));
+    BOOST_CHECK(sa::retain_from(sname, 65536+100));
+    sa::integrity_report report = sa::verify_integrity(sname);
+    BOOST_CHECK(report.valid);
+    BOOST_CHECK(report.bad_chunks.empty());
+    BOOST_CHECK(sa::verify_integrity(sname, 0, 65536, 1).valid);
+    {
+        sa::replicator rep(sname, "test/sealed.mirror");
+        BOOST_REQUIRE(rep.ok());
+        BOOST_CHECK(sa::start(sname));
+        splatfile<std::string>(sname, "tail", true);
+        BOOST_CHECK(sa::commit(sname));
+        BOOST_CHECK(rep.wait_caught_up(std::chrono::seconds(5)));
+    }
+    std::ifstream mirror_in("test/sealed.mirror", std::ios_base::binary);
+    std::vector<char> mirrored((std::istreambuf_iterator<char>(mirror_in)), std::istreambuf_iterator<char>());
+    BOOST_REQUIRE_EQUAL(mirrored.size(), data.size()+4);
+    BOOST_CHECK(std::equal(data.begin()+65536+100, data.end(), mirrored.begin()+65536+100));
+    BOOST_CHECK_EQUAL(mirrored[65536+99], 0);
+    
+    rm_dir("test/");
+}
+
+BOOST_AUTO_TEST_CASE( replication_tests )
+{
+    mk_dir("test/");
+    mk_dir("test/mirror/");
+    
+    std::string fname("test/primary.dat");
+    std::string mname("test/mirror/primary.dat");
+    splatfile<std::string>(fname, "existing;");
+    
+    std::string expected("existing;");
+    {
+        sa::replication_options opts;
+        opts.max_delay = std::chrono::milliseconds(20);
+        sa::replicator rep(fname, mname, opts);
+        BOOST_REQUIRE(rep.ok());
+        BOOST_CHECK(rep.wait_caught_up(std::chrono::milliseconds(5000)));
+        BOOST_CHECK_EQUAL(flen(mname), 9);
+        
+        // Uncommitted bytes are never shipped.
+        BOOST_CHECK(sa::start(fname));
+        splatfile<std::string>(fname, "in flight", true);
+        std::this_thread::sleep_for(std::chrono::milliseconds(40));
+        BOOST_CHECK_EQUAL(rep.shipped_length(), 9);
+        BOOST_CHECK(sa::rollback(fname));
+        
+        uint64_t batches = rep.batch_count();
+        for(int i=0; i<20; ++i) {
+            std::string record = "record" + std::to_string(i) + ";";
+            BOOST_CHECK(sa::start(fname));
+            splatfile<std::string>(fname, record, true);
+            BOOST_CHECK(sa::commit(fname));
+            expected += record;
+        }
+        BOOST_CHECK(rep.wait_caught_up(std::chrono::milliseconds(5000)));
+        BOOST_CHECK_EQUAL(rep.lag(), 0);
+        BOOST_CHECK(rep.batch_count()-batches<20);
+        BOOST_CHECK_EQUAL(rep.failed_batch_count(), 0);
+        
+        BOOST_CHECK(sa::start(fname));
+        splatfile<std::string>(fname, "last;", true);
+        BOOST_CHECK(sa::commit(fname));
+        expected += "last;";
+    }
+    // Destruction ships what is outstanding.
+    std::ifstream in(mname, std::ios_base::binary);
+    std::string mirrored((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    BOOST_CHECK_EQUAL(mirrored, expected);
+    
+    // A mirror ahead of the source is cut back to the committed length.
+    splatfile<std::string>(mname, "junk", true);
+    {
+        sa::replicator rep(fname, mname);
+        BOOST_CHECK(rep.wait_caught_up(std::chrono::milliseconds(5000)));
+    }
+    BOOST_CHECK_EQUAL(flen(mname), (long)expected.size());
+    
+    rm_dir("test/");
+}
+
+BOOST_AUTO_TEST_CASE( safe_modify_tests )
+{
+    mk_dir("test/");
+    
+    std::string fname("test/index.dat");
+    std::vector<byte> original(5*4096+100);
+    for(size_t i=0; i<original.size(); ++i) {
+        original[i] = (byte)(i*7);
+    }
+    splatfile<byte>(fname, original);
+    
+    std::vector<byte> patch(600, 0xab);
+    std::vector<byte> expected = original;
+    std::copy(patch.begin(), patch.end(), expected.begin()+4000);
+    BOOST_CHECK(sa::safe_modify(fname, 4000, patch.data(), patch.size()));
+    BOOST_CHECK_EQUAL(sa::modify_status(fname), sa::clean);
+    std::ifstream in(fname, std::ios_base::binary);
+    std::vector<byte> contents((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    BOOST_CHECK(std::equal(contents.begin(), contents.end(), expected.begin()));
+    in.close();
+    
+    // Crash part way through: pages 0-1 (one run), page 4 to the end, and
+    // growth past the end.
+    std::vector<sa::modify_range> ranges;
+    sa::modify_range a = { 10, patch.data(), 100 };
+    sa::modify_range b = { 4096+5, patch.data(), 100 };
+    sa::modify_range c = { 4*4096+6, patch.data(), patch.size()+4096 };
+    ranges.push_back(a);
+    ranges.push_back(b);
+    ranges.push_back(c);
+    BOOST_CHECK(sa::modify_start(fname, ranges));
+    BOOST_CHECK_EQUAL(sa::modify_status(fname), sa::hot);
+    BOOST_CHECK(!sa::modify_start(fname, ranges));
+    std::string jname;
+    sidecar_name(fname, "u_", ".und", jname);
+    BOOST_CHECK_EQUAL(flen(jname), 64+16+2*16+2*4096+4096+100);
+    
+    int fd = ::open(fname.c_str(), O_WRONLY);
+    std::vector<byte> big(8192, 0xcd);
+    BOOST_CHECK(pwrite_all(fd, big.data(), 50, 10));
+    BOOST_CHECK(pwrite_all(fd, big.data(), big.size(), 4*4096+6));
+    ::close(fd);
+    BOOST_CHECK(sa::modify_rollback(fname));
+    BOOST_CHECK_EQUAL(sa::modify_status(fname), sa::clean);
+    std::ifstream in2(fname, std::ios_base::binary);
+    contents.assign(std::istreambuf_iterator<char>(in2), std::istreambuf_iterator<char>());
+    BOOST_CHECK_EQUAL(contents.size(), expected.size());
+    BOOST_CHECK(std::equal(contents.begin(), contents.end(), expected.begin()));
+    
+    // A corrupt journal is left for inspection, not applied.
+    splatfile<std::string>(jname, "garbage");
+    BOOST_CHECK_EQUAL(sa::modify_status(fname), sa::dirty);
+    BOOST_CHECK(!sa::modify_rollback(fname));
+    BOOST_CHECK(!sa::safe_modify(fname, 0, patch.data(), 1));
+    BOOST_CHECK(sa::modify_cleanup(fname));
+    BOOST_CHECK(!sa::modify_cleanup(fname));
+    BOOST_CHECK_EQUAL(sa::modify_status(fname), sa::clean);
+    
+    // The integrity sidecar and a mirror follow changes made in place.
+    BOOST_REQUIRE(sa::enable_integrity(fname, 4096));
+    {
+        sa::replicator rep(fname, "test/index.mirror");
+        BOOST_REQUIRE(rep.ok());
+        BOOST_CHECK(rep.wait_caught_up(std::chrono::seconds(5)));
+        BOOST_CHECK(sa::safe_modify(fname, 4096+10, patch.data(), patch.size()));
+        BOOST_CHECK(sa::safe_modify(fname, expected.size()-10, patch.data(), 20));
+        BOOST_CHECK(rep.wait_caught_up(std::chrono::seconds(5)));
+    }
+    std::copy(patch.begin(), patch.end(), expected.begin()+4096+10);
+    expected.resize(expected.size()+10);
+    std::copy(patch.begin(), patch.begin()+20, expected.end()-20);
+    sa::integrity_report report = sa::verify_integrity(fname);
+    BOOST_CHECK(report.valid);
+    BOOST_CHECK_EQUAL(report.covered_length, expected.size());
+    std::ifstream in3("test/index.mirror", std::ios_base::binary);
+    contents.assign(std::istreambuf_iterator<char>(in3), std::istreambuf_iterator<char>());
+    BOOST_CHECK(contents==expected);
+    
+    rm_dir("test/");
+}
+
+static std::string file_contents(std::string const & fname) {
+    std::ifstream in(fname, std::ios_base::binary);
+    return std::string((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+}
+
+BOOST_AUTO_TEST_CASE( redo_log_tests )
+{
+    mk_dir("test/");
+    
+    std::string files[2] = { "test/wal_a.dat", "test/wal_b.dat" };
+    std::string expected[2] = { "a:", "b:" };
+    splatfile<std::string>(files[0], expected[0]);
+    splatfile<std::string>(files[1], expected[1]);
+    
+    sa::redo_log_options opts;
+    opts.capacity = 4096;
+    opts.apply_delay = std::chrono::milliseconds(5);
+    {
+        sa::redo_log wal("test/redo.log", opts);
+        BOOST_REQUIRE(wal.ok());
+        BOOST_CHECK_EQUAL(flen("test/redo.log"), 4096);
+        // Far more than the log holds, so it must start over several times.
+        for(int i=0; i<200; ++i) {
+            std::string record = std::to_string(i) + ";";
+            BOOST_REQUIRE(wal.append(files[i%2], std::vector<byte>(record.begin(), record.end())));
+            expected[i%2] += record;
+        }
+        BOOST_CHECK(wal.drain());
+        BOOST_CHECK_EQUAL(wal.pending_bytes(), 0);
+        BOOST_CHECK(wal.applied_batch_count()>0);
+        BOOST_CHECK_EQUAL(file_contents(files[0]), expected[0]);
+        BOOST_CHECK_EQUAL(file_contents(files[1]), expected[1]);
+        BOOST_CHECK(!wal.append(files[0], std::vector<byte>(5000)));
+        BOOST_CHECK(!wal.append("test/missing.dat", std::vector<byte>(5)));
+    }
+    
+    // Crash before anything was applied: keep the log, lose the data files'
+    // new bytes, and replay.
+    opts.apply_delay = std::chrono::milliseconds(60000);
+    std::string log_copy, ckpt_copy;
+    {
+        sa::redo_log wal("test/redo.log", opts);
+        BOOST_CHECK_EQUAL(wal.replayed_record_count(), 0);
+        for(int i=0; i<10; ++i) {
+            std::string record = "late" + std::to_string(i) + ";";
+            BOOST_REQUIRE(wal.append(files[i%2], std::vector<byte>(record.begin(), record.end())));
+        }
+        BOOST_CHECK(wal.pending_bytes()>0);
+        log_copy = file_contents("test/redo.log");
+        ckpt_copy = file_contents("test/redo.log.ckpt");
+    }
+    std::string applied[2] = { file_contents(files[0]), file_contents(files[1]) };
+    splatfile<std::string>(files[0], expected[0]);
+    splatfile<std::string>(files[1], expected[1]+"to");
+    splatfile<std::string>("test/redo.log", log_copy);
+    splatfile<std::string>("test/redo.log.ckpt", ckpt_copy);
+    {
+        sa::redo_log wal("test/redo.log", opts);
+        BOOST_REQUIRE(wal.ok());
+        BOOST_CHECK_EQUAL(wal.replayed_record_count(), 10);
+    }
+    BOOST_CHECK_EQUAL(file_contents(files[0]), applied[0]);
+    BOOST_CHECK_EQUAL(file_contents(files[1]), applied[1]);
+    
+    // A data file removed before its batch is applied: the failure sticks,
+    // and the next open skips the record instead of refusing to open.
+    opts.apply_delay = std::chrono::milliseconds(100);
+    std::string doomed("test/wal_doomed.dat");
+    splatfile<std::string>(doomed, "");
+    {
+        sa::redo_log wal("test/redo.log", opts);
+        BOOST_REQUIRE(wal.ok());
+        BOOST_REQUIRE(wal.append(doomed, std::vector<byte>(3, 'x')));
+        BOOST_REQUIRE(wal.append(files[0], std::vector<byte>(3, 'y')));
+        BOOST_REQUIRE(::unlink(doomed.c_str())==0);
+        BOOST_CHECK(!wal.drain());
+        BOOST_CHECK(wal.apply_failed());
+        BOOST_CHECK(!wal.append(files[0], std::vector<byte>(3, 'z')));
+    }
+    {
+        sa::redo_log wal("test/redo.log", opts);
+        BOOST_REQUIRE(wal.ok());
+        BOOST_CHECK_EQUAL(wal.replayed_record_count(), 2);
+        BOOST_CHECK_EQUAL(wal.skipped_record_count(), 1);
+        BOOST_CHECK(wal.drain());
+    }
+    BOOST_CHECK_EQUAL(file_contents(files[0]), applied[0]+"yyy");
+    BOOST_CHECK(!file_exists(doomed));
+    
+    rm_dir("test/");
+}
+
+BOOST_AUTO_TEST_CASE( epoch_journal_tests )
+{
+    mk_dir("test/");
+    
+    std::vector<std::string> files;
+    for(int i=0; i<3; ++i) {
+        files.push_back("test/series" + std::to_string(i) + ".dat");
+        splatfile<std::string>(files.back(), "head;");
+    }
+    
+    std::vector<sa::commit_event_kind> events;
+    uint64_t listener = sa::add_commit_listener([&events](sa::commit_event const & e) {
+        events.push_back(e.kind);
+    });
+    
+    {
+        sa::epoch_journal epochs("test/epochs.jrn");
+        BOOST_REQUIRE(epochs.ok());
+        BOOST_CHECK_EQUAL(epochs.recovered_file_count(), 0);
+        BOOST_CHECK_EQUAL(epochs.epoch(), 1);
+        
+        BOOST_CHECK(epochs.touch(files));
+        BOOST_CHECK(epochs.touch(files[0]));
+        BOOST_CHECK_EQUAL(epochs.touched_count(), 3);
+        BOOST_CHECK(!epochs.touch("test/missing.dat"));
+        for(size_t i=0; i<files.size(); ++i) {
+            splatfile<std::string>(files[i], "one;", true);
+        }
+        BOOST_CHECK(flen("test/epochs.jrn")>0);
+        BOOST_CHECK(epochs.close());
+        BOOST_CHECK_EQUAL(flen("test/epochs.jrn"), 20);
+        BOOST_CHECK_EQUAL(epochs.epoch(), 2);
+        BOOST_CHECK_EQUAL(epochs.touched_count(), 0);
+        BOOST_CHECK_EQUAL(events.size(), 3);
+        
+        BOOST_CHECK(epochs.touch(files[1]));
+        splatfile<std::string>(files[1], "two;", true);
+        BOOST_CHECK(epochs.rollback());
+        BOOST_CHECK_EQUAL(file_contents(files[1]), "head;one;");
+        BOOST_CHECK_EQUAL(events.back(), sa::rolled_back);
+        
+        // An epoch left open is rolled back by the next open.
+        BOOST_CHECK(epochs.touch(files));
+        for(size_t i=0; i<files.size(); ++i) {
+            splatfile<std::string>(files[i], "lost;", true);
+        }
+    }
+    std::string journal_copy = file_contents("test/epochs.jrn");
+    {
+        sa::epoch_journal epochs("test/epochs.jrn");
+        BOOST_REQUIRE(epochs.ok());
+        BOOST_CHECK_EQUAL(epochs.recovered_file_count(), 3);
+        BOOST_CHECK_EQUAL(flen("test/epochs.jrn"), 20);
+        // Epoch 3 was left open and rolled back; numbering carries on.
+        BOOST_CHECK_EQUAL(epochs.epoch(), 4);
+    }
+    BOOST_CHECK_EQUAL(sa::epoch_journal("test/epochs.jrn").epoch(), 4);
+    for(size_t i=0; i<files.size(); ++i) {
+        BOOST_CHECK_EQUAL(file_contents(files[i]), "head;one;");
+    }
+    
+    // A torn last record stops recovery: its file was never appended to.
+    for(size_t i=0; i<files.size(); ++i) {
+        splatfile<std::string>(files[i], "lost;", true);
+    }
+    splatfile<std::string>("test/epochs.jrn", journal_copy.substr(0, journal_copy.size()-3));
+    {
+        sa::epoch_journal epochs("test/epochs.jrn");
+        BOOST_CHECK_EQUAL(epochs.recovered_file_count(), 2);
+    }
+    BOOST_CHECK_EQUAL(file_contents(files[0]), "head;one;");
+    BOOST_CHECK_EQUAL(file_contents(files[1]), "head;one;");
+    BOOST_CHECK_EQUAL(file_contents(files[2]), "head;one;lost;");
+    
+    {
+        sa::epoch_options opts;
+        opts.barrier = sa::epoch_options::per_file_barrier;
+        sa::epoch_journal epochs("test/epochs.jrn", opts);
+        BOOST_CHECK(epochs.touch(files));
+        for(size_t i=0; i<files.size(); ++i) {
+            splatfile<std::string>(files[i], "two;", true);
+        }
+        BOOST_CHECK(epochs.close());
+    }
+    BOOST_CHECK_EQUAL(file_contents(files[0]), "head;one;two;");
+    
+    // close waits for appends in flight.
+    {
+        sa::epoch_journal epochs("test/epochs.jrn");
+        std::atomic<bool> appended(false);
+        std::unique_ptr<sa::epoch_journal::append_guard> guard(new sa::epoch_journal::append_guard(epochs, files[2]));
+        BOOST_REQUIRE(guard->ok());
+        std::thread closer([&]() {
+            BOOST_CHECK(epochs.close());
+            BOOST_CHECK(appended.load());
+        });
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        splatfile<std::string>(files[2], "three;", true);
+        appended = true;
+        guard.reset();
+        closer.join();
+        BOOST_CHECK_EQUAL(epochs.touched_count(), 0);
+    }
+    BOOST_CHECK_EQUAL(file_contents(files[2]), "head;one;lost;two;three;");
+    
+    // A retire that fails keeps the epoch open; the next touch must not
+    // write over the records of files already touched.
+    {
+        int journal_fd = ::open("/dev/null", O_RDONLY);
+        ::close(journal_fd);
+        sa::epoch_journal epochs("test/epochs.jrn");
+        struct stat by_fd, by_path;
+        BOOST_REQUIRE(::fstat(journal_fd, &by_fd)==0 && ::stat("test/epochs.jrn", &by_path)==0);
+        BOOST_REQUIRE(by_fd.st_ino==by_path.st_ino);
+        
+        BOOST_CHECK(epochs.touch(files[0]));
+        splatfile<std::string>(files[0], "lost;", true);
+        int writable = ::dup(journal_fd);
+        int read_only = ::open("test/epochs.jrn", O_RDONLY);
+        ::dup2(read_only, journal_fd);
+        BOOST_CHECK(!epochs.close());
+        ::dup2(writable, journal_fd);
+        ::close(writable);
+        ::close(read_only);
+        
+        BOOST_CHECK(epochs.touch(files[1]));
+        splatfile<std::string>(files[1], "lost;", true);
+        BOOST_CHECK_EQUAL(epochs.touched_count(), 2);
+        BOOST_CHECK_EQUAL(sa::epoch_journal("test/epochs.jrn").recovered_file_count(), 2);
+    }
+    BOOST_CHECK_EQUAL(file_contents(files[0]), "head;one;two;");
+    BOOST_CHECK_EQUAL(file_contents(files[1]), "head;one;two;");
+    
+    sa::remove_commit_listener(listener);
+    rm_dir("test/");
+}
+
+BOOST_AUTO_TEST_CASE( fd_cache_tests )
+{
+    mk_dir("test/");
+    
+    std::vector<std::string> files;
+    for(int i=0; i<8; ++i) {
+        files.push_back("test/cached" + std::to_string(i) + ".dat");
+        splatfile<std::string>(files.back(), "data" + std::to_string(i));
+    }
+    
+    {
+        sa::fd_cache_options opts;
+        opts.capacity = 4;
+        opts.shards = 1;
+        sa::fd_cache cache(opts);
+        
+        int fd = cache.open(files[0], O_RDONLY);
+        BOOST_REQUIRE(fd>=0);
+        BOOST_CHECK(cache.close(fd));
+        BOOST_CHECK_EQUAL(cache.open(files[0], O_RDWR), fd);
+        BOOST_CHECK(cache.close(fd));
+        sa::fd_cache_stats st = cache.stats();
+        BOOST_CHECK_EQUAL(st.hits, 1);
+        BOOST_CHECK_EQUAL(st.misses, 1);
+        BOOST_CHECK_EQUAL(st.hit_rate(), 0.5);
+        
+        BOOST_CHECK_EQUAL(cache.open("test/missing.dat", O_RDONLY), -1);
+        BOOST_CHECK_EQUAL(errno, ENOENT);
+        
+        // A pinned file survives any amount of churn; the rest is LRU.
+        int pinned = cache.open(files[0], O_RDWR);
+        for(size_t i=1; i<files.size(); ++i) {
+            BOOST_CHECK(cache.close(cache.open(files[i], O_RDONLY)));
+        }
+        st = cache.stats();
+        BOOST_CHECK_EQUAL(st.open_count, 4);
+        BOOST_CHECK_EQUAL(st.pinned_count, 1);
+        BOOST_CHECK_EQUAL(st.evictions, 4);
+        char c = 0;
+        BOOST_CHECK_EQUAL(::pread(pinned, &c, 1, 4), 1);
+        BOOST_CHECK_EQUAL(c, '0');
+        BOOST_CHECK(cache.close(pinned));
+        
+        cache.reset_stats();
+        BOOST_CHECK(cache.close(cache.open(files[7], O_RDONLY)));
+        BOOST_CHECK(cache.close(cache.open(files[1], O_RDONLY)));
+        BOOST_CHECK_EQUAL(cache.stats().hits, 1);
+        BOOST_CHECK_EQUAL(cache.stats().misses, 1);
+        
+        // Invalidating a pinned file keeps its descriptor until it is
+        // closed, while new opens see the new file.
+        pinned = cache.open(files[7], O_RDONLY);
+        cache.invalidate(files[7]);
+        splatfile<std::string>(files[7], "replaced");
+        int fresh = cache.open(files[7], O_RDONLY);
+        BOOST_CHECK(fresh!=pinned);
+        BOOST_CHECK(cache.close(pinned));
+        BOOST_CHECK(cache.close(fresh));
+        BOOST_CHECK(!cache.close(fresh));
+        
+        // Files replaced or removed behind the cache's back are noticed.
+        fd = cache.open(files[2], O_RDWR);
+        BOOST_CHECK(cache.close(fd));
+        BOOST_CHECK(::rename(files[3].c_str(), files[2].c_str())==0);
+        int renamed = cache.open(files[2], O_RDWR);
+        BOOST_REQUIRE(renamed>=0);
+        BOOST_CHECK_EQUAL(::pread(renamed, &c, 1, 4), 1);
+        BOOST_CHECK_EQUAL(c, '3');
+        BOOST_CHECK(cache.close(renamed));
+        BOOST_CHECK(::unlink(files[2].c_str())==0);
+        BOOST_CHECK_EQUAL(cache.open(files[2], O_RDWR), -1);
+        BOOST_CHECK_EQUAL(errno, ENOENT);
+        splatfile<std::string>(files[3], "data3");
+        
+        int created = cache.open("test/created.dat", O_WRONLY | O_CREAT | O_TRUNC);
+        BOOST_CHECK(created>=0);
+        BOOST_CHECK_EQUAL(cache.stats().bypassed, 1);
+        BOOST_CHECK(cache.close(created));
+        
+        // A hold outlasts its entry being replaced, and release() finds it.
+        BOOST_CHECK(cache.hold(files[5]));
+        BOOST_CHECK(cache.hold(files[5]));
+        BOOST_CHECK_EQUAL(cache.stats().pinned_count, 1);
+        cache.invalidate(files[5]);
+        BOOST_CHECK(cache.hold(files[5]));
+        BOOST_CHECK_EQUAL(cache.stats().pinned_count, 2);
+        cache.release(files[5]);
+        BOOST_CHECK_EQUAL(cache.stats().pinned_count, 0);
+        
+        cache.set_capacity(1);
+        BOOST_CHECK_EQUAL(cache.stats().open_count, 1);
+    }
+    
+    // The engine runs unchanged on cached descriptors.
+    typedef sa::basic_appender<sa::sha512_checksum, sa::data_sync, sa::sibling_journal, sa::no_lock,
+                               sa::cached_posix_backend> cached_appender;
+    sa::fd_cache::global().reset_stats();
+    for(int i=0; i<3; ++i) {
+        BOOST_CHECK(cached_appender::start(files[0]));
+        splatfile<std::string>(files[0], "+", true);
+        BOOST_CHECK(cached_appender::commit(files[0]));
+    }
+    BOOST_CHECK(cached_appender::start(files[0]));
+    splatfile<std::string>(files[0], "lost", true);
+    BOOST_CHECK(cached_appender::rollback(files[0]));
+    BOOST_CHECK_EQUAL(file_contents(files[0]), "data0+++");
+    BOOST_CHECK_EQUAL(cached_appender::status(files[0]), sa::clean);
+    BOOST_CHECK(sa::fd_cache::global().stats().hits>=3);
+    
+    // A file with an open transaction outlasts any churn.
+    sa::fd_cache & global = sa::fd_cache::global();
+    global.set_capacity(1);
+    BOOST_CHECK(cached_appender::start(files[0]));
+    BOOST_CHECK_EQUAL(global.stats().pinned_count, 1);
+    global.reset_stats();
+    for(int i=0; i<64; ++i) {
+        std::string churn = "test/churn" + std::to_string(i) + ".dat";
+        splatfile<std::string>(churn, "x");
+        BOOST_CHECK(global.close(global.open(churn, O_RDONLY)));
+    }
+    BOOST_CHECK(global.stats().evictions>0);
+    BOOST_CHECK(global.close(global.open(files[0], O_RDWR)));
+    BOOST_CHECK_EQUAL(global.stats().hits, 1);
+    splatfile<std::string>(files[0], "!", true);
+    BOOST_CHECK(cached_appender::commit(files[0]));
+    BOOST_CHECK_EQUAL(global.stats().pinned_count, 0);
+    global.set_capacity(1024);
+    
+    // The library's own renames and unlinks drop the path from the cache.
+    size_t cached = global.stats().open_count;
+    BOOST_CHECK(global.close(global.open(files[4], O_RDONLY)));
+    BOOST_CHECK_EQUAL(global.stats().open_count, cached+1);
+    BOOST_CHECK(replace_checksummed_file(files[4], std::vector<byte>(3, 'r')));
+    BOOST_CHECK_EQUAL(global.stats().open_count, cached);
+    BOOST_CHECK(global.close(global.open(files[4], O_RDONLY)));
+    BOOST_CHECK(delete_file(files[4]));
+    BOOST_CHECK_EQUAL(global.stats().open_count, cached);
+    
+    rm_dir("test/");
+}
+
+#ifdef SA_HAS_COROUTINES
+
+// Just enough of a coroutine type to drive the awaitables from a test.
+struct test_coroutine {
+    struct promise_type {
+        test_coroutine get_return_object() { return test_coroutine(); }
+        std::suspend_never initial_suspend() noexcept { return std::suspend_never(); }
+        std::suspend_never final_suspend() noexcept { return std::suspend_never(); }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+static test_coroutine append_records(sa::async_appender & appender, std::string fname, int records,
+                                     std::atomic<int> & committed, std::atomic<int> & done) {
+    for(int i=0; i<records; ++i) {
+        std::string record = "rec" + std::to_string(i) + ";";
+        if(!co_await appender.start(fname)) break;
+        bool written = co_await appender.append(fname, std::vector<byte>(record.begin(), record.end()));
+        if(written && co_await appender.commit(fname)) {
+            ++committed;
+        }
+    }
+    // Appending past the end and rolling back leaves the file as it was.
+    if(co_await appender.start(fname)) {
+        co_await appender.append(fname, std::vector<byte>(4, 'x'));
+        co_await appender.rollback(fname);
+    }
+    ++done;
+}
+
+#endif
+
+BOOST_AUTO_TEST_CASE( async_append_tests )
+{
+    std::atomic<int> ran(0);
+    {
+        sa::io_pool pool(3);
+        BOOST_CHECK_EQUAL(pool.thread_count(), 3);
+        for(int i=0; i<100; ++i) {
+            pool.submit([&ran]() { ++ran; });
+        }
+    }
+    // Destruction waits for everything already submitted.
+    BOOST_CHECK_EQUAL(ran.load(), 100);
+    
+#ifdef SA_HAS_COROUTINES
+    mk_dir("test/");
+    
+    std::vector<std::string> files;
+    for(int i=0; i<8; ++i) {
+        files.push_back("test/async" + std::to_string(i) + ".dat");
+        splatfile<std::string>(files.back(), "");
+    }
+    
+    std::atomic<int> committed(0), done(0);
+    {
+        // Many transactions in flight on two threads.
+        sa::io_pool pool(2);
+        sa::async_appender appender(pool);
+        for(size_t i=0; i<files.size(); ++i) {
+            append_records(appender, files[i], 20, committed, done);
+        }
+        for(int i=0; i<2000 && done.load()<(int)files.size(); ++i) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        }
+    }
+    BOOST_CHECK_EQUAL(done.load(), (int)files.size());
+    BOOST_CHECK_EQUAL(committed.load(), 20*(int)files.size());
+    std::string expected;
+    for(int i=0; i<20; ++i) {
+        expected += "rec" + std::to_string(i) + ";";
+    }
+    for(size_t i=0; i<files.size(); ++i) {
+        BOOST_CHECK_EQUAL(file_contents(files[i]), expected);
+        BOOST_CHECK_EQUAL(sa::status(files[i]), sa::clean);
+    }
+    
+    rm_dir("test/");
+#endif
+}
+
+BOOST_AUTO_TEST_CASE( steady_state_allocation_tests )
+{
+    mk_dir("test/");
+    
+    std::string fname("test/steady_state_allocations.dat");
+    splatfile<std::string>(fname, "append test\n");
+    
+    int fd = ::open(fname.c_str(), O_WRONLY | O_APPEND);
+    BOOST_REQUIRE(fd>=0);
+    const char record[] = "0123456789abcdef";
+    
+    // The first transaction is allowed to size the per-thread buffers.
+    BOOST_CHECK(sa::start(fname));
+    BOOST_CHECK_EQUAL(::write(fd, record, sizeof(record)), sizeof(record));
+    BOOST_CHECK(sa::commit(fname));
+    
+    unsigned long before = allocation_count.load();
+    bool ok = true;
+    for(int i=0; i<100; ++i) {
+        ok = sa::start(fname) && ok;
+        ok = (sa::status(fname)==sa::hot) && ok;
+        ok = (::write(fd, record, sizeof(record))==sizeof(record)) && ok;
+        ok = sa::commit(fname) && ok;
+    }
+    unsigned long after = allocation_count.load();
+    
+    BOOST_CHECK(ok);
+    BOOST_CHECK_EQUAL(before, after);
+    BOOST_CHECK_EQUAL(flen(fname), 12+101*sizeof(record));
+    
+    ::close(fd);
+    rm_dir("test/");
+}
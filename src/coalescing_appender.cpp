@@ -0,0 +1,192 @@
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "safe_append.h"
+#include "safe_append_internals.h"
+#include "coalescing_appender.h"
+#include "tail_recovery.h"
+#include "probes.h"
+
+sa::coalescing_appender::coalescing_appender(std::string const & filepath, options const & opts)
+    : m_filepath(filepath), m_options(opts), m_flush_requested(false), m_stop(false),
+      m_flushes(0), m_failed_flushes(0) {
+    m_active.reserve(m_options.capacity);
+    m_flushing.reserve(m_options.capacity);
+    m_thread = std::thread(&coalescing_appender::run, this);
+}
+
+sa::coalescing_appender::~coalescing_appender() {
+    close();
+}
+
+bool sa::coalescing_appender::close() {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_work.notify_all();
+    if(m_thread.joinable()) {
+        m_thread.join();
+    }
+    return flush();
+}
+
+sa::coalescing_appender::append_result sa::coalescing_appender::try_append(byte const * data, size_t length) {
+    if(length>m_options.capacity) {
+        return too_large;
+    }
+    bool wake = false;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if(m_active.size()+length>m_options.capacity) {
+            return full;
+        }
+        if(m_active.empty()) {
+            m_oldest = std::chrono::steady_clock::now();
+            wake = true;
+        }
+        m_active.insert(m_active.end(), data, data+length);
+        wake = wake || m_active.size()>=m_options.flush_threshold;
+    }
+    if(wake) {
+        m_work.notify_one();
+    }
+    return accepted;
+}
+
+bool sa::coalescing_appender::append(byte const * data, size_t length, std::chrono::milliseconds timeout) {
+    if(length>m_options.capacity) {
+        return false;
+    }
+    std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now()+timeout;
+    for(;;) {
+        append_result r = try_append(data, length);
+        if(r==accepted) {
+            return true;
+        }
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_flush_requested = true;
+        m_work.notify_one();
+        if(!m_space.wait_until(lock, deadline, [&]() { return m_active.size()+length<=m_options.capacity; })) {
+            return false;
+        }
+    }
+}
+
+bool sa::coalescing_appender::flush() {
+    for(;;) {
+        if(!flush_once()) {
+            return false;
+        }
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if(m_active.empty()) {
+            return true;
+        }
+    }
+}
+
+size_t sa::coalescing_appender::buffered() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_active.size();
+}
+
+uint64_t sa::coalescing_appender::flush_count() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_flushes;
+}
+
+uint64_t sa::coalescing_appender::failed_flush_count() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_failed_flushes;
+}
+
+/**
+ * Commit one batch. A batch that failed to commit last time is retried
+ * before any newer records, so records are never reordered or skipped.
+ */
+
+bool sa::coalescing_appender::flush_once() {
+    std::lock_guard<std::mutex> io_lock(m_io_mutex);
+    if(m_flushing.empty()) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_flushing.swap(m_active);
+        m_flush_requested = false;
+    }
+    m_space.notify_all();
+    if(m_flushing.empty()) {
+        return true;
+    }
+    bool success = write_batch(m_flushing);
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if(success) {
+            ++m_flushes;
+        } else {
+            ++m_failed_flushes;
+        }
+    }
+    if(success) {
+        m_flushing.clear();
+    }
+    return success;
+}
+
+bool sa::coalescing_appender::write_batch(std::vector<byte> const & batch) {
+    // Left over from a failed flush (or a crash). A dirty journal was torn
+    // while being written, before anything was appended, so it just goes.
+    sa::status_value left_over = sa::status(m_filepath);
+    if((left_over==sa::hot && !undo()) || (left_over==sa::dirty && !sa::cleanup(m_filepath))) {
+        return false;
+    }
+    if(!sa::start(m_filepath)) {
+        return false;
+    }
+    int fd = ::open(m_filepath.c_str(), O_WRONLY | O_CLOEXEC);
+    bool success = false;
+    if(fd>=0) {
+        struct stat st;
+        success = ::fstat(fd, &st)==0
+                  && pwrite_all(fd, batch.data(), batch.size(), st.st_size)
+                  && (!m_options.sync || ::fdatasync(fd)==0);
+        success = (::close(fd)==0) && success;
+    }
+    SA_PROBE3(append, m_filepath.c_str(), current_transaction(m_filepath), batch.size());
+    if(!success) {
+        undo();
+        return false;
+    }
+    if(!sa::commit(m_filepath)) {
+        undo();
+        return false;
+    }
+    return true;
+}
+
+// Roll back a hot journal. If nothing was appended (the write failed before
+// its first byte), rollback refuses, and the journal is simply removed.
+bool sa::coalescing_appender::undo() {
+    return sa::recover(m_filepath).success;
+}
+
+void sa::coalescing_appender::run() {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while(!m_stop) {
+        bool due = m_flush_requested || m_active.size()>=m_options.flush_threshold
+                   || (!m_active.empty() && std::chrono::steady_clock::now()>=m_oldest+m_options.max_delay);
+        if(!due) {
+            if(m_active.empty()) {
+                m_work.wait(lock);
+            } else {
+                m_work.wait_until(lock, m_oldest+m_options.max_delay);
+            }
+            continue;
+        }
+        lock.unlock();
+        if(!flush_once()) {
+            // Back off before retrying a failed batch.
+            std::this_thread::sleep_for(m_options.max_delay);
+        }
+        lock.lock();
+    }
+}
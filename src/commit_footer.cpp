@@ -0,0 +1,333 @@
+#include <algorithm>
+#include <cstring>
+#include <mutex>
+#include <unordered_map>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "safe_append.h"
+#include "safe_append_internals.h"
+#include "commit_footer.h"
+
+static const byte footer_magic[8] = { 'S', 'A', 'F', 'O', 'O', 'T', 'R', '1' };
+static const size_t footer_range_digest_size = 32;
+static const size_t footer_self_digest_size = 16;
+static const size_t footer_self_offset = sa::footer_size-footer_self_digest_size;
+static const size_t footer_scan_block = 64*1024;
+static const size_t footer_hash_block = 1024*1024;
+
+typedef std::array<byte, sa::footer_size> footer_bytes;
+
+static void encode_footer(sa::footer_info const & info, uchar_sha512_array const & range_digest, footer_bytes & out) {
+    std::copy(footer_magic, footer_magic+8, out.begin());
+    encode_big_endian64(out.begin()+8, info.data_begin);
+    encode_big_endian64(out.begin()+16, info.data_end);
+    encode_big_endian64(out.begin()+24, info.sequence);
+    std::copy(range_digest.begin(), range_digest.begin()+footer_range_digest_size, out.begin()+32);
+    uchar_sha512_array self;
+    sha512(out.data(), footer_self_offset, self.data());
+    std::copy(self.begin(), self.begin()+footer_self_digest_size, out.begin()+footer_self_offset);
+}
+
+// A footer at `offset` is well formed if its magic and self digest check
+// out and it claims to start where it actually is.
+static bool decode_footer(byte const * bytes, uint64_t offset, sa::footer_info & out) {
+    if(!std::equal(footer_magic, footer_magic+8, bytes)) {
+        return false;
+    }
+    uchar_sha512_array self;
+    sha512(bytes, footer_self_offset, self.data());
+    if(!std::equal(self.begin(), self.begin()+footer_self_digest_size, bytes+footer_self_offset)) {
+        return false;
+    }
+    byte const * p = bytes+8;
+    out.data_begin = extract_big_endian64(p);
+    p = bytes+16;
+    out.data_end = extract_big_endian64(p);
+    p = bytes+24;
+    out.sequence = extract_big_endian64(p);
+    return out.data_end==offset && out.data_begin<=out.data_end;
+}
+
+static bool hash_range(int fd, uint64_t begin, uint64_t end, SHA512 & ctx) {
+    std::vector<byte> buf((size_t)std::min<uint64_t>(footer_hash_block, end-begin));
+    while(begin<end) {
+        size_t n = (size_t)std::min<uint64_t>(buf.size(), end-begin);
+        if(!pread_all(fd, buf.data(), n, begin)) {
+            return false;
+        }
+        ctx.update(buf.data(), n);
+        begin+=n;
+    }
+    return true;
+}
+
+static bool range_intact(int fd, sa::footer_info const & info, byte const * footer) {
+    SHA512 ctx;
+    uchar_sha512_array d;
+    ctx.init();
+    if(!hash_range(fd, info.data_begin, info.data_end, ctx)) {
+        return false;
+    }
+    ctx.final(d.data());
+    return std::equal(d.begin(), d.begin()+footer_range_digest_size, footer+32);
+}
+
+/**
+ * Find the last footer in the first `length` bytes of the file whose data
+ * is intact. The common case (the file ends in a footer) costs one read;
+ * otherwise the file is scanned backwards for the footer magic.
+ */
+
+static bool find_last_footer(int fd, uint64_t length, sa::footer_info & out, uint64_t & out_end) {
+    footer_bytes tail;
+    if(length>=sa::footer_size && pread_all(fd, tail.data(), tail.size(), length-sa::footer_size)
+       && decode_footer(tail.data(), length-sa::footer_size, out) && range_intact(fd, out, tail.data())) {
+        out_end = length;
+        return true;
+    }
+    
+    std::vector<byte> block;
+    uint64_t block_end = length;
+    while(block_end>=sa::footer_size) {
+        // Blocks overlap by a footer so that none straddles a boundary unseen.
+        uint64_t block_begin = (block_end>footer_scan_block) ? block_end-footer_scan_block : 0;
+        block.resize((size_t)(block_end-block_begin));
+        if(!pread_all(fd, block.data(), block.size(), block_begin)) {
+            return false;
+        }
+        for(size_t i=block.size()-sa::footer_size+1; i-->0; ) {
+            if(block[i]==footer_magic[0] && decode_footer(block.data()+i, block_begin+i, out)
+               && range_intact(fd, out, block.data()+i)) {
+                out_end = block_begin+i+sa::footer_size;
+                return true;
+            }
+        }
+        if(block_begin==0) {
+            break;
+        }
+        block_end = block_begin+sa::footer_size-1;
+    }
+    return false;
+}
+
+// Where a file's last footer ends, as of this process's last look at it.
+struct footer_tail {
+    dev_t dev;
+    ino_t ino;
+    uint64_t end;      // one past the last footer; 0 if there is none
+    uint64_t sequence; // of the last footer; 0 if there is none
+    bool started;      // footer_start was called and not yet committed
+};
+
+static std::mutex tails_mutex;
+static std::unordered_map<std::string, footer_tail> tails;
+
+static void remember_tail(std::string const & filepath, footer_tail const & tail) {
+    std::lock_guard<std::mutex> lock(tails_mutex);
+    tails[filepath] = tail;
+}
+
+static void forget_tail(std::string const & filepath) {
+    std::lock_guard<std::mutex> lock(tails_mutex);
+    tails.erase(filepath);
+}
+
+/**
+ * The file's last footer. A remembered one is trusted once its framing
+ * checks out where it is expected, without re-hashing the data it seals;
+ * otherwise (another process wrote the file, or this is the first look)
+ * the file is searched and the footer's data verified.
+ */
+
+static bool locate_tail(int fd, std::string const & filepath, struct stat const & st, footer_tail & out) {
+    bool known = false;
+    {
+        std::lock_guard<std::mutex> lock(tails_mutex);
+        std::unordered_map<std::string, footer_tail>::const_iterator it = tails.find(filepath);
+        if(it!=tails.end() && it->second.dev==st.st_dev && it->second.ino==st.st_ino
+           && it->second.end<=(uint64_t)st.st_size) {
+            out = it->second;
+            known = true;
+        }
+    }
+    if(known) {
+        footer_bytes footer;
+        sa::footer_info info;
+        if(out.end==0 || (pread_all(fd, footer.data(), footer.size(), out.end-sa::footer_size)
+                          && decode_footer(footer.data(), out.end-sa::footer_size, info)
+                          && info.sequence==out.sequence)) {
+            return true;
+        }
+    }
+    
+    sa::footer_info info;
+    out.dev = st.st_dev;
+    out.ino = st.st_ino;
+    out.started = false;
+    if(find_last_footer(fd, st.st_size, info, out.end)) {
+        out.sequence = info.sequence;
+    }
+    else if(st.st_size==0) {
+        out.end = 0;
+        out.sequence = 0;
+    }
+    else {
+        // Data but no footer: not a file in footer mode, or one whose first
+        // commit was torn. Either way, nothing here is ours to seal.
+        return false;
+    }
+    remember_tail(filepath, out);
+    return true;
+}
+
+/**
+ * Seal the bytes appended by hand since footer_start (if `started`) plus
+ * `bytes`, with one write. Anything else past the last footer is refused.
+ */
+
+static bool seal(std::string const & filepath, byte const * bytes, size_t length, bool sync, bool started) {
+    int fd = ::open(filepath.c_str(), O_RDWR | O_CLOEXEC);
+    if(fd<0) {
+        return false;
+    }
+    struct stat st;
+    footer_tail tail;
+    if(::fstat(fd, &st)!=0 || !locate_tail(fd, filepath, st, tail)
+       || tail.started!=started || (!started && (uint64_t)st.st_size!=tail.end)) {
+        ::close(fd);
+        return false;
+    }
+    uint64_t file_len = st.st_size;
+    
+    SHA512 ctx;
+    ctx.init();
+    bool success = hash_range(fd, tail.end, file_len, ctx);
+    ctx.update(bytes, length);
+    uchar_sha512_array range_digest;
+    ctx.final(range_digest.data());
+    
+    sa::footer_info sealed;
+    sealed.data_begin = tail.end;
+    sealed.data_end = file_len+length;
+    sealed.sequence = tail.sequence+1;
+    footer_bytes footer;
+    encode_footer(sealed, range_digest, footer);
+    
+    if(success) {
+        struct iovec iov[2];
+        iov[0].iov_base = const_cast<byte *>(bytes);
+        iov[0].iov_len = length;
+        iov[1].iov_base = footer.data();
+        iov[1].iov_len = footer.size();
+        success = pwritev_all(fd, iov, 2, file_len);
+    }
+    if(success && sync) {
+        success = (::fdatasync(fd)==0);
+    }
+    success = (::close(fd)==0) && success;
+    if(success) {
+        tail.end = sealed.data_end+sa::footer_size;
+        tail.sequence = sealed.sequence;
+        tail.started = false;
+        remember_tail(filepath, tail);
+    }
+    else {
+        // Whatever reached the file is found (and refused) next time.
+        forget_tail(filepath);
+    }
+    return success;
+}
+
+bool sa::footer_append(std::string const & filepath, byte const * bytes, size_t length, bool sync) {
+    return seal(filepath, bytes, length, sync, false);
+}
+
+bool sa::footer_append(std::string const & filepath, std::vector<byte> const & bytes, bool sync) {
+    return seal(filepath, bytes.data(), bytes.size(), sync, false);
+}
+
+bool sa::footer_start(std::string const & filepath) {
+    int fd = ::open(filepath.c_str(), O_RDONLY | O_CLOEXEC);
+    if(fd<0) {
+        return false;
+    }
+    struct stat st;
+    footer_tail tail;
+    bool success = ::fstat(fd, &st)==0 && locate_tail(fd, filepath, st, tail)
+                   && !tail.started && (uint64_t)st.st_size==tail.end;
+    ::close(fd);
+    if(success) {
+        tail.started = true;
+        remember_tail(filepath, tail);
+    }
+    return success;
+}
+
+bool sa::footer_commit(std::string const & filepath, bool sync) {
+    return seal(filepath, nullptr, 0, sync, true);
+}
+
+bool sa::last_footer(std::string const & filepath, sa::footer_info & out_footer) {
+    int fd = ::open(filepath.c_str(), O_RDONLY | O_CLOEXEC);
+    if(fd<0) {
+        return false;
+    }
+    struct stat st;
+    uint64_t end = 0;
+    bool found = ::fstat(fd, &st)==0 && find_last_footer(fd, st.st_size, out_footer, end);
+    ::close(fd);
+    return found;
+}
+
+bool sa::footer_recover(std::string const & filepath) {
+    int fd = ::open(filepath.c_str(), O_RDWR | O_CLOEXEC);
+    if(fd<0) {
+        return false;
+    }
+    struct stat st;
+    sa::footer_info info;
+    uint64_t end = 0;
+    bool success = ::fstat(fd, &st)==0 && find_last_footer(fd, st.st_size, info, end);
+    if(success && end<(uint64_t)st.st_size) {
+        success = (::ftruncate(fd, end)==0) && (::fdatasync(fd)==0);
+    }
+    if(success) {
+        footer_tail tail = { st.st_dev, st.st_ino, end, info.sequence, false };
+        remember_tail(filepath, tail);
+    }
+    else {
+        forget_tail(filepath);
+    }
+    return (::close(fd)==0) && success;
+}
+
+bool sa::footer_ranges(std::string const & filepath, std::vector<sa::footer_info> & out_ranges) {
+    out_ranges.clear();
+    int fd = ::open(filepath.c_str(), O_RDONLY | O_CLOEXEC);
+    if(fd<0) {
+        return false;
+    }
+    struct stat st;
+    sa::footer_info info;
+    uint64_t end = 0;
+    bool success = ::fstat(fd, &st)==0 && find_last_footer(fd, st.st_size, info, end);
+    while(success) {
+        out_ranges.push_back(info);
+        if(info.data_begin==0) {
+            break;
+        }
+        // Earlier footers were verified when they were the last one; only
+        // their framing is checked on the way back.
+        footer_bytes footer;
+        success = info.data_begin>=sa::footer_size
+                  && pread_all(fd, footer.data(), footer.size(), info.data_begin-sa::footer_size)
+                  && decode_footer(footer.data(), info.data_begin-sa::footer_size, info);
+    }
+    ::close(fd);
+    std::reverse(out_ranges.begin(), out_ranges.end());
+    return success;
+}
@@ -0,0 +1,58 @@
+#include <atomic>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include "safe_append_internals.h"
+#include "commit_listener.h"
+
+namespace {
+    
+    struct listener_registry {
+        std::mutex mutex;
+        std::atomic<size_t> count;
+        uint64_t next_id;
+        std::vector<std::pair<uint64_t, sa::commit_listener>> listeners;
+        
+        listener_registry() : count(0), next_id(1) {}
+    };
+    
+    listener_registry & registry() {
+        static listener_registry r;
+        return r;
+    }
+}
+
+uint64_t sa::add_commit_listener(commit_listener listener) {
+    listener_registry & r = registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    uint64_t id = r.next_id++;
+    r.listeners.push_back(std::make_pair(id, std::move(listener)));
+    r.count = r.listeners.size();
+    return id;
+}
+
+void sa::remove_commit_listener(uint64_t id) {
+    listener_registry & r = registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    for(size_t i=0; i<r.listeners.size(); ++i) {
+        if(r.listeners[i].first==id) {
+            r.listeners.erase(r.listeners.begin()+i);
+            break;
+        }
+    }
+    r.count = r.listeners.size();
+}
+
+void sa::notify_commit_listeners(commit_event_kind kind, std::string const & filepath, uint64_t rewritten_from) {
+    listener_registry & r = registry();
+    if(r.count.load(std::memory_order_acquire)==0) {
+        return;
+    }
+    long length = flen(filepath);
+    commit_event event = { kind, filepath, (uint64_t)(length<0 ? 0 : length), rewritten_from };
+    std::lock_guard<std::mutex> lock(r.mutex);
+    for(std::pair<uint64_t, commit_listener> const & l : r.listeners) {
+        l.second(event);
+    }
+}
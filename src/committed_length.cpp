@@ -0,0 +1,159 @@
+#include <climits>
+#include <cstring>
+#include <thread>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+#include "safe_append.h"
+#include "safe_append_internals.h"
+#include "commit_listener.h"
+#include "committed_length.h"
+
+// The shared sidecar. Only the fields are shared; each is accessed with
+// atomic builtins, since the memory is mapped rather than constructed.
+struct sa::published_length {
+    byte magic[8];
+    uint32_t sequence; // bumped after every publish; the futex word
+    uint32_t waiters;  // readers blocked in wait_for_growth
+    uint64_t length;
+};
+
+static const byte published_magic[8] = { 'S', 'A', 'P', 'U', 'B', 'L', 'N', '1' };
+static const size_t published_file_size = 64;
+
+static void length_sidecar_name(std::string const & filepath, std::string & out_name) {
+    sidecar_name(filepath, "c_", ".len", out_name);
+}
+
+static sa::published_length * map_table(std::string const & filepath, bool create) {
+    std::string name;
+    length_sidecar_name(filepath, name);
+    int fd = ::open(name.c_str(), O_RDWR | O_CLOEXEC | (create ? O_CREAT : 0), 0666);
+    if(fd<0) {
+        return nullptr;
+    }
+    struct stat st;
+    bool sized = ::fstat(fd, &st)==0
+                 && ((uint64_t)st.st_size>=published_file_size
+                     || (create && ::ftruncate(fd, published_file_size)==0));
+    void * p = sized ? ::mmap(nullptr, published_file_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+    ::close(fd);
+    if(p==MAP_FAILED) {
+        return nullptr;
+    }
+    sa::published_length * table = static_cast<sa::published_length *>(p);
+    if(create && !std::equal(published_magic, published_magic+8, table->magic)) {
+        std::memcpy(table->magic, published_magic, 8);
+    }
+    if(!std::equal(published_magic, published_magic+8, table->magic)) {
+        ::munmap(p, published_file_size);
+        return nullptr;
+    }
+    return table;
+}
+
+static void unmap_table(sa::published_length * table) {
+    if(table) {
+        ::munmap(table, published_file_size);
+    }
+}
+
+static void wake_waiters(uint32_t * word) {
+#ifdef __linux__
+    ::syscall(SYS_futex, word, FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+#else
+    (void)word;
+#endif
+}
+
+static void wait_for_change(uint32_t * word, uint32_t expected, std::chrono::nanoseconds timeout) {
+#ifdef __linux__
+    struct timespec ts;
+    ts.tv_sec = (time_t)std::chrono::duration_cast<std::chrono::seconds>(timeout).count();
+    ts.tv_nsec = (long)(timeout.count()%1000000000);
+    ::syscall(SYS_futex, word, FUTEX_WAIT, expected, &ts, nullptr, 0);
+#else
+    (void)word;
+    (void)expected;
+    std::this_thread::sleep_for(std::min<std::chrono::nanoseconds>(timeout, std::chrono::milliseconds(1)));
+#endif
+}
+
+sa::length_publisher::length_publisher(std::string const & filepath)
+    : m_filepath(filepath), m_table(map_table(filepath, true)), m_listener(0) {
+    if(!m_table) {
+        return;
+    }
+    long length = -1;
+    if(read_append_journal(filepath, length)!=sa::hot) {
+        length = flen(filepath);
+    }
+    publish(length<0 ? 0 : (uint64_t)length);
+    m_listener = add_commit_listener([this](commit_event const & e) {
+        if(e.filepath==m_filepath) {
+            publish(e.length);
+        }
+    });
+}
+
+sa::length_publisher::~length_publisher() {
+    if(m_listener) {
+        remove_commit_listener(m_listener);
+    }
+    unmap_table(m_table);
+}
+
+/**
+ * Store the length, then bump the sequence. A reader that registered as a
+ * waiter before the bump is woken; one that registers after it sees the new
+ * sequence and does not sleep.
+ */
+
+void sa::length_publisher::publish(uint64_t length) {
+    if(!m_table) {
+        return;
+    }
+    __atomic_store_n(&m_table->length, length, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&m_table->sequence, 1, __ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&m_table->waiters, __ATOMIC_SEQ_CST)!=0) {
+        wake_waiters(&m_table->sequence);
+    }
+}
+
+sa::committed_length_reader::committed_length_reader(std::string const & filepath)
+    : m_table(map_table(filepath, false)) {
+}
+
+sa::committed_length_reader::~committed_length_reader() {
+    unmap_table(m_table);
+}
+
+uint64_t sa::committed_length_reader::committed() const {
+    return m_table ? __atomic_load_n(&m_table->length, __ATOMIC_ACQUIRE) : 0;
+}
+
+uint64_t sa::committed_length_reader::wait_for_growth(uint64_t known, std::chrono::milliseconds timeout) const {
+    if(!m_table) {
+        return 0;
+    }
+    std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now()+timeout;
+    for(;;) {
+        uint32_t sequence = __atomic_load_n(&m_table->sequence, __ATOMIC_ACQUIRE);
+        uint64_t length = __atomic_load_n(&m_table->length, __ATOMIC_ACQUIRE);
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        if(length>known || now>=deadline) {
+            return length;
+        }
+        __atomic_add_fetch(&m_table->waiters, 1, __ATOMIC_SEQ_CST);
+        wait_for_change(&m_table->sequence, sequence, deadline-now);
+        __atomic_sub_fetch(&m_table->waiters, 1, __ATOMIC_SEQ_CST);
+    }
+}
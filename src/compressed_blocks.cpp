@@ -0,0 +1,230 @@
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "safe_append.h"
+#include "safe_append_internals.h"
+#include "compressed_blocks.h"
+#include "lz_codec.h"
+#include "parallel_for.h"
+#include "probes.h"
+#include "tail_recovery.h"
+
+static const byte frame_magic[4] = { 'S', 'A', 'L', 'Z' };
+static const byte codec_stored = 0;
+static const byte codec_lz = 1;
+static const size_t frame_checked_size = 16;
+static const size_t frame_check_size = 8;
+
+// Per-thread buffers larger than this are released after use, so one huge
+// batch does not pin its memory for the life of the thread.
+static const size_t retained_buffer_size = 8*1024*1024;
+
+static void trim(std::vector<byte> & buf) {
+    if(buf.capacity()>retained_buffer_size) {
+        std::vector<byte>().swap(buf);
+    }
+}
+
+static void frame_check(byte const * header, byte const * stored, size_t stored_length, byte * out) {
+    SHA512 & ctx = thread_sha512_context();
+    uchar_sha512_array d;
+    ctx.init();
+    ctx.update(header, frame_checked_size);
+    ctx.update(stored, stored_length);
+    ctx.final(d.data());
+    std::copy(d.begin(), d.begin()+frame_check_size, out);
+}
+
+/**
+ * Build the frame for one block in `out`, which must hold the header and
+ * lz_compress_bound(length) bytes. Returns the frame size.
+ */
+
+static size_t encode_frame(byte const * bytes, size_t length, byte * out) {
+    byte * stored = out+sa::compressed_frame_header_size;
+    size_t stored_length = lz_compress(bytes, length, stored);
+    byte codec = codec_lz;
+    if(stored_length>=length) {
+        std::memcpy(stored, bytes, length);
+        stored_length = length;
+        codec = codec_stored;
+    }
+    std::copy(frame_magic, frame_magic+4, out);
+    out[4] = codec;
+    out[5] = out[6] = out[7] = 0;
+    encode_big_endian(out+8, (uint32_t)length);
+    encode_big_endian(out+12, (uint32_t)stored_length);
+    frame_check(out, stored, stored_length, out+frame_checked_size);
+    return sa::compressed_frame_header_size+stored_length;
+}
+
+bool sa::write_compressed_blocks(std::string const & filepath, byte const * bytes, size_t length,
+                                 uint32_t block_size, unsigned threads) {
+    if(block_size==0 || block_size>max_compressed_block_size) {
+        return false;
+    }
+    size_t blocks = (length+block_size-1)/block_size;
+    size_t slot = compressed_frame_header_size+lz_compress_bound(block_size);
+    
+    // Frames are built in fixed slots in parallel, then packed in place.
+    // The references make the workers share this thread's buffers.
+    static thread_local std::vector<byte> frames;
+    static thread_local std::vector<size_t> frame_sizes;
+    std::vector<byte> & buf = frames;
+    std::vector<size_t> & sizes = frame_sizes;
+    buf.resize(blocks*slot);
+    sizes.resize(blocks);
+    parallel_for(blocks, threads, [&](size_t i) {
+        size_t begin = i*(size_t)block_size;
+        sizes[i] = encode_frame(bytes+begin, std::min<size_t>(block_size, length-begin), buf.data()+i*slot);
+    });
+    size_t packed = 0;
+    for(size_t i=0; i<blocks; ++i) {
+        std::memmove(buf.data()+packed, buf.data()+i*slot, sizes[i]);
+        packed += sizes[i];
+    }
+    
+    int fd = ::open(filepath.c_str(), O_WRONLY | O_CLOEXEC);
+    if(fd<0) {
+        return false;
+    }
+    struct stat st;
+    bool success = ::fstat(fd, &st)==0 && pwrite_all(fd, buf.data(), packed, st.st_size);
+    SA_PROBE3(append, filepath.c_str(), current_transaction(filepath), packed);
+    trim(buf);
+    return (::close(fd)==0) && success;
+}
+
+bool sa::compressed_append(std::string const & filepath, byte const * bytes, size_t length,
+                           uint32_t block_size, unsigned threads) {
+    if(block_size==0 || block_size>max_compressed_block_size || !sa::start(filepath)) {
+        return false;
+    }
+    if(!write_compressed_blocks(filepath, bytes, length, block_size, threads)) {
+        // Also clears the journal if nothing reached the file.
+        sa::recover(filepath);
+        return false;
+    }
+    return sa::commit(filepath);
+}
+
+bool sa::compressed_append(std::string const & filepath, std::vector<byte> const & bytes,
+                           uint32_t block_size, unsigned threads) {
+    return compressed_append(filepath, bytes.data(), bytes.size(), block_size, threads);
+}
+
+static bool index_blocks(int fd, std::vector<sa::compressed_block> & out_blocks) {
+    out_blocks.clear();
+    struct stat st;
+    if(::fstat(fd, &st)!=0) {
+        return false;
+    }
+    uint64_t file_length = st.st_size;
+    uint64_t offset = 0;
+    uint64_t raw_offset = 0;
+    std::array<byte, sa::compressed_frame_header_size> header;
+    while(offset<file_length) {
+        if(file_length-offset<header.size() || !pread_all(fd, header.data(), header.size(), offset)
+           || !std::equal(frame_magic, frame_magic+4, header.begin()) || header[4]>codec_lz) {
+            return false;
+        }
+        sa::compressed_block block;
+        byte const * p = header.data()+8;
+        block.raw_length = extract_big_endian(p);
+        p = header.data()+12;
+        block.stored_length = extract_big_endian(p);
+        block.offset = offset;
+        block.raw_offset = raw_offset;
+        // Sizes are checked before anything is allocated for the block: no
+        // writer produces larger blocks, or frames beyond the codec's
+        // bound, and lz cannot expand input by more than 255 to 1.
+        if(block.stored_length>file_length-offset-header.size()
+           || block.raw_length>sa::max_compressed_block_size
+           || block.stored_length>lz_compress_bound(block.raw_length)
+           || (header[4]==codec_stored && block.stored_length!=block.raw_length)
+           || (header[4]==codec_lz && block.raw_length>256*(uint64_t)block.stored_length)) {
+            return false;
+        }
+        out_blocks.push_back(block);
+        offset += header.size()+block.stored_length;
+        raw_offset += block.raw_length;
+    }
+    return true;
+}
+
+bool sa::index_compressed_blocks(std::string const & filepath, std::vector<compressed_block> & out_blocks) {
+    int fd = ::open(filepath.c_str(), O_RDONLY | O_CLOEXEC);
+    if(fd<0) {
+        out_blocks.clear();
+        return false;
+    }
+    bool success = index_blocks(fd, out_blocks);
+    ::close(fd);
+    return success;
+}
+
+// Decode blocks [first, last] into out, back to back. One block per task.
+static bool read_blocks(int fd, std::vector<sa::compressed_block> const & blocks, size_t first, size_t last,
+                        byte * out, unsigned threads) {
+    uint64_t base = blocks[first].raw_offset;
+    std::atomic<bool> valid(true);
+    parallel_for(last-first+1, threads, [&](size_t i) {
+        sa::compressed_block const & block = blocks[first+i];
+        static thread_local std::vector<byte> frame;
+        frame.resize(sa::compressed_frame_header_size+block.stored_length);
+        byte * dest = out+(block.raw_offset-base);
+        byte const * stored = frame.data()+sa::compressed_frame_header_size;
+        byte check[frame_check_size];
+        if(!pread_all(fd, frame.data(), frame.size(), block.offset)) {
+            valid = false;
+            return;
+        }
+        frame_check(frame.data(), stored, block.stored_length, check);
+        if(!std::equal(check, check+frame_check_size, frame.data()+frame_checked_size)) {
+            valid = false;
+        } else if(frame[4]==codec_stored) {
+            std::memcpy(dest, stored, block.raw_length);
+        } else if(!lz_decompress(stored, block.stored_length, dest, block.raw_length)) {
+            valid = false;
+        }
+    });
+    return valid;
+}
+
+bool sa::read_compressed_file(std::string const & filepath, std::vector<byte> & out_contents, unsigned threads) {
+    return read_compressed_range(filepath, 0, UINT64_MAX, out_contents, threads);
+}
+
+bool sa::read_compressed_range(std::string const & filepath, uint64_t raw_offset, uint64_t length,
+                               std::vector<byte> & out_contents, unsigned threads) {
+    out_contents.clear();
+    int fd = ::open(filepath.c_str(), O_RDONLY | O_CLOEXEC);
+    if(fd<0) {
+        return false;
+    }
+    std::vector<compressed_block> blocks;
+    bool valid = index_blocks(fd, blocks);
+    uint64_t total = blocks.empty() ? 0 : blocks.back().raw_offset+blocks.back().raw_length;
+    uint64_t end = (length>total || raw_offset>total-length) ? total : raw_offset+length;
+    if(valid && raw_offset<end) {
+        // Blocks are ordered by raw_offset; find the first and last overlapping.
+        auto after = [](uint64_t value, compressed_block const & b) { return value<b.raw_offset+b.raw_length; };
+        size_t first = std::upper_bound(blocks.begin(), blocks.end(), raw_offset, after)-blocks.begin();
+        size_t last = std::upper_bound(blocks.begin(), blocks.end(), end-1, after)-blocks.begin();
+        uint64_t aligned = blocks[first].raw_offset;
+        out_contents.resize((size_t)(blocks[last].raw_offset+blocks[last].raw_length-aligned));
+        valid = read_blocks(fd, blocks, first, last, out_contents.data(), threads);
+        out_contents.resize((size_t)(end-aligned));
+        out_contents.erase(out_contents.begin(), out_contents.begin()+(size_t)(raw_offset-aligned));
+    }
+    ::close(fd);
+    if(!valid) {
+        out_contents.clear();
+    }
+    return valid;
+}
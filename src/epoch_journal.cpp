@@ -0,0 +1,339 @@
+#include <algorithm>
+#include <cerrno>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "safe_append_internals.h"
+#include "epoch_journal.h"
+#include "commit_listener.h"
+#include "probes.h"
+
+static const byte header_magic[4] = { 'S', 'A', 'E', 'J' };
+static const size_t header_size = 4+8+8;
+static const size_t record_header_size = 2+8+8;
+
+// Files opened at once by the per-file barrier.
+static const size_t barrier_batch = 256;
+
+static void journal_check(uint64_t epoch, byte const * fields, size_t fields_length,
+                          byte const * path, size_t path_length, byte * out) {
+    SHA512 & ctx = thread_sha512_context();
+    uchar_sha512_array d;
+    byte e[8];
+    encode_big_endian64(&e[0], epoch);
+    ctx.init();
+    ctx.update(e, sizeof(e));
+    ctx.update(fields, fields_length);
+    ctx.update(path, path_length);
+    ctx.final(d.data());
+    std::copy(d.begin(), d.begin()+8, out);
+}
+
+static bool current_length(std::string const & filepath, uint64_t & out_length) {
+    struct stat st;
+    if(::stat(filepath.c_str(), &st)!=0) {
+        return false;
+    }
+    out_length = (uint64_t)st.st_size;
+    return true;
+}
+
+static void add_record(std::vector<byte> & records, uint64_t epoch, std::string const & filepath, uint64_t length) {
+    size_t at = records.size();
+    records.resize(at+record_header_size+filepath.size());
+    byte * rec = records.data()+at;
+    rec[0] = (byte)(filepath.size()>>8);
+    rec[1] = (byte)filepath.size();
+    encode_big_endian64(rec+2, length);
+    std::copy(filepath.begin(), filepath.end(), rec+record_header_size);
+    journal_check(epoch, rec, 10, rec+record_header_size, filepath.size(), rec+10);
+}
+
+// Shrink the file to length if it grew, and make that durable.
+static bool truncate_to(std::string const & filepath, uint64_t length) {
+    uint64_t size = 0;
+    if(!current_length(filepath, size)) {
+        return errno==ENOENT;
+    }
+    if(size<=length) {
+        return true;
+    }
+    int fd = ::open(filepath.c_str(), O_WRONLY | O_CLOEXEC);
+    if(fd<0) {
+        return false;
+    }
+    bool success = ::ftruncate(fd, (off_t)length)==0 && ::fdatasync(fd)==0;
+    return (::close(fd)==0) && success;
+}
+
+sa::epoch_journal::epoch_journal(std::string const & journal_path, epoch_options const & opts)
+    : m_journal_path(journal_path), m_options(opts), m_fd(-1), m_recovered(0), m_epoch(1), m_head(0), m_appending(0) {
+    m_fd = ::open(journal_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+    if(m_fd<0) {
+        return;
+    }
+    if(!fsync_directory(journal_path) || !recover()) {
+        ::close(m_fd);
+        m_fd = -1;
+    }
+}
+
+sa::epoch_journal::~epoch_journal() {
+    if(m_fd>=0) {
+        ::close(m_fd);
+    }
+}
+
+/**
+ * Roll back every file named by an intact record, then retire the journal.
+ * A torn record was never acknowledged by touch, so its file was not
+ * appended to. The header names the epoch to continue from: the one after
+ * it if records show it was used.
+ */
+
+bool sa::epoch_journal::recover() {
+    struct stat st;
+    if(::fstat(m_fd, &st)!=0) {
+        return false;
+    }
+    std::vector<byte> journal((size_t)st.st_size);
+    if(!pread_all(m_fd, journal.data(), journal.size(), 0)) {
+        return false;
+    }
+
+    byte check[8];
+    uint64_t epoch = 0;
+    if(journal.size()>=header_size && std::equal(header_magic, header_magic+4, journal.begin())) {
+        std::vector<byte>::iterator it = journal.begin()+4;
+        epoch = extract_big_endian64(it);
+        journal_check(epoch, journal.data(), 4, NULL, 0, check);
+        if(!std::equal(check, check+8, journal.begin()+12)) {
+            epoch = 0;
+        }
+    }
+
+    bool success = true;
+    for(size_t at = header_size; epoch!=0 && at+record_header_size<=journal.size(); ) {
+        byte const * rec = journal.data()+at;
+        size_t path_length = ((size_t)rec[0]<<8) | rec[1];
+        if(at+record_header_size+path_length>journal.size()) {
+            break;
+        }
+        byte const * path = rec+record_header_size;
+        journal_check(epoch, rec, 10, path, path_length, check);
+        if(!std::equal(check, check+8, rec+10)) {
+            break;
+        }
+        std::vector<byte>::iterator it = journal.begin()+at+2;
+        uint64_t length = extract_big_endian64(it);
+        std::string filepath((char const *)path, path_length);
+        success = truncate_to(filepath, length) && success;
+        ++m_recovered;
+        at += record_header_size+path_length;
+    }
+    if(epoch!=0) {
+        m_epoch = m_recovered>0 ? epoch+1 : epoch;
+    }
+    return success && retire(m_epoch);
+}
+
+bool sa::epoch_journal::touch(std::string const & filepath) {
+    return touch(std::vector<std::string>(1, filepath));
+}
+
+bool sa::epoch_journal::touch(std::vector<std::string> const & filepaths) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return touch_locked(filepaths);
+}
+
+bool sa::epoch_journal::touch_locked(std::vector<std::string> const & filepaths) {
+    if(m_fd<0) {
+        return false;
+    }
+
+    std::vector<byte> records;
+    std::vector<std::pair<std::string, uint64_t> > added;
+    if(m_head==0) {
+        records.resize(header_size);
+        std::copy(header_magic, header_magic+4, records.begin());
+        encode_big_endian64(records.begin()+4, m_epoch);
+        journal_check(m_epoch, records.data(), 4, NULL, 0, records.data()+12);
+        // After a failed retire the journal may no longer hold the records
+        // of files already touched, so write them again with the header.
+        for(std::map<std::string, uint64_t>::const_iterator it = m_touched.begin(); it!=m_touched.end(); ++it) {
+            add_record(records, m_epoch, it->first, it->second);
+        }
+    }
+    for(size_t i=0; i<filepaths.size(); ++i) {
+        std::string const & filepath = filepaths[i];
+        if(m_touched.count(filepath)) {
+            continue;
+        }
+        uint64_t length = 0;
+        if(filepath.size()>0xffff || !current_length(filepath, length)) {
+            return false;
+        }
+        add_record(records, m_epoch, filepath, length);
+        added.push_back(std::make_pair(filepath, length));
+    }
+    if(added.empty() && (m_head!=0 || m_touched.empty())) {
+        return true;
+    }
+
+    // The records must be durable before any of the files grow.
+    SA_PROBE2(journal_begin, m_journal_path.c_str(), m_epoch);
+    bool success = pwrite_all(m_fd, records.data(), records.size(), m_head) && ::fdatasync(m_fd)==0;
+    SA_PROBE4(journal_end, m_journal_path.c_str(), m_epoch, records.size(), success);
+    if(!success) {
+        return false;
+    }
+    m_head += records.size();
+    m_touched.insert(added.begin(), added.end());
+    return true;
+}
+
+bool sa::epoch_journal::barrier() {
+    if(m_options.barrier==epoch_options::syncfs_barrier) {
+        return ::syncfs(m_fd)==0;
+    }
+
+    // Start writeback on a batch of files before waiting on any of them, so
+    // the device sees one large queue instead of one file at a time.
+    bool success = true;
+    std::map<std::string, uint64_t>::const_iterator it = m_touched.begin();
+    while(it!=m_touched.end()) {
+        std::vector<int> fds;
+        for(; it!=m_touched.end() && fds.size()<barrier_batch; ++it) {
+            int fd = ::open(it->first.c_str(), O_RDONLY | O_CLOEXEC);
+            if(fd<0) {
+                success = false;
+                continue;
+            }
+            ::sync_file_range(fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+            fds.push_back(fd);
+        }
+        for(int fd : fds) {
+            success = ::fdatasync(fd)==0 && success;
+            ::close(fd);
+        }
+    }
+    return success;
+}
+
+// Dropping the records is the commit point. The header naming the next
+// epoch goes first, which already disowns them (their checks use the old
+// epoch), then the truncation to just the header: both small, and made
+// durable by the fdatasync.
+bool sa::epoch_journal::retire(uint64_t next_epoch) {
+    byte header[header_size];
+    std::copy(header_magic, header_magic+4, header);
+    encode_big_endian64(header+4, next_epoch);
+    journal_check(next_epoch, header, 4, NULL, 0, header+12);
+    if(!pwrite_all(m_fd, header, header_size, 0) || ::ftruncate(m_fd, header_size)!=0 || ::fdatasync(m_fd)!=0) {
+        // The header may or may not have changed. The next touch writes it
+        // afresh, along with the records of every file touched so far.
+        m_head = 0;
+        return false;
+    }
+    m_head = header_size;
+    return true;
+}
+
+bool sa::epoch_journal::begin_append(std::string const & filepath) {
+    return begin_append(std::vector<std::string>(1, filepath));
+}
+
+bool sa::epoch_journal::begin_append(std::vector<std::string> const & filepaths) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if(!touch_locked(filepaths)) {
+        return false;
+    }
+    ++m_appending;
+    return true;
+}
+
+void sa::epoch_journal::end_append() {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        --m_appending;
+    }
+    m_idle.notify_all();
+}
+
+bool sa::epoch_journal::close() {
+    std::vector<std::string> files;
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_idle.wait(lock, [this]() { return m_appending==0; });
+        if(m_fd<0) {
+            return false;
+        }
+        if(m_touched.empty()) {
+            return true;
+        }
+        SA_PROBE2(commit_begin, m_journal_path.c_str(), m_epoch);
+        SA_PROBE2(sync_begin, m_journal_path.c_str(), m_epoch);
+        bool synced = barrier();
+        SA_PROBE3(sync_end, m_journal_path.c_str(), m_epoch, synced);
+        bool success = synced && retire(m_epoch+1);
+        SA_PROBE3(commit_end, m_journal_path.c_str(), m_epoch, success);
+        if(!success) {
+            return false;
+        }
+        for(std::map<std::string, uint64_t>::const_iterator it = m_touched.begin(); it!=m_touched.end(); ++it) {
+            files.push_back(it->first);
+        }
+        m_touched.clear();
+        ++m_epoch;
+    }
+    for(size_t i=0; i<files.size(); ++i) {
+        notify_commit_listeners(committed, files[i]);
+    }
+    return true;
+}
+
+bool sa::epoch_journal::truncate_touched() {
+    bool success = true;
+    for(std::map<std::string, uint64_t>::const_iterator it = m_touched.begin(); it!=m_touched.end(); ++it) {
+        success = truncate_to(it->first, it->second) && success;
+    }
+    return success;
+}
+
+bool sa::epoch_journal::rollback() {
+    std::vector<std::string> files;
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_idle.wait(lock, [this]() { return m_appending==0; });
+        if(m_fd<0) {
+            return false;
+        }
+        SA_PROBE2(rollback_begin, m_journal_path.c_str(), m_epoch);
+        bool success = truncate_touched() && retire(m_epoch+1);
+        SA_PROBE4(rollback_end, m_journal_path.c_str(), m_epoch, m_touched.size(), success);
+        if(!success) {
+            return false;
+        }
+        for(std::map<std::string, uint64_t>::const_iterator it = m_touched.begin(); it!=m_touched.end(); ++it) {
+            files.push_back(it->first);
+        }
+        m_touched.clear();
+        ++m_epoch;
+    }
+    for(size_t i=0; i<files.size(); ++i) {
+        notify_commit_listeners(rolled_back, files[i]);
+    }
+    return true;
+}
+
+uint64_t sa::epoch_journal::epoch() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_epoch;
+}
+
+size_t sa::epoch_journal::touched_count() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_touched.size();
+}
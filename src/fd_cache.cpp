@@ -0,0 +1,325 @@
+#include <algorithm>
+#include <cerrno>
+#include <functional>
+
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "fd_cache.h"
+
+static const int bypass_flags = O_CREAT | O_TRUNC | O_EXCL | O_APPEND;
+
+// Set once global() has made the cache.
+static std::atomic<sa::fd_cache *> global_cache(nullptr);
+
+sa::fd_cache::fd_cache(fd_cache_options const & opts)
+    : m_shard_capacity(0), m_hits(0), m_misses(0), m_evictions(0), m_bypassed(0) {
+    size_t shards = std::max<size_t>(opts.shards, 1);
+    for(size_t i=0; i<shards; ++i) {
+        m_shards.push_back(std::unique_ptr<shard>(new shard()));
+        m_fd_shards.push_back(std::unique_ptr<fd_shard>(new fd_shard()));
+    }
+    m_shard_capacity = (opts.capacity+shards-1)/shards;
+}
+
+sa::fd_cache::~fd_cache() {
+    for(size_t i=0; i<m_shards.size(); ++i) {
+        for(std::list<entry>::iterator it = m_shards[i]->lru.begin(); it!=m_shards[i]->lru.end(); ++it) {
+            ::close(it->fd);
+        }
+    }
+}
+
+sa::fd_cache & sa::fd_cache::global() {
+    static fd_cache * cache = []() {
+        fd_cache_options opts;
+        struct rlimit limit;
+        if(::getrlimit(RLIMIT_NOFILE, &limit)==0 && limit.rlim_cur!=RLIM_INFINITY) {
+            opts.capacity = std::min<size_t>(opts.capacity, std::max<size_t>(limit.rlim_cur/2, 1));
+        }
+        // Never destroyed, so descriptors stay valid during static destruction.
+        fd_cache * made = new fd_cache(opts);
+        global_cache.store(made, std::memory_order_release);
+        return made;
+    }();
+    return *cache;
+}
+
+void sa::fd_cache::invalidate_global(std::string const & path) {
+    fd_cache * cache = global_cache.load(std::memory_order_acquire);
+    if(cache) {
+        cache->invalidate(path);
+    }
+}
+
+sa::fd_cache::shard & sa::fd_cache::shard_for(std::string const & path) {
+    return *m_shards[std::hash<std::string>()(path) % m_shards.size()];
+}
+
+sa::fd_cache::fd_shard & sa::fd_cache::fd_shard_for(int fd) {
+    return *m_fd_shards[(size_t)fd % m_fd_shards.size()];
+}
+
+// The entry for a descriptor open() handed out: the indexed one, or a stale
+// one no longer in the index.
+std::list<sa::fd_cache::entry>::iterator sa::fd_cache::find_entry(shard & s, std::string const & path, int fd) {
+    std::unordered_map<std::string, std::list<entry>::iterator>::iterator found = s.index.find(path);
+    if(found!=s.index.end() && found->second->fd==fd) {
+        return found->second;
+    }
+    return std::find_if(s.lru.begin(), s.lru.end(), [fd](entry const & e) { return e.fd==fd; });
+}
+
+// Take an entry out of the index. Unpinned, it goes now; pinned, it goes
+// when its last pin does.
+void sa::fd_cache::drop(shard & s, std::list<entry>::iterator it, std::vector<int> & out_fds) {
+    s.index.erase(it->path);
+    if(it->pins==0) {
+        out_fds.push_back(it->fd);
+        s.lru.erase(it);
+        return;
+    }
+    it->stale = true;
+    s.stale_held += it->held;
+}
+
+void sa::fd_cache::unpin(shard & s, std::list<entry>::iterator it, std::vector<int> & out_fds) {
+    if(--it->pins==0 && it->stale) {
+        out_fds.push_back(it->fd);
+        s.lru.erase(it);
+    }
+    else {
+        evict(s, out_fds);
+    }
+}
+
+// Unlink least recently used, unpinned entries until the shard fits. The
+// descriptors are closed by the caller, after forget(), outside the lock.
+void sa::fd_cache::evict(shard & s, std::vector<int> & out_fds) {
+    size_t capacity = m_shard_capacity;
+    std::list<entry>::iterator it = s.lru.end();
+    while(s.lru.size()>capacity && it!=s.lru.begin()) {
+        --it;
+        if(it->pins>0) {
+            continue;
+        }
+        out_fds.push_back(it->fd);
+        s.index.erase(it->path);
+        it = s.lru.erase(it);
+        ++m_evictions;
+    }
+}
+
+// Drop the descriptors from the fd index, then close them. In that order, a
+// descriptor number reused by the kernel can never be mistaken for a cached
+// one.
+void sa::fd_cache::forget(std::vector<int> const & fds) {
+    for(size_t i=0; i<fds.size(); ++i) {
+        fd_shard & f = fd_shard_for(fds[i]);
+        {
+            std::lock_guard<std::mutex> lock(f.mutex);
+            f.paths.erase(fds[i]);
+        }
+        ::close(fds[i]);
+    }
+}
+
+int sa::fd_cache::open(std::string const & path, int flags) {
+    int access = flags & O_ACCMODE;
+    if(flags & bypass_flags) {
+        ++m_bypassed;
+        return ::open(path.c_str(), flags | O_CLOEXEC, 0666);
+    }
+
+    // A cached descriptor is only reused while its file still has a name:
+    // one unlinked, or renamed over, behind the cache's back is replaced,
+    // never appended to. The library's own unlinks and renames invalidate
+    // the path, which also covers a file renamed away.
+    shard & s = shard_for(path);
+    {
+        std::lock_guard<std::mutex> lock(s.mutex);
+        std::unordered_map<std::string, std::list<entry>::iterator>::iterator found = s.index.find(path);
+        if(found!=s.index.end()) {
+            entry & e = *found->second;
+            struct stat st;
+            if(!e.stale && (access==O_RDONLY || e.writable)
+               && ::fstat(e.fd, &st)==0 && st.st_nlink>0) {
+                ++e.pins;
+                s.lru.splice(s.lru.begin(), s.lru, found->second);
+                ++m_hits;
+                return e.fd;
+            }
+        }
+    }
+
+    bool writable = true;
+    int fd = ::open(path.c_str(), O_RDWR | O_CLOEXEC);
+    if(fd<0 && access==O_RDONLY && (errno==EACCES || errno==EROFS || errno==EISDIR)) {
+        writable = false;
+        fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    }
+    if(fd<0) {
+        int saved = errno;
+        // Gone: drop the entry rather than keep a deleted file open.
+        invalidate(path);
+        errno = saved;
+        return -1;
+    }
+    ++m_misses;
+
+    {
+        fd_shard & f = fd_shard_for(fd);
+        std::lock_guard<std::mutex> lock(f.mutex);
+        f.paths[fd] = path;
+    }
+    std::vector<int> evicted;
+    {
+        std::lock_guard<std::mutex> lock(s.mutex);
+        std::unordered_map<std::string, std::list<entry>::iterator>::iterator found = s.index.find(path);
+        if(found!=s.index.end()) {
+            // Replaced: stale, read-only, or opened by another thread
+            // meanwhile. The old descriptor goes once it is unpinned.
+            drop(s, found->second, evicted);
+        }
+        entry e = { path, fd, writable, false, false, 1 };
+        s.lru.push_front(e);
+        s.index[path] = s.lru.begin();
+        evict(s, evicted);
+    }
+    int saved = errno;
+    forget(evicted);
+    errno = saved;
+    return fd;
+}
+
+bool sa::fd_cache::close(int fd) {
+    std::string path;
+    {
+        fd_shard & f = fd_shard_for(fd);
+        std::lock_guard<std::mutex> lock(f.mutex);
+        std::unordered_map<int, std::string>::iterator found = f.paths.find(fd);
+        if(found==f.paths.end()) {
+            // Not cached: a bypassed open.
+            return ::close(fd)==0;
+        }
+        path = found->second;
+    }
+
+    shard & s = shard_for(path);
+    std::vector<int> evicted;
+    {
+        std::lock_guard<std::mutex> lock(s.mutex);
+        std::list<entry>::iterator it = find_entry(s, path, fd);
+        if(it==s.lru.end() || it->pins==0) {
+            errno = EBADF;
+            return false;
+        }
+        unpin(s, it, evicted);
+    }
+    forget(evicted);
+    return true;
+}
+
+bool sa::fd_cache::hold(std::string const & path) {
+    shard & s = shard_for(path);
+    {
+        std::lock_guard<std::mutex> lock(s.mutex);
+        std::unordered_map<std::string, std::list<entry>::iterator>::iterator found = s.index.find(path);
+        if(found!=s.index.end() && found->second->held) {
+            return true;
+        }
+    }
+    int fd = open(path, O_RDONLY);
+    if(fd<0) {
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(s.mutex);
+    std::list<entry>::iterator it = find_entry(s, path, fd);
+    if(it->held) {
+        // Held by another thread meanwhile; its pin is enough.
+        --it->pins;
+        return true;
+    }
+    // The pin open() took is the hold's.
+    it->held = true;
+    s.stale_held += it->stale;
+    return true;
+}
+
+void sa::fd_cache::release(std::string const & path) {
+    shard & s = shard_for(path);
+    std::vector<int> evicted;
+    {
+        std::lock_guard<std::mutex> lock(s.mutex);
+        std::unordered_map<std::string, std::list<entry>::iterator>::iterator found = s.index.find(path);
+        if(found!=s.index.end() && found->second->held) {
+            found->second->held = false;
+            unpin(s, found->second, evicted);
+        }
+        // A hold on a file since replaced or invalidated.
+        for(std::list<entry>::iterator it = s.lru.begin(); s.stale_held>0 && it!=s.lru.end(); ) {
+            std::list<entry>::iterator next = it;
+            ++next;
+            if(it->stale && it->held && it->path==path) {
+                it->held = false;
+                --s.stale_held;
+                unpin(s, it, evicted);
+            }
+            it = next;
+        }
+    }
+    forget(evicted);
+}
+
+void sa::fd_cache::invalidate(std::string const & path) {
+    shard & s = shard_for(path);
+    std::vector<int> evicted;
+    {
+        std::lock_guard<std::mutex> lock(s.mutex);
+        std::unordered_map<std::string, std::list<entry>::iterator>::iterator found = s.index.find(path);
+        if(found==s.index.end()) {
+            return;
+        }
+        drop(s, found->second, evicted);
+    }
+    forget(evicted);
+}
+
+void sa::fd_cache::set_capacity(size_t capacity) {
+    m_shard_capacity = (capacity+m_shards.size()-1)/m_shards.size();
+    for(size_t i=0; i<m_shards.size(); ++i) {
+        std::vector<int> evicted;
+        {
+            std::lock_guard<std::mutex> lock(m_shards[i]->mutex);
+            evict(*m_shards[i], evicted);
+        }
+        forget(evicted);
+    }
+}
+
+sa::fd_cache_stats sa::fd_cache::stats() const {
+    fd_cache_stats st;
+    st.hits = m_hits;
+    st.misses = m_misses;
+    st.evictions = m_evictions;
+    st.bypassed = m_bypassed;
+    st.open_count = 0;
+    st.pinned_count = 0;
+    for(size_t i=0; i<m_shards.size(); ++i) {
+        std::lock_guard<std::mutex> lock(m_shards[i]->mutex);
+        st.open_count += m_shards[i]->lru.size();
+        for(std::list<entry>::const_iterator it = m_shards[i]->lru.begin(); it!=m_shards[i]->lru.end(); ++it) {
+            st.pinned_count += it->pins>0;
+        }
+    }
+    return st;
+}
+
+void sa::fd_cache::reset_stats() {
+    m_hits = 0;
+    m_misses = 0;
+    m_evictions = 0;
+    m_bypassed = 0;
+}
@@ -0,0 +1,364 @@
+#include <algorithm>
+#include <cstring>
+#include <mutex>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "safe_append.h"
+#include "safe_append_internals.h"
+#include "integrity.h"
+#include "parallel_for.h"
+#include "retention.h"
+#include "stream_hash.h"
+
+// The sidecar is two files next to the data file:
+//
+//   i_<sha1>.int  checksummed head, replaced atomically on every extension:
+//                 magic, chunk size, covered length, complete chunk count,
+//                 chained root over the chunk digests and a snapshot of the
+//                 running digest of the trailing partial chunk.
+//   i_<sha1>.dig  append-only array of the sha512 digests of complete chunks.
+//
+// Digests are appended (and synced) before the head that counts them is
+// replaced, so a crash between the two leaves extra records past the
+// counted ones, which the next extension overwrites.
+
+static const byte integrity_magic[4] = { 'S', 'A', 'I', 'N' };
+static const size_t integrity_head_size = 4 + 8 + 8 + 8 + SHA512::DIGEST_SIZE + sha512_stream::snapshot_size;
+static const size_t integrity_read_size = 1024*1024;
+
+namespace {
+    
+    struct integrity_head {
+        uint64_t chunk_size;
+        uint64_t covered_length;
+        uint64_t chunk_count;
+        uchar_sha512_array root;
+        sha512_stream tail;
+    };
+    
+}
+
+static void integrity_names(std::string const & filepath, std::string & head_name, std::string & digest_name) {
+    sidecar_name(filepath, "i_", ".int", head_name);
+    sidecar_name(filepath, "i_", ".dig", digest_name);
+}
+
+static bool read_integrity_head(std::string const & head_name, integrity_head & head) {
+    std::array<byte, integrity_head_size> buf;
+    size_t len = 0;
+    if(!read_checksummed_file(head_name, buf.data(), buf.size(), len) || len!=buf.size()
+       || !std::equal(integrity_magic, integrity_magic+4, buf.begin())) {
+        return false;
+    }
+    byte const * p = buf.data()+4;
+    head.chunk_size = extract_big_endian64(p);
+    p+=8;
+    head.covered_length = extract_big_endian64(p);
+    p+=8;
+    head.chunk_count = extract_big_endian64(p);
+    p+=8;
+    std::copy(p, p+SHA512::DIGEST_SIZE, head.root.begin());
+    p+=SHA512::DIGEST_SIZE;
+    return head.chunk_size>0 && head.tail.restore(byte_span(p, sha512_stream::snapshot_size));
+}
+
+static bool write_integrity_head(std::string const & head_name, integrity_head const & head) {
+    std::array<byte, integrity_head_size> buf;
+    byte * p = buf.data();
+    std::copy(integrity_magic, integrity_magic+4, p);
+    p+=4;
+    encode_big_endian64(p, head.chunk_size);
+    p+=8;
+    encode_big_endian64(p, head.covered_length);
+    p+=8;
+    encode_big_endian64(p, head.chunk_count);
+    p+=8;
+    p = std::copy(head.root.begin(), head.root.end(), p);
+    std::vector<byte> snapshot = head.tail.snapshot();
+    if(snapshot.size()!=sha512_stream::snapshot_size) {
+        return false;
+    }
+    std::copy(snapshot.begin(), snapshot.end(), p);
+    return replace_checksummed_file(head_name, buf.data(), buf.size());
+}
+
+// root_i = sha512(root_{i-1} || digest_i), with root_0 all zeros.
+static void chain_digest(uchar_sha512_array & root, byte const * digest) {
+    SHA512 & ctx = thread_sha512_context();
+    ctx.init();
+    ctx.update(root.data(), root.size());
+    ctx.update(digest, SHA512::DIGEST_SIZE);
+    ctx.final(root.data());
+}
+
+// Hash [begin, end) of the data file into hash.
+static bool hash_range(int fd, uint64_t begin, uint64_t end, sha512_stream & hash) {
+    std::vector<byte> buf((size_t)std::min<uint64_t>(integrity_read_size, end-begin));
+    for(uint64_t pos=begin; pos<end; ) {
+        size_t n = (size_t)std::min<uint64_t>(buf.size(), end-pos);
+        if(!pread_all(fd, buf.data(), n, pos)) {
+            return false;
+        }
+        hash.update(buf.data(), n);
+        pos+=n;
+    }
+    return true;
+}
+
+static std::string & integrity_buffer() {
+    static thread_local std::string buf;
+    return buf;
+}
+
+bool sa::has_integrity(std::string const & filepath) {
+    std::string & head_name = integrity_buffer();
+    sidecar_name(filepath, "i_", ".int", head_name);
+    return file_exists(head_name);
+}
+
+bool sa::enable_integrity(std::string const & filepath, uint64_t chunk_size) {
+    if(chunk_size==0 || flen(filepath)<0) {
+        return false;
+    }
+    std::string head_name, digest_name;
+    integrity_names(filepath, head_name, digest_name);
+    
+    integrity_head head;
+    head.chunk_size = chunk_size;
+    head.covered_length = 0;
+    head.chunk_count = 0;
+    head.root.fill(0);
+    
+    int fd = ::open(digest_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if(fd<0) {
+        return false;
+    }
+    ::close(fd);
+    
+    return write_integrity_head(head_name, head) && sa::extend_integrity(filepath);
+}
+
+bool sa::disable_integrity(std::string const & filepath) {
+    std::string head_name, digest_name;
+    integrity_names(filepath, head_name, digest_name);
+    bool success = delete_file(head_name);
+    return delete_file(digest_name) && success;
+}
+
+bool sa::extend_integrity(std::string const & filepath) {
+    std::string head_name, digest_name;
+    integrity_names(filepath, head_name, digest_name);
+    
+    integrity_head head;
+    if(!read_integrity_head(head_name, head)) {
+        return false;
+    }
+    long data_len = flen(filepath);
+    if(data_len<0 || (uint64_t)data_len<head.covered_length) {
+        // Committed data went missing underneath us; the sidecar must be rebuilt.
+        return false;
+    }
+    if((uint64_t)data_len==head.covered_length) {
+        return true;
+    }
+    
+    int data_fd = ::open(filepath.c_str(), O_RDONLY | O_CLOEXEC);
+    if(data_fd<0) {
+        return false;
+    }
+    
+    std::vector<byte> buf(std::min<uint64_t>(integrity_read_size, data_len-head.covered_length));
+    std::vector<byte> new_digests;
+    uint64_t pos = head.covered_length;
+    bool success = true;
+    while(success && pos<(uint64_t)data_len) {
+        uint64_t room = head.chunk_size-head.tail.length();
+        size_t n = (size_t)std::min<uint64_t>(std::min<uint64_t>(buf.size(), data_len-pos), room);
+        success = pread_all(data_fd, buf.data(), n, pos);
+        head.tail.update(buf.data(), n);
+        pos+=n;
+        if(head.tail.length()==head.chunk_size) {
+            sha512_stream::digest_type d = head.tail.digest();
+            new_digests.insert(new_digests.end(), d.begin(), d.end());
+            chain_digest(head.root, d.data());
+            head.tail.reset();
+        }
+    }
+    ::close(data_fd);
+    if(!success) {
+        return false;
+    }
+    
+    if(!new_digests.empty()) {
+        int dig_fd = ::open(digest_name.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0666);
+        if(dig_fd<0) {
+            return false;
+        }
+        uint64_t offset = head.chunk_count*SHA512::DIGEST_SIZE;
+        success = pwrite_all(dig_fd, new_digests.data(), new_digests.size(), offset)
+                  && ::ftruncate(dig_fd, offset+new_digests.size())==0
+                  && ::fdatasync(dig_fd)==0;
+        success = (::close(dig_fd)==0) && success;
+        if(!success) {
+            return false;
+        }
+        head.chunk_count += new_digests.size()/SHA512::DIGEST_SIZE;
+    }
+    head.covered_length = pos;
+    return write_integrity_head(head_name, head);
+}
+
+/**
+ * Rehash the chunks overlapping [offset, offset+length) and rebuild the
+ * root. The digests are rewritten in place before the head, so a crash in
+ * between leaves a root that no longer matches: the sidecar reads as
+ * damaged rather than as valid for the wrong contents.
+ */
+
+bool sa::refresh_integrity(std::string const & filepath, uint64_t offset, uint64_t length) {
+    std::string head_name, digest_name;
+    integrity_names(filepath, head_name, digest_name);
+    
+    integrity_head head;
+    if(!read_integrity_head(head_name, head)) {
+        return false;
+    }
+    long data_len = flen(filepath);
+    if(data_len<0 || (uint64_t)data_len<head.covered_length) {
+        return false;
+    }
+    uint64_t end = (length>head.covered_length || offset>head.covered_length-length)
+                   ? head.covered_length : offset+length;
+    if(offset<end) {
+        std::vector<byte> digests(head.chunk_count*SHA512::DIGEST_SIZE);
+        int dig_fd = ::open(digest_name.c_str(), O_RDWR | O_CLOEXEC);
+        if(dig_fd<0) {
+            return false;
+        }
+        int data_fd = ::open(filepath.c_str(), O_RDONLY | O_CLOEXEC);
+        bool success = data_fd>=0 && pread_all(dig_fd, digests.data(), digests.size(), 0);
+        uint64_t first = offset/head.chunk_size;
+        uint64_t last = (end-1)/head.chunk_size;
+        for(uint64_t chunk=first; success && chunk<=last; ++chunk) {
+            uint64_t chunk_begin = chunk*head.chunk_size;
+            uint64_t chunk_end = std::min(chunk_begin+head.chunk_size, head.covered_length);
+            sha512_stream hash;
+            success = hash_range(data_fd, chunk_begin, chunk_end, hash);
+            if(chunk<head.chunk_count) {
+                sha512_stream::digest_type d = hash.digest();
+                std::copy(d.begin(), d.end(), digests.begin()+chunk*SHA512::DIGEST_SIZE);
+            } else {
+                head.tail = hash;
+            }
+        }
+        if(data_fd>=0) {
+            ::close(data_fd);
+        }
+        uint64_t stop = std::min(last+1, head.chunk_count);
+        if(success && first<stop) {
+            success = pwrite_all(dig_fd, digests.data()+first*SHA512::DIGEST_SIZE,
+                                 (size_t)((stop-first)*SHA512::DIGEST_SIZE), first*SHA512::DIGEST_SIZE)
+                      && ::fdatasync(dig_fd)==0;
+        }
+        success = (::close(dig_fd)==0) && success;
+        if(!success) {
+            return false;
+        }
+        head.root.fill(0);
+        for(uint64_t i=0; i<head.chunk_count; ++i) {
+            chain_digest(head.root, digests.data()+i*SHA512::DIGEST_SIZE);
+        }
+        if(!write_integrity_head(head_name, head)) {
+            return false;
+        }
+    }
+    // Bytes written past the covered length are hashed as an extension.
+    return sa::extend_integrity(filepath);
+}
+
+sa::integrity_report sa::verify_integrity(std::string const & filepath, unsigned threads) {
+    return sa::verify_integrity(filepath, 0, UINT64_MAX, threads);
+}
+
+sa::integrity_report sa::verify_integrity(std::string const & filepath, uint64_t offset, uint64_t length, unsigned threads) {
+    sa::integrity_report rv;
+    rv.valid = false;
+    rv.covered_length = 0;
+    
+    std::string head_name, digest_name;
+    integrity_names(filepath, head_name, digest_name);
+    
+    integrity_head head;
+    if(!read_integrity_head(head_name, head)) {
+        return rv;
+    }
+    rv.covered_length = head.covered_length;
+    
+    // The chunk digests are only trusted once their chained root matches.
+    std::vector<byte> digests(head.chunk_count*SHA512::DIGEST_SIZE);
+    int dig_fd = ::open(digest_name.c_str(), O_RDONLY | O_CLOEXEC);
+    if(dig_fd<0) {
+        return rv;
+    }
+    bool success = pread_all(dig_fd, digests.data(), digests.size(), 0);
+    ::close(dig_fd);
+    if(!success) {
+        return rv;
+    }
+    uchar_sha512_array root;
+    root.fill(0);
+    for(uint64_t i=0; i<head.chunk_count; ++i) {
+        chain_digest(root, digests.data()+i*SHA512::DIGEST_SIZE);
+    }
+    if(!bytes_equal(root, head.root)) {
+        return rv;
+    }
+    
+    uint64_t end = (length>head.covered_length || offset>head.covered_length-length)
+                   ? head.covered_length : offset+length;
+    // Chunks reaching below the logical start were released by retention
+    // and no longer hold what was hashed.
+    uint64_t retained = sa::logical_start(filepath);
+    retained = (retained+head.chunk_size-1)/head.chunk_size*head.chunk_size;
+    offset = std::max(offset, retained);
+    if(offset>=end) {
+        rv.valid = true;
+        return rv;
+    }
+    uint64_t first = offset/head.chunk_size;
+    uint64_t last = (end-1)/head.chunk_size;
+    
+    int data_fd = ::open(filepath.c_str(), O_RDONLY | O_CLOEXEC);
+    if(data_fd<0) {
+        return rv;
+    }
+    
+    std::mutex bad_mutex;
+    parallel_for((size_t)(last-first+1), threads, [&](size_t i) {
+        uint64_t chunk = first+i;
+        uint64_t chunk_begin = chunk*head.chunk_size;
+        uint64_t chunk_end = std::min(chunk_begin+head.chunk_size, head.covered_length);
+        sha512_stream hash;
+        bool ok = hash_range(data_fd, chunk_begin, chunk_end, hash);
+        if(ok) {
+            sha512_stream::digest_type d = hash.digest();
+            if(chunk<head.chunk_count) {
+                ok = std::equal(d.begin(), d.end(), digests.begin()+chunk*SHA512::DIGEST_SIZE);
+            } else {
+                ok = bytes_equal(d, head.tail.digest());
+            }
+        }
+        if(!ok) {
+            std::lock_guard<std::mutex> lock(bad_mutex);
+            rv.bad_chunks.push_back(chunk);
+        }
+    });
+    ::close(data_fd);
+    
+    std::sort(rv.bad_chunks.begin(), rv.bad_chunks.end());
+    rv.valid = rv.bad_chunks.empty();
+    return rv;
+}
@@ -0,0 +1,64 @@
+#include "io_pool.h"
+
+sa::io_pool::io_pool(unsigned threads) : m_stop(false), m_completed(0) {
+    if(threads==0) {
+        threads = std::thread::hardware_concurrency();
+    }
+    if(threads==0) {
+        threads = 1;
+    }
+    m_threads.reserve(threads);
+    for(unsigned t=0; t<threads; ++t) {
+        m_threads.push_back(std::thread(&io_pool::run, this));
+    }
+}
+
+sa::io_pool::~io_pool() {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_work.notify_all();
+    for(std::thread & th : m_threads) {
+        th.join();
+    }
+}
+
+void sa::io_pool::submit(std::function<void()> job) {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_jobs.push_back(std::move(job));
+    }
+    m_work.notify_one();
+}
+
+unsigned sa::io_pool::thread_count() const {
+    return (unsigned)m_threads.size();
+}
+
+size_t sa::io_pool::pending() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_jobs.size();
+}
+
+uint64_t sa::io_pool::completed() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_completed;
+}
+
+void sa::io_pool::run() {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    for(;;) {
+        m_work.wait(lock, [this]() { return m_stop || !m_jobs.empty(); });
+        if(m_jobs.empty()) {
+            // Stopping, and nothing is left to run.
+            return;
+        }
+        std::function<void()> job = std::move(m_jobs.front());
+        m_jobs.pop_front();
+        lock.unlock();
+        job();
+        lock.lock();
+        ++m_completed;
+    }
+}
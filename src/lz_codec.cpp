@@ -0,0 +1,145 @@
+#include <array>
+#include <cstdint>
+#include <cstring>
+
+#include "lz_codec.h"
+
+// Format limits: the last 5 bytes are always literals, and no match starts
+// within 12 bytes of the end.
+static const size_t lz_min_match = 4;
+static const size_t lz_last_literals = 5;
+static const size_t lz_match_limit = 12;
+static const size_t lz_max_offset = 65535;
+static const int lz_hash_bits = 12;
+
+static inline uint32_t read32(byte const * p) {
+    uint32_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t lz_hash(uint32_t sequence) {
+    return (sequence*2654435761u) >> (32-lz_hash_bits);
+}
+
+static inline byte * write_length(byte * op, size_t length) {
+    for(; length>=255; length-=255) {
+        *op++ = 255;
+    }
+    *op++ = (byte)length;
+    return op;
+}
+
+static inline byte * write_literals(byte * op, byte * token, byte const * literals, size_t length) {
+    *token = (byte)((length<15 ? length : 15) << 4);
+    if(length>=15) {
+        op = write_length(op, length-15);
+    }
+    std::memcpy(op, literals, length);
+    return op+length;
+}
+
+size_t lz_compress(byte const * in, size_t length, byte * out) {
+    static thread_local std::array<uint32_t, 1<<lz_hash_bits> table;
+    table.fill(0);
+    
+    byte * op = out;
+    size_t anchor = 0;
+    if(length>lz_match_limit) {
+        size_t const match_start_limit = length-lz_match_limit;
+        size_t const match_end_limit = length-lz_last_literals;
+        size_t i = 1;
+        while(i<match_start_limit) {
+            uint32_t sequence = read32(in+i);
+            uint32_t & slot = table[lz_hash(sequence)];
+            size_t candidate = slot;
+            slot = (uint32_t)i;
+            if(candidate>=i || i-candidate>lz_max_offset || read32(in+candidate)!=sequence) {
+                // Step faster through data that is not compressing.
+                i += 1 + ((i-anchor)>>6);
+                continue;
+            }
+            while(i>anchor && candidate>0 && in[i-1]==in[candidate-1]) {
+                --i;
+                --candidate;
+            }
+            size_t match = lz_min_match;
+            while(i+match<match_end_limit && in[i+match]==in[candidate+match]) {
+                ++match;
+            }
+            
+            byte * token = op++;
+            op = write_literals(op, token, in+anchor, i-anchor);
+            size_t offset = i-candidate;
+            *op++ = (byte)offset;
+            *op++ = (byte)(offset>>8);
+            size_t extra = match-lz_min_match;
+            *token |= (byte)(extra<15 ? extra : 15);
+            if(extra>=15) {
+                op = write_length(op, extra-15);
+            }
+            i += match;
+            anchor = i;
+        }
+    }
+    byte * token = op++;
+    op = write_literals(op, token, in+anchor, length-anchor);
+    return op-out;
+}
+
+static inline bool read_length(byte const * in, size_t length, size_t & ip, size_t & out_value) {
+    byte b;
+    do {
+        if(ip>=length) return false;
+        b = in[ip++];
+        out_value += b;
+    } while(b==255);
+    return true;
+}
+
+bool lz_decompress(byte const * in, size_t length, byte * out, size_t out_length) {
+    size_t ip = 0;
+    size_t op = 0;
+    while(ip<length) {
+        byte token = in[ip++];
+        size_t literals = token>>4;
+        if(literals==15 && !read_length(in, length, ip, literals)) {
+            return false;
+        }
+        if(literals>length-ip || literals>out_length-op) {
+            return false;
+        }
+        std::memcpy(out+op, in+ip, literals);
+        ip += literals;
+        op += literals;
+        if(ip==length) {
+            // The last sequence has literals only.
+            break;
+        }
+        
+        if(length-ip<2) {
+            return false;
+        }
+        size_t offset = in[ip] | ((size_t)in[ip+1]<<8);
+        ip += 2;
+        size_t match = token&15;
+        if(match==15 && !read_length(in, length, ip, match)) {
+            return false;
+        }
+        match += lz_min_match;
+        if(offset==0 || offset>op || match>out_length-op) {
+            return false;
+        }
+        byte const * from = out+op-offset;
+        if(offset>=match) {
+            std::memcpy(out+op, from, match);
+        } else {
+            // Overlapping copy repeats the last `offset` bytes.
+            for(size_t k=0; k<match; ++k) {
+                out[op+k] = from[k];
+            }
+        }
+        op += match;
+    }
+    return op==out_length;
+}
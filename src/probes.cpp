@@ -0,0 +1,24 @@
+#include "probes.h"
+
+#ifdef SA_PROBES_ENABLED
+// One USDT semaphore per probe, named as <sys/sdt.h> expects; a tracer
+// increments a probe's semaphore while attached to it.
+#define SA_SEMAPHORE(name) \
+    unsigned short safe_append_##name##_semaphore __attribute__((section(".probes"))) = 0
+
+extern "C" {
+    SA_SEMAPHORE(start_begin);
+    SA_SEMAPHORE(start_end);
+    SA_SEMAPHORE(journal_begin);
+    SA_SEMAPHORE(journal_end);
+    SA_SEMAPHORE(checksum);
+    SA_SEMAPHORE(sync_begin);
+    SA_SEMAPHORE(sync_end);
+    SA_SEMAPHORE(append);
+    SA_SEMAPHORE(commit_begin);
+    SA_SEMAPHORE(commit_end);
+    SA_SEMAPHORE(rollback_begin);
+    SA_SEMAPHORE(rollback_end);
+    SA_SEMAPHORE(cleanup);
+}
+#endif
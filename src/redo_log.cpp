@@ -0,0 +1,330 @@
+#include <algorithm>
+#include <cerrno>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "safe_append.h"
+#include "safe_append_internals.h"
+#include "redo_log.h"
+#include "probes.h"
+
+static const byte record_magic[4] = { 'S', 'A', 'W', 'R' };
+static const byte checkpoint_magic[4] = { 'S', 'A', 'W', 'C' };
+static const size_t record_header_size = 4+8+2+4+8+8;
+static const size_t record_checked_size = record_header_size-8;
+static const size_t checkpoint_size = 4+8+8;
+
+static void record_check(byte const * header, byte const * path, size_t path_length,
+                         byte const * payload, size_t length, byte * out) {
+    SHA512 & ctx = thread_sha512_context();
+    uchar_sha512_array d;
+    ctx.init();
+    ctx.update(header, record_checked_size);
+    ctx.update(path, path_length);
+    ctx.update(payload, length);
+    ctx.final(d.data());
+    std::copy(d.begin(), d.begin()+8, out);
+}
+
+static std::string checkpoint_path(std::string const & log_path) {
+    return log_path + ".ckpt";
+}
+
+sa::redo_log::redo_log(std::string const & log_path, redo_log_options const & opts)
+    : m_log_path(log_path), m_options(opts), m_fd(-1), m_replayed(0), m_skipped(0), m_head(0), m_next_sequence(1),
+      m_applying(false), m_restarting(false), m_apply_failed(false), m_pending_bytes(0), m_applied_batches(0), m_stop(false) {
+    m_fd = ::open(log_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+    if(m_fd<0) {
+        return;
+    }
+    struct stat st;
+    if(::fstat(m_fd, &st)!=0
+       || ((uint64_t)st.st_size<m_options.capacity && ::posix_fallocate(m_fd, 0, (off_t)m_options.capacity)!=0)
+       || !replay()) {
+        ::close(m_fd);
+        m_fd = -1;
+        return;
+    }
+    m_thread = std::thread(&redo_log::run, this);
+}
+
+sa::redo_log::~redo_log() {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_work.notify_all();
+    if(m_thread.joinable()) {
+        m_thread.join();
+    }
+    if(m_fd>=0) {
+        ::close(m_fd);
+    }
+}
+
+bool sa::redo_log::write_checkpoint(uint64_t offset, uint64_t sequence) {
+    std::array<byte, checkpoint_size> c;
+    std::copy(checkpoint_magic, checkpoint_magic+4, c.begin());
+    encode_big_endian64(c.begin()+4, offset);
+    encode_big_endian64(c.begin()+12, sequence);
+    return replace_checksummed_file(checkpoint_path(m_log_path), c.data(), c.size());
+}
+
+/**
+ * Apply every intact record after the checkpoint, in sequence. The scan
+ * stops at the first record that is torn, or left over from before the log
+ * last started again (its sequence is too low). Records for data files
+ * that no longer exist are skipped and counted, rather than keep the log
+ * from ever opening again.
+ */
+
+bool sa::redo_log::replay() {
+    uint64_t offset = 0;
+    std::array<byte, checkpoint_size> c;
+    size_t len = 0;
+    std::string cname = checkpoint_path(m_log_path);
+    if(file_exists(cname)) {
+        if(!read_checksummed_file(cname, c.data(), c.size(), len) || len!=c.size()
+           || !std::equal(checkpoint_magic, checkpoint_magic+4, c.begin())) {
+            return false;
+        }
+        byte const * p = c.data()+4;
+        offset = extract_big_endian64(p);
+        p = c.data()+12;
+        m_next_sequence = extract_big_endian64(p);
+    }
+    
+    std::vector<record> records;
+    std::vector<byte> body;
+    std::array<byte, record_header_size> header;
+    byte check[8];
+    while(offset+record_header_size<=m_options.capacity
+          && pread_all(m_fd, header.data(), header.size(), offset)
+          && std::equal(record_magic, record_magic+4, header.begin())) {
+        byte const * p = header.data()+4;
+        uint64_t sequence = extract_big_endian64(p);
+        uint16_t path_length = (uint16_t)((header[12]<<8) | header[13]);
+        p = header.data()+14;
+        uint32_t length = extract_big_endian(p);
+        p = header.data()+18;
+        uint64_t file_offset = extract_big_endian64(p);
+        uint64_t end = offset+record_header_size+path_length+length;
+        if(sequence!=m_next_sequence || end>m_options.capacity) {
+            break;
+        }
+        body.resize(path_length+length);
+        if(!pread_all(m_fd, body.data(), body.size(), offset+record_header_size)) {
+            break;
+        }
+        record_check(header.data(), body.data(), path_length, body.data()+path_length, length, check);
+        if(!std::equal(check, check+8, header.begin()+record_checked_size)) {
+            break;
+        }
+        record r;
+        r.filepath.assign(reinterpret_cast<char const *>(body.data()), path_length);
+        r.file_offset = file_offset;
+        r.log_offset = offset+record_header_size+path_length;
+        r.length = length;
+        records.push_back(r);
+        ++m_next_sequence;
+        offset = end;
+    }
+    m_replayed = records.size();
+    if(!records.empty() && !apply(records, true)) {
+        return false;
+    }
+    return write_checkpoint(0, m_next_sequence);
+}
+
+/**
+ * Copy a batch of records to their data files: sorted by file and offset,
+ * one write per contiguous run, one sync per file.
+ */
+
+bool sa::redo_log::apply(std::vector<record> & batch, bool skip_missing) {
+    std::stable_sort(batch.begin(), batch.end(), [](record const & a, record const & b) {
+        return a.filepath<b.filepath || (a.filepath==b.filepath && a.file_offset<b.file_offset);
+    });
+    std::vector<byte> run;
+    size_t i = 0;
+    while(i<batch.size()) {
+        std::string const & path = batch[i].filepath;
+        int fd = ::open(path.c_str(), O_WRONLY | O_CLOEXEC);
+        if(fd<0 && skip_missing && errno==ENOENT) {
+            for(; i<batch.size() && batch[i].filepath==path; ++i) {
+                ++m_skipped;
+            }
+            continue;
+        }
+        if(fd<0) {
+            return false;
+        }
+        bool success = true;
+        for(; success && i<batch.size() && batch[i].filepath==path; ) {
+            uint64_t run_offset = batch[i].file_offset;
+            run.clear();
+            for(; success && i<batch.size() && batch[i].filepath==path
+                  && batch[i].file_offset==run_offset+run.size(); ++i) {
+                size_t at = run.size();
+                run.resize(at+batch[i].length);
+                success = pread_all(m_fd, run.data()+at, batch[i].length, batch[i].log_offset);
+            }
+            success = success && pwrite_all(fd, run.data(), run.size(), run_offset);
+        }
+        success = success && ::fdatasync(fd)==0;
+        success = (::close(fd)==0) && success;
+        if(!success) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool sa::redo_log::append(std::string const & filepath, byte const * bytes, size_t length) {
+    size_t size = record_header_size+filepath.size()+length;
+    if(m_fd<0 || filepath.size()>0xffff || length>0xffffffffu || size>m_options.capacity) {
+        return false;
+    }
+    std::unique_lock<std::mutex> lock(m_mutex);
+    // The log is starting again from the top; its record would go there.
+    m_progress.wait(lock, [this]() { return !m_restarting; });
+    if(m_head+size>m_options.capacity) {
+        // Full: wait for the applier to catch up and start the log again.
+        m_work.notify_one();
+        m_progress.wait(lock, [&]() {
+            return m_stop || m_apply_failed || (!m_restarting && m_head+size<=m_options.capacity);
+        });
+    }
+    if(m_stop || m_apply_failed) {
+        return false;
+    }
+    std::unordered_map<std::string, uint64_t>::iterator it = m_file_lengths.find(filepath);
+    if(it==m_file_lengths.end()) {
+        long length_now = flen(filepath);
+        if(length_now<0) {
+            return false;
+        }
+        it = m_file_lengths.insert(std::make_pair(filepath, (uint64_t)length_now)).first;
+    }
+    
+    static thread_local std::vector<byte> rec;
+    rec.resize(size);
+    std::copy(record_magic, record_magic+4, rec.begin());
+    encode_big_endian64(rec.begin()+4, m_next_sequence);
+    rec[12] = (byte)(filepath.size()>>8);
+    rec[13] = (byte)filepath.size();
+    encode_big_endian(rec.begin()+14, (uint32_t)length);
+    encode_big_endian64(rec.begin()+18, it->second);
+    std::copy(filepath.begin(), filepath.end(), rec.begin()+record_header_size);
+    std::copy(bytes, bytes+length, rec.begin()+record_header_size+filepath.size());
+    record_check(rec.data(), rec.data()+record_header_size, filepath.size(),
+                 rec.data()+record_header_size+filepath.size(), length, rec.data()+record_checked_size);
+    bool logged = pwrite_all(m_fd, rec.data(), rec.size(), m_head) && ::fdatasync(m_fd)==0;
+    SA_PROBE3(append, filepath.c_str(), m_next_sequence, length);
+    if(!logged) {
+        return false;
+    }
+    
+    record r;
+    r.filepath = filepath;
+    r.file_offset = it->second;
+    r.log_offset = m_head+record_header_size+filepath.size();
+    r.length = (uint32_t)length;
+    m_pending.push_back(r);
+    m_pending_bytes += length;
+    it->second += length;
+    m_head += size;
+    ++m_next_sequence;
+    m_work.notify_one();
+    return true;
+}
+
+bool sa::redo_log::append(std::string const & filepath, std::vector<byte> const & bytes) {
+    return append(filepath, bytes.data(), bytes.size());
+}
+
+bool sa::redo_log::drain() {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_work.notify_one();
+    m_progress.wait(lock, [this]() { return m_stop || m_apply_failed || (m_pending.empty() && !m_applying); });
+    return !m_apply_failed && m_pending.empty() && !m_applying;
+}
+
+bool sa::redo_log::apply_failed() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_apply_failed;
+}
+
+uint64_t sa::redo_log::pending_bytes() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_pending_bytes;
+}
+
+uint64_t sa::redo_log::applied_batch_count() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_applied_batches;
+}
+
+void sa::redo_log::run() {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    for(;;) {
+        m_work.wait(lock, [this]() { return m_stop || !m_pending.empty(); });
+        if(m_pending.empty()) {
+            return;
+        }
+        // Let records pile up into a larger batch, unless shutting down.
+        m_work.wait_for(lock, m_options.apply_delay, [this]() { return m_stop; });
+        
+        std::vector<record> batch;
+        batch.swap(m_pending);
+        uint64_t batch_end = m_head;
+        uint64_t next_sequence = m_next_sequence;
+        m_applying = true;
+        lock.unlock();
+        uint64_t bytes = 0;
+        for(record const & r : batch) {
+            bytes += r.length;
+        }
+        bool success = apply(batch);
+        lock.lock();
+        
+        if(success) {
+            // The checkpoint is written without the lock. With nothing newer
+            // in the log, it can start again from the top, and appends wait
+            // for that checkpoint since they would write there too.
+            // Otherwise they carry on past batch_end meanwhile.
+            bool restart = m_pending.empty();
+            uint64_t restart_sequence = m_next_sequence;
+            m_restarting = restart;
+            lock.unlock();
+            bool restarted = restart && write_checkpoint(0, restart_sequence);
+            if(!restarted) {
+                write_checkpoint(batch_end, next_sequence);
+            }
+            lock.lock();
+            if(restarted) {
+                m_head = 0;
+            }
+            m_restarting = false;
+            m_pending_bytes -= bytes;
+            ++m_applied_batches;
+        } else {
+            // Kept for the next attempt (or the next open), but from now on
+            // drain and append report the failure.
+            m_pending.insert(m_pending.begin(), batch.begin(), batch.end());
+            m_apply_failed = true;
+            m_progress.notify_all();
+            if(!m_stop) {
+                m_work.wait_for(lock, m_options.apply_delay, [this]() { return m_stop; });
+            } else {
+                m_applying = false;
+                m_progress.notify_all();
+                return;
+            }
+        }
+        m_applying = false;
+        m_progress.notify_all();
+    }
+}
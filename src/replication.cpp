@@ -0,0 +1,190 @@
+#include <algorithm>
+#include <cerrno>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "safe_append.h"
+#include "safe_append_internals.h"
+#include "commit_listener.h"
+#include "replication.h"
+#include "retention.h"
+
+static const size_t replication_copy_block = 1024*1024;
+
+sa::replicator::replicator(std::string const & source, std::string const & mirror, replication_options const & opts)
+    : m_source(source), m_mirror(mirror), m_options(opts), m_ok(false),
+      m_target(0), m_shipped(0), m_rewritten(UINT64_MAX), m_batches(0), m_failed_batches(0), m_stop(false), m_listener(0) {
+    long committed = -1;
+    if(read_append_journal(source, committed)!=sa::hot) {
+        committed = flen(source);
+    }
+    if(committed<0 || (!file_exists(mirror) && !splatfile<std::string>(mirror, ""))) {
+        return;
+    }
+    long mirrored = flen(mirror);
+    if(mirrored<0) {
+        return;
+    }
+    m_target = (uint64_t)committed;
+    m_shipped = (uint64_t)mirrored;
+    m_ok = true;
+    m_listener = add_commit_listener([this](commit_event const & e) {
+        if(e.filepath!=m_source) {
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_target = e.length;
+            m_rewritten = std::min(m_rewritten, e.rewritten_from);
+        }
+        m_work.notify_one();
+    });
+    m_thread = std::thread(&replicator::run, this);
+}
+
+sa::replicator::~replicator() {
+    if(m_listener) {
+        remove_commit_listener(m_listener);
+    }
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_work.notify_one();
+    if(m_thread.joinable()) {
+        m_thread.join();
+    }
+}
+
+uint64_t sa::replicator::lag() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    uint64_t valid = std::min(m_shipped, m_rewritten);
+    return (m_target>valid) ? m_target-valid : 0;
+}
+
+uint64_t sa::replicator::shipped_length() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_shipped;
+}
+
+uint64_t sa::replicator::batch_count() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_batches;
+}
+
+uint64_t sa::replicator::failed_batch_count() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_failed_batches;
+}
+
+bool sa::replicator::wait_caught_up(std::chrono::milliseconds timeout) const {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    return m_progress.wait_for(lock, timeout, [this]() { return caught_up(); });
+}
+
+bool sa::replicator::caught_up() const {
+    return m_target==m_shipped && m_rewritten>=m_shipped;
+}
+
+void sa::replicator::run() {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    for(;;) {
+        m_work.wait(lock, [this]() { return m_stop || !caught_up(); });
+        if(caught_up()) {
+            return;
+        }
+        if(!m_stop) {
+            // Let closely spaced commits pile up into one batch.
+            lock.unlock();
+            std::this_thread::sleep_for(m_options.max_delay);
+            lock.lock();
+        }
+        uint64_t shipped = m_shipped;
+        uint64_t from = std::min(shipped, m_rewritten);
+        uint64_t to = m_target;
+        m_rewritten = UINT64_MAX;
+        lock.unlock();
+        bool success = ship(from, to, shipped);
+        lock.lock();
+        if(success) {
+            m_shipped = to;
+            ++m_batches;
+            m_progress.notify_all();
+        } else {
+            m_rewritten = std::min(m_rewritten, from);
+            ++m_failed_batches;
+            if(m_stop) {
+                return;
+            }
+            lock.unlock();
+            std::this_thread::sleep_for(std::max(m_options.max_delay, std::chrono::milliseconds(1)));
+            lock.lock();
+        }
+    }
+}
+
+static bool copy_through_user_space(int in, int out, uint64_t from, uint64_t to) {
+    std::vector<byte> buf((size_t)std::min<uint64_t>(replication_copy_block, to-from));
+    while(from<to) {
+        size_t n = (size_t)std::min<uint64_t>(buf.size(), to-from);
+        if(!pread_all(in, buf.data(), n, from) || !pwrite_all(out, buf.data(), n, from)) {
+            return false;
+        }
+        from += n;
+    }
+    return true;
+}
+
+static bool copy_range(int in, int out, uint64_t from, uint64_t to) {
+#if defined(__linux__) && defined(__GLIBC__) && (__GLIBC__>2 || (__GLIBC__==2 && __GLIBC_MINOR__>=27))
+    while(from<to) {
+        loff_t in_off = (loff_t)from;
+        loff_t out_off = (loff_t)from;
+        ssize_t n = ::copy_file_range(in, &in_off, out, &out_off, (size_t)std::min<uint64_t>(to-from, (uint64_t)1<<30), 0);
+        if(n<0 && errno==EINTR) {
+            continue;
+        }
+        if(n<0 && (errno==ENOSYS || errno==EXDEV || errno==EINVAL || errno==EOPNOTSUPP)) {
+            return copy_through_user_space(in, out, from, to);
+        }
+        if(n<=0) {
+            return false;
+        }
+        from += n;
+    }
+    return true;
+#else
+    return copy_through_user_space(in, out, from, to);
+#endif
+}
+
+/**
+ * Bring the mirror from `shipped` bytes to `to` bytes: truncate if the
+ * source was rolled back below what was shipped, then copy [from, to),
+ * which starts before `shipped` when bytes were rewritten in place.
+ */
+
+bool sa::replicator::ship(uint64_t from, uint64_t to, uint64_t shipped) {
+    int out = ::open(m_mirror.c_str(), O_WRONLY | O_CLOEXEC);
+    if(out<0) {
+        return false;
+    }
+    bool success = to>=shipped || ::ftruncate(out, (off_t)to)==0;
+    if(success && from<to) {
+        // Bytes before the logical start were released by retention; the
+        // mirror keeps the offsets with a hole instead of copying zeros.
+        uint64_t retained = std::min(sa::logical_start(m_source), to);
+        bool skipped = std::min(shipped, to)>=retained || ::ftruncate(out, (off_t)retained)==0;
+        from = std::max(from, retained);
+        int in = ::open(m_source.c_str(), O_RDONLY | O_CLOEXEC);
+        success = skipped && in>=0 && copy_range(in, out, from, to);
+        if(in>=0) {
+            ::close(in);
+        }
+    }
+    success = success && (!m_options.sync || ::fdatasync(out)==0);
+    return (::close(out)==0) && success;
+}
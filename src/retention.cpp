@@ -0,0 +1,109 @@
+#include <algorithm>
+#include <cerrno>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "safe_append.h"
+#include "safe_append_internals.h"
+#include "retention.h"
+
+static const byte start_magic[4] = { 'S', 'A', 'R', 'T' };
+static const byte retention_magic[4] = { 'S', 'A', 'R', 'J' };
+static const size_t retention_record_size = 4+8;
+
+static void header_name(std::string const & filepath, std::string & out_name) {
+    sidecar_name(filepath, "s_", ".hdr", out_name);
+}
+
+static void retention_journal_name(std::string const & filepath, std::string & out_name) {
+    sidecar_name(filepath, "r_", ".rtn", out_name);
+}
+
+static bool write_record(std::string const & name, byte const * magic, uint64_t offset) {
+    std::array<byte, retention_record_size> record;
+    std::copy(magic, magic+4, record.begin());
+    encode_big_endian64(record.begin()+4, offset);
+    return replace_checksummed_file(name, record.data(), record.size());
+}
+
+static bool read_record(std::string const & name, byte const * magic, uint64_t & out_offset) {
+    std::array<byte, retention_record_size> record;
+    size_t len = 0;
+    if(!read_checksummed_file(name, record.data(), record.size(), len) || len!=record.size()
+       || !std::equal(magic, magic+4, record.begin())) {
+        return false;
+    }
+    byte const * p = record.data()+4;
+    out_offset = extract_big_endian64(p);
+    return true;
+}
+
+static bool punch_head(std::string const & filepath, uint64_t offset) {
+    if(offset==0) {
+        return true;
+    }
+#ifdef FALLOC_FL_PUNCH_HOLE
+    int fd = ::open(filepath.c_str(), O_WRONLY | O_CLOEXEC);
+    if(fd<0) {
+        return false;
+    }
+    int rv = ::fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 0, (off_t)offset);
+    bool success = rv==0 || errno==EOPNOTSUPP;
+    ::close(fd);
+    return success;
+#else
+    (void)filepath;
+    return true;
+#endif
+}
+
+uint64_t sa::logical_start(std::string const & filepath) {
+    std::string name;
+    header_name(filepath, name);
+    uint64_t offset = 0;
+    return read_record(name, start_magic, offset) ? offset : 0;
+}
+
+/**
+ * The retention journal is written first, so a crash at any later step
+ * leaves enough to finish: the header is replaced atomically and punching
+ * is idempotent.
+ */
+
+bool sa::retain_from(std::string const & filepath, uint64_t offset) {
+    if(!recover_retention(filepath) || offset<logical_start(filepath)) {
+        return false;
+    }
+    long committed = -1;
+    if(read_append_journal(filepath, committed)!=sa::hot) {
+        committed = flen(filepath);
+    }
+    if(committed<0 || offset>(uint64_t)committed) {
+        return false;
+    }
+    std::string jname;
+    retention_journal_name(filepath, jname);
+    return write_record(jname, retention_magic, offset) && recover_retention(filepath);
+}
+
+bool sa::recover_retention(std::string const & filepath) {
+    std::string jname;
+    retention_journal_name(filepath, jname);
+    if(!file_exists(jname)) {
+        return true;
+    }
+    uint64_t offset = 0;
+    if(!read_record(jname, retention_magic, offset)) {
+        // Torn before it was complete: nothing else had been changed yet.
+        return delete_file(jname);
+    }
+    std::string hname;
+    header_name(filepath, hname);
+    uint64_t current = 0;
+    bool header_done = read_record(hname, start_magic, current) && current==offset;
+    if(!header_done && !write_record(hname, start_magic, offset)) {
+        return false;
+    }
+    return punch_head(filepath, offset) && delete_file(jname) && fsync_directory(jname);
+}
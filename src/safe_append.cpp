@@ -1,10 +1,20 @@
 
+#include <cerrno>
 #include <fstream>
 
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
 #include <boost/filesystem.hpp>
 
 #include "safe_append.h"
 #include "safe_append_internals.h"
+#include "basic_appender.h"
+#include "integrity.h"
+#include "commit_listener.h"
+#include "fd_cache.h"
 
 bool mk_dir(std::string const & dirname) {
     boost::system::error_code sec;
@@ -38,186 +48,342 @@ std::string get_path(std::string const & filepath) {
     return p.parent_path().string();
 }
 
+// The functions below sit on the per-transaction path, so they use plain
+// POSIX calls on the caller's string rather than building boost paths.
+
 bool file_exists(std::string const & filepath) {
-    boost::filesystem::path p(filepath);
-    boost::system::error_code sec;
-    return exists(p, sec) && boost::system::errc::success == sec.value();
+    struct stat st;
+    return ::stat(filepath.c_str(), &st)==0;
 }
 
 bool delete_file(std::string const & filepath) {
-    boost::system::error_code sec;
-    bool success = boost::filesystem::remove(boost::filesystem::path(filepath), sec);
-    return success && boost::system::errc::success == sec.value();
+    if(::unlink(filepath.c_str())!=0) {
+        return false;
+    }
+    sa::fd_cache::invalidate_global(filepath);
+    return true;
 }
 
-
 long flen(std::string const & filepath) {
-    boost::system::error_code sec;
-    long rv = boost::filesystem::file_size(boost::filesystem::path(filepath), sec);
-    if(boost::system::errc::success == sec.value()) {
-        return rv;
+    struct stat st;
+    if(::stat(filepath.c_str(), &st)==0 && S_ISREG(st.st_mode)) {
+        return st.st_size;
     } else {
         return -1;
     }
 }
 
+static bool writev_all(int fd, struct iovec * iov, int iovcnt) {
+    while(iovcnt>0) {
+        ssize_t n = ::writev(fd, iov, iovcnt);
+        if(n<0) {
+            if(errno==EINTR) continue;
+            return false;
+        }
+        while(iovcnt>0 && (size_t)n>=iov->iov_len) {
+            n-=iov->iov_len;
+            ++iov;
+            --iovcnt;
+        }
+        if(iovcnt>0) {
+            iov->iov_base = static_cast<char *>(iov->iov_base)+n;
+            iov->iov_len -= n;
+        }
+    }
+    return true;
+}
+
+bool pwritev_all(int fd, struct iovec * iov, int iovcnt, uint64_t offset) {
+    while(iovcnt>0) {
+        ssize_t n = ::pwritev(fd, iov, iovcnt, offset);
+        if(n<0) {
+            if(errno==EINTR) continue;
+            return false;
+        }
+        offset+=n;
+        while(iovcnt>0 && (size_t)n>=iov->iov_len) {
+            n-=iov->iov_len;
+            ++iov;
+            --iovcnt;
+        }
+        if(iovcnt>0) {
+            iov->iov_base = static_cast<char *>(iov->iov_base)+n;
+            iov->iov_len -= n;
+        }
+    }
+    return true;
+}
+
+static bool read_all(int fd, byte * out, size_t length) {
+    while(length>0) {
+        ssize_t n = ::read(fd, out, length);
+        if(n<0) {
+            if(errno==EINTR) continue;
+            return false;
+        }
+        if(n==0) return false;
+        out+=n;
+        length-=n;
+    }
+    return true;
+}
+
+bool pread_all(int fd, byte * out, size_t length, uint64_t offset) {
+    while(length>0) {
+        ssize_t n = ::pread(fd, out, length, offset);
+        if(n<0) {
+            if(errno==EINTR) continue;
+            return false;
+        }
+        if(n==0) return false;
+        out+=n;
+        offset+=n;
+        length-=n;
+    }
+    return true;
+}
+
+bool pwrite_all(int fd, byte const * bytes, size_t length, uint64_t offset) {
+    while(length>0) {
+        ssize_t n = ::pwrite(fd, bytes, length, offset);
+        if(n<0) {
+            if(errno==EINTR) continue;
+            return false;
+        }
+        bytes+=n;
+        offset+=n;
+        length-=n;
+    }
+    return true;
+}
+
+bool fsync_directory(std::string const & filepath) {
+    std::string::size_type slash = filepath.find_last_of('/');
+    std::string dirname = (slash==std::string::npos) ? std::string(".") : filepath.substr(0, (slash==0) ? 1 : slash);
+    int fd = ::open(dirname.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(fd<0) {
+        return false;
+    }
+    bool success = (::fsync(fd)==0);
+    return (::close(fd)==0) && success;
+}
+
 /**
  * Write (or overwrite, if file fname exists) the bytes to file fname,
  * preceded by the sha512 checksum of the bytes. Provides a reader a way
  * to ensure file is valid and that write succeeded fully.
  */
 
+static bool write_checksummed_fd(int fd, const byte * bytes, size_t length) {
+    uchar_sha512_array digest;
+    sha512(bytes, length, digest.data());
+    struct iovec iov[2];
+    iov[0].iov_base = digest.data();
+    iov[0].iov_len = digest.size();
+    iov[1].iov_base = const_cast<byte *>(bytes);
+    iov[1].iov_len = length;
+    return writev_all(fd, iov, 2);
+}
+
+bool write_checksummed_file(std::string const & filename, const byte * bytes, size_t length) {
+    int fd = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if(fd<0) {
+        return false;
+    }
+    bool success = write_checksummed_fd(fd, bytes, length);
+    return (::close(fd)==0) && success;
+}
+
 bool write_checksummed_file(std::string const & filename, std::vector<byte> const & bytes) {
-    std::ofstream f(filename, std::ios_base::binary | std::ios_base::out | std::ios_base::trunc);
-    if(f.is_open()) {
-        auto hashvec = sha512(bytes);
-        f.write(reinterpret_cast<const char *>(hashvec.data()), hashvec.size());
-        f.flush();
-        f.write(reinterpret_cast<const char *>(bytes.data()), bytes.size());
-        f.flush();
-        f.close();
-        if (f.rdstate() == f.goodbit) {
-            return true;
-        }
+    return write_checksummed_file(filename, bytes.data(), bytes.size());
+}
+
+/**
+ * Like write_checksummed_file, but the file is replaced atomically: the
+ * bytes go to a temporary file which is synced and then renamed over
+ * filename. A reader sees either the old contents or the new, never a
+ * partial write.
+ */
+
+bool replace_checksummed_file(std::string const & filename, const byte * bytes, size_t length) {
+    std::string tmpname(filename);
+    tmpname+=".tmp";
+    int fd = ::open(tmpname.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if(fd<0) {
+        return false;
+    }
+    bool success = write_checksummed_fd(fd, bytes, length) && (::fdatasync(fd)==0);
+    success = (::close(fd)==0) && success;
+    if(!success || ::rename(tmpname.c_str(), filename.c_str())!=0) {
+        delete_file(tmpname);
+        return false;
     }
-    return false;
+    sa::fd_cache::invalidate_global(filename);
+    return fsync_directory(filename);
 }
 
-std::tuple<bool, std::vector<byte>, std::vector<byte>> read_checksummed_file(std::string const & filename) {
-    long len = flen(filename);
-    std::tuple<bool, std::vector<byte>, std::vector<byte>> rv;
-    
-    std::get<0>(rv)=false;    // cksum of contents valid?
-    std::get<1>(rv).clear();  // cksum
-    std::get<2>(rv).clear();  // contents
-    
-    if(len>SHA512::DIGEST_SIZE) {
-        std::ifstream f(filename, f.binary | f.in);
-        if(f.is_open()) {
-            f.seekg (0, f.beg);
-            std::get<1>(rv).resize(SHA512::DIGEST_SIZE);
-            f.read(reinterpret_cast<char *>(std::get<1>(rv).data()), SHA512::DIGEST_SIZE);
-            
-            len-=SHA512::DIGEST_SIZE;
-            std::get<2>(rv).resize(len);
-            f.read(reinterpret_cast<char *>(std::get<2>(rv).data()), len);
-            
-            if(f.fail()) {
-                std::get<0>(rv)=false;
-            } else {
-                std::get<0>(rv)=bytes_equal(sha512(std::get<2>(rv)), std::get<1>(rv));
-            }
-            f.close();
-        }
+bool replace_checksummed_file(std::string const & filename, std::vector<byte> const & bytes) {
+    return replace_checksummed_file(filename, bytes.data(), bytes.size());
+}
+
+/**
+ * Open a checksummed file and read its stored checksum. Returns the open
+ * descriptor, positioned at the start of the contents, or -1 if the file
+ * is missing or too short to hold any contents.
+ */
+
+static int open_checksummed_file(std::string const & filename, uchar_sha512_array & out_checksum, size_t & out_length) {
+    out_length = 0;
+    int fd = ::open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+    if(fd<0) {
+        return -1;
     }
-    return rv;
+    struct stat st;
+    if(::fstat(fd, &st)!=0 || st.st_size<=SHA512::DIGEST_SIZE
+       || !read_all(fd, out_checksum.data(), out_checksum.size())) {
+        ::close(fd);
+        return -1;
+    }
+    out_length = st.st_size-SHA512::DIGEST_SIZE;
+    return fd;
 }
 
-std::string journal_name(std::string const & filepath) {
-    std::string const fname = get_name(filepath);
-    std::string journal_name("j_");
-    std::array<byte, SHA1::DIGEST_SIZE> hash = sha1<std::string>(fname);
-    std::back_insert_iterator<std::string> it = std::back_inserter(journal_name);
-    bytes_to_hex(hash.begin(), hash.end(), it);
-    journal_name+=".jrn";
-    return make_path(get_path(filepath), journal_name);
+static bool contents_match(byte const * contents, size_t length, uchar_sha512_array const & checksum) {
+    uchar_sha512_array computed;
+    sha512(contents, length, computed.data());
+    return bytes_equal(computed, checksum);
 }
 
-bool create_append_journal(std::string const & filepath) {
-    if(!file_exists(filepath)) {
+bool read_checksummed_file(std::string const & filename, byte * out_contents, size_t capacity, size_t & out_length,
+                           uchar_sha512_array * out_checksum) {
+    uchar_sha512_array stored;
+    size_t len = 0;
+    out_length = 0;
+    int fd = open_checksummed_file(filename, stored, len);
+    if(fd<0) {
         return false;
     }
-    std::vector<byte> bytes;
-    int curlen = flen(filepath);
-    if(curlen<0) return false;
-    bytes.resize(sizeof(uint32_t));
-    
-    // The only data we are writing for now is the length of the file to be journaled.
-    // This may (probably will) expand in the future.
-    
-    std::vector<byte>::iterator it = bytes.begin();
-    encode_big_endian(it, (uint32_t)curlen);
-    
-    return write_checksummed_file(journal_name(filepath), bytes);
+    bool valid = false;
+    if(len<=capacity && read_all(fd, out_contents, len)) {
+        out_length = len;
+        valid = contents_match(out_contents, len, stored);
+        if(out_checksum) *out_checksum = stored;
+    }
+    ::close(fd);
+    return valid;
 }
 
-sa::status_value read_append_journal(std::string const & filepath, long & out_length) {
-    std::string jname = journal_name(filepath);
-    
-    if(!file_exists(jname)) {
-        return sa::clean;
+bool read_checksummed_file(std::string const & filename, std::vector<byte> & out_contents,
+                           uchar_sha512_array * out_checksum) {
+    uchar_sha512_array stored;
+    size_t len = 0;
+    out_contents.clear();
+    int fd = open_checksummed_file(filename, stored, len);
+    if(fd<0) {
+        return false;
     }
-    
-    std::tuple<bool, std::vector<byte>, std::vector<byte>> tpl = read_checksummed_file(jname);
-    
-    bool valid = std::get<0>(tpl);
-    std::vector<byte> cksum = std::get<1>(tpl);
-    std::vector<byte> content = std::get<2>(tpl);
-    
-    if(!valid) {
-        out_length = -1;
-        return sa::dirty;
+    out_contents.resize(len);
+    bool valid = false;
+    if(read_all(fd, out_contents.data(), len)) {
+        valid = contents_match(out_contents.data(), len, stored);
+        if(out_checksum) *out_checksum = stored;
+    } else {
+        out_contents.clear();
     }
+    ::close(fd);
+    return valid;
+}
+
+checksummed_contents read_checksummed_file(std::string const & filename) {
+    checksummed_contents rv;
+    rv.checksum.fill(0);
+    rv.valid = read_checksummed_file(filename, rv.contents, &rv.checksum);
+    return rv;
+}
+
+/**
+ * Names of files kept alongside a data file (journals and the like) are
+ * built into a caller-supplied string so that a reused string (see
+ * journal_buffer below) costs no allocation once it has grown. The result
+ * is the same as make_path(get_path(filepath), prefix + "<sha1>" + suffix).
+ */
+
+void sidecar_name(std::string const & filepath, char const * prefix, char const * suffix, std::string & out_name) {
+    std::string::size_type slash = filepath.find_last_of('/');
+    std::string::size_type name_pos = (slash==std::string::npos) ? 0 : slash+1;
     
-    std::vector<byte>::iterator it = content.begin();
-    out_length = extract_big_endian(it);
+    uchar_sha_array hash;
+    uchar_sha_array::iterator hash_it = hash.begin();
+    internal_sha1<byte>(reinterpret_cast<const unsigned char *>(filepath.data()+name_pos),
+                        filepath.size()-name_pos, hash_it);
     
-    return sa::hot;
+    out_name.clear();
+    if(slash!=std::string::npos) {
+        out_name.append(filepath, 0, (slash==0) ? 1 : slash);
+        if(out_name[out_name.size()-1]!='/') {
+            out_name+='/';
+        }
+    }
+    out_name+=prefix;
+    size_t hex_pos = out_name.size();
+    out_name.resize(hex_pos+2*hash.size());
+    bytes_to_hex(hash.data(), hash.size(), &out_name[hex_pos]);
+    out_name+=suffix;
+}
+
+void journal_name(std::string const & filepath, std::string & out_name) {
+    sidecar_name(filepath, "j_", ".jrn", out_name);
+}
+
+std::string journal_name(std::string const & filepath) {
+    std::string rv;
+    journal_name(filepath, rv);
+    return rv;
+}
+
+bool create_append_journal(std::string const & filepath) {
+    return sa::default_appender::create_journal(filepath);
+}
+
+sa::status_value read_append_journal(std::string const & filepath, long & out_length) {
+    return sa::default_appender::status(filepath, out_length);
 }
 
 bool delete_append_journal(std::string const & filepath) {
-    std::string jrn_name = journal_name(filepath);
-    if(!file_exists(jrn_name)) return true;
-    return delete_file(jrn_name);
+    return sa::default_appender::delete_journal(filepath);
 }
 
 sa::status_value sa::status(std::string const & filepath) {
-    long unused;
-    return read_append_journal(filepath, unused);
+    return sa::default_appender::status(filepath);
 }
 
 bool sa::start(std::string const & filepath) {
-    if(sa::status(filepath)!=sa::clean) {
-        return false;
-    }
-    return create_append_journal(filepath);
+    return sa::default_appender::start(filepath);
 }
 
 bool sa::commit(std::string const & filepath) {
-    if(sa::status(filepath)!=sa::hot) {
+    if(!sa::default_appender::commit(filepath)) {
         return false;
     }
-    return delete_append_journal(filepath);
+    // The data is committed at this point. If the sidecar cannot be
+    // extended now, the next commit (or extend_integrity) catches it up.
+    if(sa::has_integrity(filepath)) {
+        sa::extend_integrity(filepath);
+    }
+    sa::notify_commit_listeners(sa::committed, filepath);
+    return true;
 }
 
 bool sa::cleanup(std::string const & filepath) {
-    if(sa::status(filepath)!=sa::dirty) {
-        return false;
-    }
-    return delete_append_journal(filepath);
+    return sa::default_appender::cleanup(filepath);
 }
 
 bool sa::rollback(std::string const & filepath) {
-    long valid_length = 0;
-    sa::status_value s = read_append_journal(filepath, valid_length);
-    if(s!=sa::hot || valid_length<0) {
+    if(!sa::default_appender::rollback(filepath)) {
         return false;
     }
-    long current_length = flen(filepath);
-    
-    if(valid_length>=current_length) {
-        // Do not touch file. We do not want to expand the already bad data!
-        // Valid length should have been less than the current length.
-        return false;
-    }
-    
-    boost::system::error_code sec;
-    boost::filesystem::resize_file(filepath, valid_length, sec);
-    if(boost::system::errc::success == sec.value()) {
-        return(delete_append_journal(filepath));
-    } else {
-        return (boost::system::errc::success == sec.value());
-    }
+    sa::notify_commit_listeners(sa::rolled_back, filepath);
+    return true;
 }
 
 
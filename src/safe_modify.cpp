@@ -0,0 +1,240 @@
+#include <algorithm>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "safe_append.h"
+#include "safe_append_internals.h"
+#include "safe_modify.h"
+#include "commit_listener.h"
+#include "integrity.h"
+
+static const byte undo_magic[4] = { 'S', 'A', 'U', 'N' };
+static const size_t undo_fixed_size = 4+8+4;
+static const size_t undo_run_size = 8+8;
+
+namespace {
+    
+    struct page_run {
+        uint64_t offset;
+        uint64_t length;
+    };
+    
+}
+
+static void undo_journal_name(std::string const & filepath, std::string & out_name) {
+    sidecar_name(filepath, "u_", ".und", out_name);
+}
+
+/**
+ * The page-aligned runs covering the ranges, merged where they touch and
+ * clipped to the file length.
+ */
+
+static std::vector<page_run> page_runs(std::vector<sa::modify_range> const & ranges, uint64_t file_length) {
+    std::vector<page_run> pages;
+    for(sa::modify_range const & r : ranges) {
+        uint64_t begin = r.offset/sa::modify_page_size*sa::modify_page_size;
+        uint64_t end = std::min(file_length, r.offset+r.length);
+        if(r.length>0 && begin<end) {
+            end = (end+sa::modify_page_size-1)/sa::modify_page_size*sa::modify_page_size;
+            page_run run = { begin, std::min(end, file_length)-begin };
+            pages.push_back(run);
+        }
+    }
+    std::sort(pages.begin(), pages.end(), [](page_run const & a, page_run const & b) { return a.offset<b.offset; });
+    std::vector<page_run> runs;
+    for(page_run const & p : pages) {
+        if(!runs.empty() && p.offset<=runs.back().offset+runs.back().length) {
+            runs.back().length = std::max(runs.back().length, p.offset+p.length-runs.back().offset);
+        } else {
+            runs.push_back(p);
+        }
+    }
+    return runs;
+}
+
+static bool valid_undo_journal(checksummed_contents const & journal) {
+    return journal.valid && journal.contents.size()>=undo_fixed_size
+           && std::equal(undo_magic, undo_magic+4, journal.contents.begin());
+}
+
+// The extent [out_begin, out_end) of the journaled runs: the only bytes a
+// modification changed in place. Empty when it only wrote past the end.
+static bool journaled_extent(std::vector<byte> const & j, uint64_t & out_begin, uint64_t & out_end) {
+    byte const * p = j.data()+12;
+    uint32_t count = extract_big_endian(p);
+    if(j.size()<undo_fixed_size+(uint64_t)count*undo_run_size) {
+        return false;
+    }
+    out_begin = UINT64_MAX;
+    out_end = 0;
+    for(uint32_t i=0; i<count; ++i) {
+        byte const * entry = j.data()+undo_fixed_size+i*undo_run_size;
+        uint64_t offset = extract_big_endian64(entry);
+        entry += 8;
+        uint64_t run_length = extract_big_endian64(entry);
+        out_begin = std::min(out_begin, offset);
+        out_end = std::max(out_end, offset+run_length);
+    }
+    return true;
+}
+
+/**
+ * Rehash the integrity chunks under the changed extent, and any bytes
+ * written past the covered length. Done while the journal still exists, so
+ * a crash part way is repaired when the rollback refreshes them again. As
+ * with sa::commit, a sidecar that cannot be brought up to date does not
+ * fail the transaction; verification reports it.
+ */
+
+static void refresh_sidecars(std::string const & filepath, uint64_t begin, uint64_t end) {
+    if(sa::has_integrity(filepath)) {
+        sa::refresh_integrity(filepath, begin, begin<end ? end-begin : 0);
+    }
+}
+
+sa::status_value sa::modify_status(std::string const & filepath) {
+    std::string jname;
+    undo_journal_name(filepath, jname);
+    if(!file_exists(jname)) {
+        return clean;
+    }
+    return valid_undo_journal(read_checksummed_file(jname)) ? hot : dirty;
+}
+
+bool sa::modify_start(std::string const & filepath, std::vector<modify_range> const & ranges) {
+    std::string jname;
+    undo_journal_name(filepath, jname);
+    if(file_exists(jname)) {
+        return false;
+    }
+    int fd = ::open(filepath.c_str(), O_RDONLY | O_CLOEXEC);
+    if(fd<0) {
+        return false;
+    }
+    struct stat st;
+    if(::fstat(fd, &st)!=0) {
+        ::close(fd);
+        return false;
+    }
+    std::vector<page_run> runs = page_runs(ranges, st.st_size);
+    uint64_t images = 0;
+    for(page_run const & r : runs) {
+        images += r.length;
+    }
+    std::vector<byte> journal(undo_fixed_size+runs.size()*undo_run_size+images);
+    std::copy(undo_magic, undo_magic+4, journal.begin());
+    encode_big_endian64(journal.begin()+4, (uint64_t)st.st_size);
+    encode_big_endian(journal.begin()+12, (uint32_t)runs.size());
+    byte * image = journal.data()+undo_fixed_size+runs.size()*undo_run_size;
+    bool success = true;
+    for(size_t i=0; i<runs.size() && success; ++i) {
+        std::vector<byte>::iterator entry = journal.begin()+undo_fixed_size+i*undo_run_size;
+        encode_big_endian64(entry, runs[i].offset);
+        encode_big_endian64(entry+8, runs[i].length);
+        success = pread_all(fd, image, (size_t)runs[i].length, runs[i].offset);
+        image += runs[i].length;
+    }
+    ::close(fd);
+    // The journal must be durable before any page is overwritten.
+    return success && replace_checksummed_file(jname, journal);
+}
+
+bool sa::modify_commit(std::string const & filepath) {
+    std::string jname;
+    undo_journal_name(filepath, jname);
+    checksummed_contents journal = read_checksummed_file(jname);
+    uint64_t begin = 0, end = 0;
+    if(!valid_undo_journal(journal) || !journaled_extent(journal.contents, begin, end)) {
+        return false;
+    }
+    int fd = ::open(filepath.c_str(), O_RDONLY | O_CLOEXEC);
+    bool synced = fd>=0 && ::fdatasync(fd)==0;
+    if(fd>=0) {
+        ::close(fd);
+    }
+    if(!synced) {
+        return false;
+    }
+    refresh_sidecars(filepath, begin, end);
+    if(!delete_file(jname) || !fsync_directory(jname)) {
+        return false;
+    }
+    notify_commit_listeners(committed, filepath, begin);
+    return true;
+}
+
+bool sa::modify_cleanup(std::string const & filepath) {
+    std::string jname;
+    undo_journal_name(filepath, jname);
+    return modify_status(filepath)==dirty && delete_file(jname) && fsync_directory(jname);
+}
+
+bool sa::modify_rollback(std::string const & filepath) {
+    std::string jname;
+    undo_journal_name(filepath, jname);
+    checksummed_contents journal = read_checksummed_file(jname);
+    std::vector<byte> const & j = journal.contents;
+    uint64_t begin = 0, end = 0;
+    if(!valid_undo_journal(journal) || !journaled_extent(j, begin, end)) {
+        return false;
+    }
+    byte const * p = j.data()+4;
+    uint64_t length = extract_big_endian64(p);
+    p = j.data()+12;
+    uint32_t count = extract_big_endian(p);
+    
+    int fd = ::open(filepath.c_str(), O_WRONLY | O_CLOEXEC);
+    if(fd<0) {
+        return false;
+    }
+    bool success = true;
+    byte const * image = j.data()+undo_fixed_size+count*undo_run_size;
+    byte const * images_end = j.data()+j.size();
+    for(uint32_t i=0; i<count && success; ++i) {
+        byte const * entry = j.data()+undo_fixed_size+i*undo_run_size;
+        uint64_t offset = extract_big_endian64(entry);
+        entry += 8;
+        uint64_t run_length = extract_big_endian64(entry);
+        success = run_length<=(uint64_t)(images_end-image)
+                  && pwrite_all(fd, image, (size_t)run_length, offset);
+        image += success ? run_length : 0;
+    }
+    success = success && ::ftruncate(fd, (off_t)length)==0 && ::fdatasync(fd)==0;
+    success = (::close(fd)==0) && success;
+    if(!success) {
+        return false;
+    }
+    refresh_sidecars(filepath, begin, end);
+    if(!delete_file(jname) || !fsync_directory(jname)) {
+        return false;
+    }
+    notify_commit_listeners(rolled_back, filepath, begin);
+    return true;
+}
+
+bool sa::safe_modify(std::string const & filepath, std::vector<modify_range> const & ranges) {
+    if(!modify_start(filepath, ranges)) {
+        return false;
+    }
+    int fd = ::open(filepath.c_str(), O_WRONLY | O_CLOEXEC);
+    bool success = fd>=0;
+    for(size_t i=0; i<ranges.size() && success; ++i) {
+        success = pwrite_all(fd, ranges[i].bytes, ranges[i].length, ranges[i].offset);
+    }
+    if(fd>=0) {
+        success = (::close(fd)==0) && success;
+    }
+    if(!success) {
+        modify_rollback(filepath);
+        return false;
+    }
+    return modify_commit(filepath);
+}
+
+bool sa::safe_modify(std::string const & filepath, uint64_t offset, byte const * bytes, size_t length) {
+    modify_range range = { offset, bytes, length };
+    return safe_modify(filepath, std::vector<modify_range>(1, range));
+}
@@ -0,0 +1,221 @@
+#include <algorithm>
+#include <cstdio>
+#include <ctime>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "safe_append.h"
+#include "safe_append_internals.h"
+#include "segmented_log.h"
+#include "tail_recovery.h"
+#include "probes.h"
+
+static const byte manifest_magic[4] = { 'S', 'A', 'S', 'M' };
+static const size_t manifest_entry_size = 4*8;
+
+/**
+ * Clear what an interrupted append left on a segment. A hot journal is
+ * rolled back (or just removed if nothing was appended). A dirty one was
+ * torn while being written, before anything was appended, so it is removed.
+ */
+
+static bool settle(std::string const & path) {
+    sa::status_value left_over = sa::status(path);
+    if(left_over==sa::hot) {
+        return sa::recover(path).success;
+    }
+    return left_over==sa::clean || sa::cleanup(path);
+}
+
+sa::segmented_log::segmented_log(std::string const & base_path, segment_options const & opts)
+    : m_base(base_path), m_options(opts), m_ok(false) {
+    if(file_exists(manifest_path())) {
+        m_ok = load_manifest();
+    } else {
+        m_ok = add_segment(0);
+    }
+    if(!m_ok) {
+        return;
+    }
+    
+    // Only the active segment can have been interrupted.
+    segment_info & active = m_segments.back();
+    if(!file_exists(active.path)) {
+        // Crashed after the manifest named it but before it was created.
+        m_ok = splatfile<std::string>(active.path, "");
+    } else {
+        m_ok = settle(active.path);
+    }
+    long length = flen(active.path);
+    m_ok = m_ok && length>=0;
+    active.length = m_ok ? (uint64_t)length : 0;
+}
+
+std::string sa::segmented_log::manifest_path() const {
+    return m_base + ".manifest";
+}
+
+std::string sa::segmented_log::segment_path(uint64_t index) const {
+    char suffix[32];
+    std::snprintf(suffix, sizeof(suffix), ".%012llu", (unsigned long long)index);
+    return m_base + suffix;
+}
+
+bool sa::segmented_log::load_manifest() {
+    std::vector<byte> contents;
+    if(!read_checksummed_file(manifest_path(), contents) || contents.size()<8
+       || !std::equal(manifest_magic, manifest_magic+4, contents.begin())) {
+        return false;
+    }
+    byte const * p = contents.data()+4;
+    uint32_t count = extract_big_endian(p);
+    if(count==0 || contents.size()!=8+count*manifest_entry_size) {
+        return false;
+    }
+    m_segments.resize(count);
+    for(uint32_t i=0; i<count; ++i) {
+        byte const * e = contents.data()+8+i*manifest_entry_size;
+        segment_info & s = m_segments[i];
+        s.index = extract_big_endian64(e);
+        e+=8;
+        s.offset = extract_big_endian64(e);
+        e+=8;
+        s.length = extract_big_endian64(e);
+        e+=8;
+        s.created = (int64_t)extract_big_endian64(e);
+        s.path = segment_path(s.index);
+    }
+    return true;
+}
+
+bool sa::segmented_log::write_manifest() const {
+    std::vector<byte> contents(8+m_segments.size()*manifest_entry_size);
+    std::copy(manifest_magic, manifest_magic+4, contents.begin());
+    encode_big_endian(contents.begin()+4, (uint32_t)m_segments.size());
+    for(size_t i=0; i<m_segments.size(); ++i) {
+        std::vector<byte>::iterator e = contents.begin()+8+i*manifest_entry_size;
+        encode_big_endian64(e, m_segments[i].index);
+        encode_big_endian64(e+8, m_segments[i].offset);
+        encode_big_endian64(e+16, m_segments[i].length);
+        encode_big_endian64(e+24, (uint64_t)m_segments[i].created);
+    }
+    return replace_checksummed_file(manifest_path(), contents);
+}
+
+/**
+ * Create the next segment, then publish it in the manifest. A crash in
+ * between leaves an empty file that no manifest names; it is truncated and
+ * reused by the next rotation.
+ */
+
+bool sa::segmented_log::add_segment(uint64_t offset) {
+    segment_info s;
+    s.index = m_segments.empty() ? 1 : m_segments.back().index+1;
+    s.offset = offset;
+    s.length = 0;
+    s.created = (int64_t)std::time(nullptr);
+    s.path = segment_path(s.index);
+    if(!splatfile<std::string>(s.path, "") || !fsync_directory(s.path)) {
+        return false;
+    }
+    m_segments.push_back(s);
+    if(!write_manifest()) {
+        m_segments.pop_back();
+        return false;
+    }
+    return true;
+}
+
+bool sa::segmented_log::rotate() {
+    if(!m_ok) {
+        return false;
+    }
+    segment_info const & active = m_segments.back();
+    if(active.length==0) {
+        return true;
+    }
+    int fd = ::open(active.path.c_str(), O_RDONLY | O_CLOEXEC);
+    bool synced = fd>=0 && ::fsync(fd)==0;
+    if(fd>=0) {
+        ::close(fd);
+    }
+    // The sealed length is recorded by the same manifest write that adds
+    // the new segment.
+    return synced && add_segment(active.offset+active.length);
+}
+
+bool sa::segmented_log::rotation_due(size_t incoming) const {
+    segment_info const & active = m_segments.back();
+    if(active.length==0) {
+        return false;
+    }
+    if(active.length+incoming>m_options.max_segment_size) {
+        return true;
+    }
+    return m_options.max_segment_age.count()>0
+           && (int64_t)std::time(nullptr)-active.created>=m_options.max_segment_age.count();
+}
+
+bool sa::segmented_log::append(byte const * bytes, size_t length) {
+    if(!m_ok || (rotation_due(length) && !rotate())) {
+        return false;
+    }
+    segment_info & active = m_segments.back();
+    // Left by an append whose recovery also failed.
+    if(!settle(active.path)) {
+        return false;
+    }
+    if(!sa::start(active.path)) {
+        return false;
+    }
+    int fd = ::open(active.path.c_str(), O_WRONLY | O_CLOEXEC);
+    bool written = fd>=0 && pwrite_all(fd, bytes, length, active.length);
+    if(fd>=0) {
+        written = (::close(fd)==0) && written;
+    }
+    SA_PROBE3(append, active.path.c_str(), current_transaction(active.path), length);
+    // Recovery also clears a journal with nothing appended, which rollback
+    // refuses, so the segment stays appendable after either failure.
+    if(!written || !sa::commit(active.path)) {
+        sa::recover(active.path);
+        return false;
+    }
+    active.length += length;
+    return true;
+}
+
+bool sa::segmented_log::append(std::vector<byte> const & bytes) {
+    return append(bytes.data(), bytes.size());
+}
+
+uint64_t sa::segmented_log::length() const {
+    return m_segments.empty() ? 0 : m_segments.back().offset+m_segments.back().length;
+}
+
+bool sa::segmented_log::read(uint64_t offset, uint64_t length, std::vector<byte> & out_contents) const {
+    out_contents.clear();
+    uint64_t total = this->length();
+    uint64_t end = (length>total || offset>total-length) ? total : offset+length;
+    if(offset>=end) {
+        return m_ok;
+    }
+    out_contents.resize((size_t)(end-offset));
+    for(segment_info const & s : m_segments) {
+        uint64_t begin = std::max(offset, s.offset);
+        uint64_t stop = std::min(end, s.offset+s.length);
+        if(begin>=stop) {
+            continue;
+        }
+        int fd = ::open(s.path.c_str(), O_RDONLY | O_CLOEXEC);
+        bool success = fd>=0 && pread_all(fd, out_contents.data()+(begin-offset), (size_t)(stop-begin), begin-s.offset);
+        if(fd>=0) {
+            ::close(fd);
+        }
+        if(!success) {
+            out_contents.clear();
+            return false;
+        }
+    }
+    return true;
+}
@@ -171,7 +171,7 @@ bool SHA1::Result(unsigned *message_digest_array)
  *
  */
 void SHA1::Input(   const unsigned char *message_array,
-                    unsigned            length)
+                    size_t              length)
 {
     if (!length)
     {
@@ -230,7 +230,7 @@ void SHA1::Input(   const unsigned char *message_array,
  *
  */
 void SHA1::Input(   const char  *message_array,
-                    unsigned    length)
+                    size_t      length)
 {
     Input((unsigned char *) message_array, length);
 }
@@ -564,6 +564,108 @@ void SHA1::PadMessage()
 }
 
 
+/*  
+ *  ExportState
+ *
+ *  Description:
+ *      This function writes the running state of the digest (the
+ *      digest buffers, the message length and the partial message
+ *      block) to the array provided, most significant byte first.
+ *
+ *  Parameters:
+ *      state: [out]
+ *          An array of at least STATE_SIZE octets.
+ *
+ *  Returns:
+ *      True if successful, false if the digest has already been
+ *      computed or is corrupted.
+ *
+ *  Comments:
+ *
+ */
+bool SHA1::ExportState(unsigned char *state) const
+{
+    int i;
+
+    if (Computed || Corrupted)
+    {
+        return false;
+    }
+
+    for(i = 0; i < 5; i++)
+    {
+        *state++ = (H[i] >> 24) & 0xFF;
+        *state++ = (H[i] >> 16) & 0xFF;
+        *state++ = (H[i] >> 8) & 0xFF;
+        *state++ = (H[i]) & 0xFF;
+    }
+    for(i = 24; i >= 0; i -= 8)
+    {
+        *state++ = (Length_High >> i) & 0xFF;
+    }
+    for(i = 24; i >= 0; i -= 8)
+    {
+        *state++ = (Length_Low >> i) & 0xFF;
+    }
+    *state++ = (unsigned char) Message_Block_Index;
+    for(i = 0; i < 64; i++)
+    {
+        *state++ = (i < Message_Block_Index) ? Message_Block[i] : 0;
+    }
+
+    return true;
+}
+
+/*  
+ *  ImportState
+ *
+ *  Description:
+ *      This function restores a running state previously written by
+ *      ExportState.
+ *
+ *  Parameters:
+ *      state: [in]
+ *          An array of STATE_SIZE octets.
+ *
+ *  Returns:
+ *      True if successful, false if the state is malformed.
+ *
+ *  Comments:
+ *
+ */
+bool SHA1::ImportState(const unsigned char *state)
+{
+    int i;
+    unsigned index = state[(5 * 4) + 8];
+
+    if (index >= 64)
+    {
+        return false;
+    }
+
+    Reset();
+    for(i = 0; i < 5; i++)
+    {
+        H[i] = ((unsigned) state[0] << 24) | ((unsigned) state[1] << 16) |
+               ((unsigned) state[2] << 8) | ((unsigned) state[3]);
+        state += 4;
+    }
+    Length_High = ((unsigned) state[0] << 24) | ((unsigned) state[1] << 16) |
+                  ((unsigned) state[2] << 8) | ((unsigned) state[3]);
+    state += 4;
+    Length_Low = ((unsigned) state[0] << 24) | ((unsigned) state[1] << 16) |
+                 ((unsigned) state[2] << 8) | ((unsigned) state[3]);
+    state += 4;
+    Message_Block_Index = index;
+    state++;
+    for(i = 0; i < 64; i++)
+    {
+        Message_Block[i] = state[i];
+    }
+
+    return true;
+}
+
 /*  
  *  CircularShift
  *
@@ -37,6 +37,7 @@
  */
 
 
+#include <cstring>
 #include <fstream>
 #include "sha512.h"
 
@@ -82,14 +83,15 @@ const unsigned long long SHA512::sha512_k[80] = //ULL = uint64
     0x4cc5d4becb3e42b6ULL, 0x597f299cfc657e2aULL,
     0x5fcb6fab3ad6faecULL, 0x6c44198c4a475817ULL};
 
-void SHA512::transform(const unsigned char *message, unsigned int block_nb)
+void SHA512::transform(const unsigned char *message, size_t block_nb)
 {
     uint64 w[80];
     uint64 wv[8];
     uint64 t1, t2;
     const unsigned char *sub_block;
-    int i, j;
-    for (i = 0; i < (int) block_nb; i++) {
+    size_t i;
+    int j;
+    for (i = 0; i < block_nb; i++) {
         sub_block = message + (i << 7);
         for (j = 0; j < 16; j++) {
             SHA2_PACK64(&sub_block[j << 3], &w[j]);
@@ -134,10 +136,10 @@ void SHA512::init()
     m_tot_len = 0;
 }
 
-void SHA512::update(const unsigned char *message, unsigned int len)
+void SHA512::update(const unsigned char *message, size_t len)
 {
-    unsigned int block_nb;
-    unsigned int new_len, rem_len, tmp_len;
+    size_t block_nb;
+    size_t new_len, rem_len, tmp_len;
     const unsigned char *shifted_message;
     tmp_len = SHA384_512_BLOCK_SIZE - m_len;
     rem_len = len < tmp_len ? len : tmp_len;
@@ -153,27 +155,54 @@ void SHA512::update(const unsigned char *message, unsigned int len)
     transform(shifted_message, block_nb);
     rem_len = new_len % SHA384_512_BLOCK_SIZE;
     memcpy(m_block, &shifted_message[block_nb << 7], rem_len);
-    m_len = rem_len;
-    m_tot_len += (block_nb + 1) << 7;
+    m_len = (unsigned int) rem_len;
+    m_tot_len += ((uint64) block_nb + 1) << 7;
 }
 
 void SHA512::final(unsigned char *digest)
 {
     unsigned int block_nb;
     unsigned int pm_len;
-    unsigned int len_b;
+    uint64 len_b_hi, len_b_lo;
     int i;
     block_nb = 1 + ((SHA384_512_BLOCK_SIZE - 17)
                     < (m_len % SHA384_512_BLOCK_SIZE));
-    len_b = (m_tot_len + m_len) << 3;
+    len_b_lo = (m_tot_len + m_len) << 3;
+    len_b_hi = (m_tot_len + m_len) >> 61;
     pm_len = block_nb << 7;
     memset(m_block + m_len, 0, pm_len - m_len);
     m_block[m_len] = 0x80;
-    SHA2_UNPACK32(len_b, m_block + pm_len - 4);
+    SHA2_UNPACK64(len_b_hi, m_block + pm_len - 16);
+    SHA2_UNPACK64(len_b_lo, m_block + pm_len - 8);
     transform(m_block, block_nb);
     for (i = 0 ; i < 8; i++) {
         SHA2_UNPACK64(m_h[i], &digest[i << 3]);
     }
 }
 
+void SHA512::export_state(unsigned char *state) const
+{
+    int i;
+    for (i = 0; i < 8; i++) {
+        SHA2_UNPACK64(m_h[i], &state[i << 3]);
+    }
+    SHA2_UNPACK64(m_tot_len, &state[64]);
+    state[72] = (uint8) m_len;
+    memset(state + 73, 0, SHA384_512_BLOCK_SIZE);
+    memcpy(state + 73, m_block, m_len);
+}
 
+bool SHA512::import_state(const unsigned char *state)
+{
+    int i;
+    if (state[72] >= SHA384_512_BLOCK_SIZE) {
+        return false;
+    }
+    for (i = 0; i < 8; i++) {
+        SHA2_PACK64(&state[i << 3], &m_h[i]);
+    }
+    SHA2_PACK64(&state[64], &m_tot_len);
+    m_len = state[72];
+    memcpy(m_block, state + 73, SHA384_512_BLOCK_SIZE);
+    return true;
+}
@@ -0,0 +1,139 @@
+#include <algorithm>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "safe_append.h"
+#include "safe_append_internals.h"
+#include "committed_length.h"
+#include "snapshot_reader.h"
+
+sa::snapshot::snapshot(std::string const & filepath)
+    : m_filepath(filepath), m_fd(-1), m_data(nullptr), m_length(0) {
+    std::unique_ptr<committed_length_reader> published(new committed_length_reader(filepath));
+    if(published->ok()) {
+        m_published = std::move(published);
+    }
+    m_fd = ::open(filepath.c_str(), O_RDONLY | O_CLOEXEC);
+    if(m_fd>=0 && !update()) {
+        close();
+    }
+}
+
+sa::snapshot::~snapshot() {
+    close();
+}
+
+bool sa::snapshot::refresh() {
+    uint64_t before = m_length;
+    return ok() && update() && m_length>before;
+}
+
+/**
+ * Map the committed prefix, then check it again. A transaction that
+ * started, appended and rolled back while the length was being read could
+ * have made it too long; the second look sees the journal or the shorter
+ * file, and the mapping shrinks to match before anything reads it.
+ */
+
+bool sa::snapshot::update() {
+    uint64_t length = 0;
+    if(!committed_length(length)) {
+        return false;
+    }
+    for(;;) {
+        if(!map(length)) {
+            return false;
+        }
+        uint64_t checked = 0;
+        if(!committed_length(checked)) {
+            return false;
+        }
+        if(checked>=length) {
+            return true;
+        }
+        length = checked;
+    }
+}
+
+// Never more than the file holds: a stale sidecar or journal (the writer
+// gone, the file truncated or recreated) must not map past the end of
+// the file.
+bool sa::snapshot::committed_length(uint64_t & out_length) const {
+    for(;;) {
+        long journaled = -1;
+        sa::status_value before = m_published ? sa::clean : read_append_journal(m_filepath, journaled);
+        if(before==sa::dirty) {
+            return false;
+        }
+        struct stat st;
+        if(::fstat(m_fd, &st)!=0) {
+            return false;
+        }
+        uint64_t size = (uint64_t)st.st_size;
+        if(m_published) {
+            out_length = std::min(m_published->committed(), size);
+            return true;
+        }
+        if(before==sa::hot) {
+            out_length = std::min((uint64_t)journaled, size);
+            return true;
+        }
+        // A transaction that started after the first check may already
+        // have appended; its journal then holds the committed length.
+        if(read_append_journal(m_filepath, journaled)==sa::clean) {
+            out_length = size;
+            return true;
+        }
+    }
+}
+
+/**
+ * Map [0, length). The committed prefix normally only grows, so an
+ * existing mapping is resized in place where the system allows it.
+ */
+
+bool sa::snapshot::map(uint64_t length) {
+    if(length==m_length) {
+        return true;
+    }
+    if(length==0) {
+        ::munmap(m_data, (size_t)m_length);
+        m_data = nullptr;
+        m_length = 0;
+        return true;
+    }
+    void * p = MAP_FAILED;
+    if(m_data) {
+#ifdef MREMAP_MAYMOVE
+        p = ::mremap(m_data, (size_t)m_length, (size_t)length, MREMAP_MAYMOVE);
+#else
+        p = ::mmap(nullptr, (size_t)length, PROT_READ, MAP_SHARED, m_fd, 0);
+        if(p!=MAP_FAILED) {
+            ::munmap(m_data, (size_t)m_length);
+        }
+#endif
+    } else {
+        p = ::mmap(nullptr, (size_t)length, PROT_READ, MAP_SHARED, m_fd, 0);
+    }
+    if(p==MAP_FAILED) {
+        return false;
+    }
+    m_data = static_cast<byte *>(p);
+    m_length = length;
+    return true;
+}
+
+void sa::snapshot::close() {
+    if(m_data) {
+        ::munmap(m_data, (size_t)m_length);
+        m_data = nullptr;
+    }
+    m_length = 0;
+    if(m_fd>=0) {
+        ::close(m_fd);
+        m_fd = -1;
+    }
+}
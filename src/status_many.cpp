@@ -0,0 +1,84 @@
+#include <cerrno>
+#include <cstring>
+#include <unordered_map>
+#include <unordered_set>
+
+#include <dirent.h>
+
+#include "safe_append.h"
+#include "safe_append_internals.h"
+#include "basic_appender.h"
+#include "parallel_for.h"
+
+namespace {
+    
+    struct directory_group {
+        std::string directory;
+        std::vector<size_t> members; // indexes into the caller's paths
+    };
+    
+}
+
+/**
+ * List the j_*.jrn names in a directory. False if it cannot be listed for
+ * any reason other than not existing.
+ */
+
+static bool list_journals(std::string const & directory, std::unordered_set<std::string> & out_names) {
+    DIR * dir = ::opendir(directory.c_str());
+    if(!dir) {
+        return errno==ENOENT;
+    }
+    while(struct dirent * entry = ::readdir(dir)) {
+        size_t len = std::strlen(entry->d_name);
+        if(len>6 && std::strncmp(entry->d_name, "j_", 2)==0 && std::strcmp(entry->d_name+len-4, ".jrn")==0) {
+            out_names.insert(entry->d_name);
+        }
+    }
+    ::closedir(dir);
+    return true;
+}
+
+std::vector<sa::status_value> sa::status_many(std::vector<std::string> const & filepaths, unsigned threads) {
+    std::vector<status_value> rv(filepaths.size(), clean);
+    std::vector<std::string> jnames(filepaths.size());
+    parallel_for(filepaths.size(), threads, [&](size_t i) {
+        journal_name(filepaths[i], jnames[i]);
+    });
+    
+    std::vector<directory_group> groups;
+    std::unordered_map<std::string, size_t> group_of;
+    for(size_t i=0; i<jnames.size(); ++i) {
+        std::string::size_type slash = jnames[i].find_last_of('/');
+        std::string directory = (slash==std::string::npos) ? std::string(".") : jnames[i].substr(0, slash+1);
+        std::pair<std::unordered_map<std::string, size_t>::iterator, bool> ins = group_of.insert(std::make_pair(directory, groups.size()));
+        if(ins.second) {
+            groups.push_back(directory_group());
+            groups.back().directory = directory;
+        }
+        groups[ins.first->second].members.push_back(i);
+    }
+    
+    // One listing per directory decides which files need their journal
+    // read; every other file is clean.
+    std::vector<std::vector<size_t>> to_check(groups.size());
+    parallel_for(groups.size(), threads, [&](size_t g) {
+        std::unordered_set<std::string> names;
+        bool listed = list_journals(groups[g].directory, names);
+        for(size_t i : groups[g].members) {
+            std::string::size_type slash = jnames[i].find_last_of('/');
+            if(!listed || names.count(jnames[i].substr(slash==std::string::npos ? 0 : slash+1))) {
+                to_check[g].push_back(i);
+            }
+        }
+    });
+    
+    std::vector<size_t> checks;
+    for(std::vector<size_t> const & c : to_check) {
+        checks.insert(checks.end(), c.begin(), c.end());
+    }
+    parallel_for(checks.size(), threads, [&](size_t k) {
+        rv[checks[k]] = default_appender::status(filepaths[checks[k]]);
+    });
+    return rv;
+}
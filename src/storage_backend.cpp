@@ -0,0 +1,287 @@
+#include <cerrno>
+#include <map>
+#include <memory>
+#include <mutex>
+
+#include "storage_backend.h"
+
+namespace {
+    
+    struct memory_file {
+        std::vector<byte> data;
+        std::vector<byte> durable; // contents as of the last sync
+    };
+    
+    typedef std::shared_ptr<memory_file> file_ptr;
+    
+    struct memory_state {
+        std::mutex mutex;
+        std::map<std::string, file_ptr> names;
+        std::map<std::string, file_ptr> durable_names; // as of the last directory sync
+        std::map<int, file_ptr> open_files;
+        int next_fd;
+        bool crash_armed;
+        uint64_t operations_left;
+        
+        memory_state() : next_fd(3), crash_armed(false), operations_left(0) {}
+    };
+    
+    memory_state & state() {
+        static memory_state s;
+        return s;
+    }
+    
+    std::string directory_of(std::string const & path) {
+        std::string::size_type slash = path.find_last_of('/');
+        return (slash==std::string::npos) ? std::string() : path.substr(0, slash+1);
+    }
+    
+    bool in_directory(std::string const & path, std::string const & dir) {
+        return path.compare(0, dir.size(), dir)==0 && path.find('/', dir.size())==std::string::npos;
+    }
+    
+    // Every call passes through here; false once the simulated crash hit.
+    bool tick(memory_state & s) {
+        if(!s.crash_armed) {
+            return true;
+        }
+        if(s.operations_left==0) {
+            errno = EIO;
+            return false;
+        }
+        --s.operations_left;
+        return true;
+    }
+    
+    file_ptr find_fd(memory_state & s, int fd) {
+        std::map<int, file_ptr>::iterator it = s.open_files.find(fd);
+        if(it==s.open_files.end()) {
+            errno = EBADF;
+            return file_ptr();
+        }
+        return it->second;
+    }
+}
+
+int sa::memory_backend::open(std::string const & path, int flags) {
+    memory_state & s = state();
+    std::lock_guard<std::mutex> lock(s.mutex);
+    if(!tick(s)) {
+        return -1;
+    }
+    std::map<std::string, file_ptr>::iterator it = s.names.find(path);
+    if(it==s.names.end()) {
+        if(!(flags & O_CREAT)) {
+            errno = ENOENT;
+            return -1;
+        }
+        it = s.names.insert(std::make_pair(path, std::make_shared<memory_file>())).first;
+    } else if((flags & O_TRUNC) && (flags & (O_WRONLY | O_RDWR))) {
+        it->second->data.clear();
+    }
+    int fd = s.next_fd++;
+    s.open_files[fd] = it->second;
+    return fd;
+}
+
+bool sa::memory_backend::close(int fd) {
+    memory_state & s = state();
+    std::lock_guard<std::mutex> lock(s.mutex);
+    if(!tick(s)) {
+        return false;
+    }
+    return s.open_files.erase(fd)==1;
+}
+
+bool sa::memory_backend::pread_all(int fd, byte * out, size_t length, uint64_t offset) {
+    memory_state & s = state();
+    std::lock_guard<std::mutex> lock(s.mutex);
+    if(!tick(s)) {
+        return false;
+    }
+    file_ptr f = find_fd(s, fd);
+    if(!f || offset>f->data.size() || length>f->data.size()-offset) {
+        return false;
+    }
+    std::copy(f->data.begin()+offset, f->data.begin()+offset+length, out);
+    return true;
+}
+
+bool sa::memory_backend::pwrite_all(int fd, byte const * bytes, size_t length, uint64_t offset) {
+    memory_state & s = state();
+    std::lock_guard<std::mutex> lock(s.mutex);
+    if(!tick(s)) {
+        return false;
+    }
+    file_ptr f = find_fd(s, fd);
+    if(!f) {
+        return false;
+    }
+    if(f->data.size()<offset+length) {
+        f->data.resize(offset+length);
+    }
+    std::copy(bytes, bytes+length, f->data.begin()+offset);
+    return true;
+}
+
+bool sa::memory_backend::size(int fd, uint64_t & out_size) {
+    memory_state & s = state();
+    std::lock_guard<std::mutex> lock(s.mutex);
+    if(!tick(s)) {
+        return false;
+    }
+    file_ptr f = find_fd(s, fd);
+    if(!f) {
+        return false;
+    }
+    out_size = f->data.size();
+    return true;
+}
+
+bool sa::memory_backend::truncate(int fd, uint64_t length) {
+    memory_state & s = state();
+    std::lock_guard<std::mutex> lock(s.mutex);
+    if(!tick(s)) {
+        return false;
+    }
+    file_ptr f = find_fd(s, fd);
+    if(!f) {
+        return false;
+    }
+    f->data.resize(length);
+    return true;
+}
+
+bool sa::memory_backend::sync(int fd) {
+    return datasync(fd);
+}
+
+bool sa::memory_backend::datasync(int fd) {
+    memory_state & s = state();
+    std::lock_guard<std::mutex> lock(s.mutex);
+    if(!tick(s)) {
+        return false;
+    }
+    file_ptr f = find_fd(s, fd);
+    if(!f) {
+        return false;
+    }
+    f->durable = f->data;
+    return true;
+}
+
+bool sa::memory_backend::sync_directory(std::string const & path) {
+    memory_state & s = state();
+    std::lock_guard<std::mutex> lock(s.mutex);
+    if(!tick(s)) {
+        return false;
+    }
+    std::string dir = directory_of(path);
+    for(std::map<std::string, file_ptr>::iterator it = s.durable_names.begin(); it!=s.durable_names.end(); ) {
+        if(in_directory(it->first, dir)) {
+            it = s.durable_names.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    for(std::pair<std::string const, file_ptr> const & entry : s.names) {
+        if(in_directory(entry.first, dir)) {
+            s.durable_names.insert(entry);
+        }
+    }
+    return true;
+}
+
+bool sa::memory_backend::unlink(std::string const & path) {
+    memory_state & s = state();
+    std::lock_guard<std::mutex> lock(s.mutex);
+    if(!tick(s)) {
+        return false;
+    }
+    if(s.names.erase(path)==0) {
+        errno = ENOENT;
+        return false;
+    }
+    return true;
+}
+
+bool sa::memory_backend::exists(std::string const & path) {
+    memory_state & s = state();
+    std::lock_guard<std::mutex> lock(s.mutex);
+    if(!tick(s)) {
+        return false;
+    }
+    return s.names.count(path)!=0;
+}
+
+long sa::memory_backend::length(std::string const & path) {
+    memory_state & s = state();
+    std::lock_guard<std::mutex> lock(s.mutex);
+    if(!tick(s)) {
+        return -1;
+    }
+    std::map<std::string, file_ptr>::const_iterator it = s.names.find(path);
+    return (it==s.names.end()) ? -1 : (long)it->second->data.size();
+}
+
+bool sa::memory_backend::write_file(std::string const & path, byte const * bytes, size_t length) {
+    memory_state & s = state();
+    std::lock_guard<std::mutex> lock(s.mutex);
+    file_ptr f = std::make_shared<memory_file>();
+    f->data.assign(bytes, bytes+length);
+    f->durable = f->data;
+    s.names[path] = f;
+    s.durable_names[path] = f;
+    return true;
+}
+
+bool sa::memory_backend::read_file(std::string const & path, std::vector<byte> & out_contents) {
+    memory_state & s = state();
+    std::lock_guard<std::mutex> lock(s.mutex);
+    std::map<std::string, file_ptr>::const_iterator it = s.names.find(path);
+    if(it==s.names.end()) {
+        out_contents.clear();
+        return false;
+    }
+    out_contents = it->second->data;
+    return true;
+}
+
+void sa::memory_backend::crash_after(uint64_t operations) {
+    memory_state & s = state();
+    std::lock_guard<std::mutex> lock(s.mutex);
+    s.crash_armed = true;
+    s.operations_left = operations;
+}
+
+bool sa::memory_backend::crashed() {
+    memory_state & s = state();
+    std::lock_guard<std::mutex> lock(s.mutex);
+    return s.crash_armed && s.operations_left==0;
+}
+
+void sa::memory_backend::power_loss(double keep_unsynced) {
+    memory_state & s = state();
+    std::lock_guard<std::mutex> lock(s.mutex);
+    s.open_files.clear();
+    s.crash_armed = false;
+    s.names = s.durable_names;
+    for(std::pair<std::string const, file_ptr> & entry : s.names) {
+        memory_file & f = *entry.second;
+        size_t kept = f.durable.size();
+        if(f.data.size()>kept) {
+            kept += (size_t)((f.data.size()-kept)*keep_unsynced);
+            f.durable.insert(f.durable.end(), f.data.begin()+f.durable.size(), f.data.begin()+kept);
+        }
+        f.data = f.durable;
+    }
+}
+
+void sa::memory_backend::reset() {
+    memory_state & s = state();
+    std::lock_guard<std::mutex> lock(s.mutex);
+    s.open_files.clear();
+    s.names.clear();
+    s.durable_names.clear();
+    s.crash_armed = false;
+}
@@ -0,0 +1,130 @@
+#include <algorithm>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "safe_append.h"
+#include "safe_append_internals.h"
+#include "integrity.h"
+#include "tail_recovery.h"
+
+static const size_t recovery_read_size = 1024*1024;
+
+// Offset of the first hole at or after `from`, or `end` if there is none
+// (or the file system cannot tell us).
+static uint64_t first_hole(int fd, uint64_t from, uint64_t end) {
+#ifdef SEEK_HOLE
+    off_t hole = ::lseek(fd, from, SEEK_HOLE);
+    if(hole>=0 && (uint64_t)hole<end) {
+        return hole;
+    }
+#endif
+    return end;
+}
+
+/**
+ * Find the first all-zero block in [begin, end), reading a chunk at a time.
+ * Only whole blocks aligned to absolute file offsets count: a partial block
+ * at either end of the tail may hold a few legitimate zeros. out_end is
+ * left alone if there is no such block.
+ */
+
+static bool first_zero_block(int fd, uint64_t begin, uint64_t end, size_t block, uint64_t & out_end) {
+    size_t chunk = std::max<size_t>(block, recovery_read_size/block*block);
+    std::vector<byte> buf;
+    uint64_t pos = (begin+block-1)/block*block;
+    while(pos<end && end-pos>=block) {
+        size_t n = (size_t)std::min<uint64_t>(chunk, (end-pos)/block*block);
+        buf.resize(n);
+        if(!pread_all(fd, buf.data(), n, pos)) {
+            return false;
+        }
+        for(size_t at=0; at<n; at+=block) {
+            if(all_zero(buf.data()+at, block)) {
+                out_end = pos+at;
+                return true;
+            }
+        }
+        pos += n;
+    }
+    return true;
+}
+
+sa::recovery_result sa::recover(std::string const & filepath, sa::recovery_options const & options) {
+    sa::recovery_result rv;
+    rv.success = false;
+    rv.journaled_length = 0;
+    rv.original_length = 0;
+    rv.recovered_length = 0;
+    
+    long valid_length = 0;
+    if(read_append_journal(filepath, valid_length)!=sa::hot || valid_length<0) {
+        return rv;
+    }
+    long current_length = flen(filepath);
+    rv.journaled_length = valid_length;
+    rv.original_length = (current_length<0) ? 0 : current_length;
+    rv.recovered_length = rv.original_length;
+    
+    if(current_length<valid_length) {
+        // Do not touch file. We do not want to expand the already bad data!
+        return rv;
+    }
+    if(current_length==valid_length) {
+        // Nothing was appended; the journal is all there is to clean up.
+        rv.success = delete_append_journal(filepath);
+        return rv;
+    }
+    
+    int fd = ::open(filepath.c_str(), O_RDWR | O_CLOEXEC);
+    if(fd<0) {
+        return rv;
+    }
+    
+    uint64_t begin = valid_length;
+    uint64_t end = first_hole(fd, begin, current_length);
+    bool can_keep = options.record_size>0 || options.validator;
+    bool success = true;
+    
+    if(can_keep && end>begin && options.zero_blocks_are_torn) {
+        success = first_zero_block(fd, begin, end, std::max<size_t>(options.block_size, 1), end);
+    }
+    
+    size_t keep = 0;
+    if(success && can_keep) {
+        keep = (size_t)(end-begin);
+        if(options.record_size>0) {
+            keep -= keep%options.record_size;
+        }
+        if(options.validator && keep>0) {
+            // Mapped rather than read, so a large tail costs no heap and only
+            // the pages the validator looks at are read.
+            uint64_t map_begin = begin - begin%(uint64_t)::sysconf(_SC_PAGESIZE);
+            size_t map_length = (size_t)(begin-map_begin)+keep;
+            void * map = ::mmap(NULL, map_length, PROT_READ, MAP_SHARED, fd, (off_t)map_begin);
+            if(map==MAP_FAILED) {
+                success = false;
+            }
+            else {
+                keep = std::min(keep, options.validator((byte const *)map+(begin-map_begin), keep));
+                ::munmap(map, map_length);
+            }
+        }
+    }
+    
+    uint64_t new_length = begin+keep;
+    if(success) {
+        success = (::ftruncate(fd, new_length)==0) && (::fdatasync(fd)==0);
+    }
+    success = (::close(fd)==0) && success;
+    if(success) {
+        rv.recovered_length = new_length;
+        rv.success = delete_append_journal(filepath);
+        if(rv.success && keep>0 && sa::has_integrity(filepath)) {
+            sa::extend_integrity(filepath);
+        }
+    }
+    return rv;
+}
@@ -0,0 +1,198 @@
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "safe_append.h"
+#include "tree_checksum.h"
+#include "parallel_for.h"
+
+static const byte tree_magic[4] = { 'S', 'A', 'T', 'R' };
+static const size_t tree_fixed_header_size = 4 + 4 + 8;
+static const size_t tree_header_offset = SHA512::DIGEST_SIZE;
+
+static uint64_t tree_chunk_count(uint64_t length, uint32_t chunk_size) {
+    return (length+chunk_size-1)/chunk_size;
+}
+
+// The root covers the fixed header and every chunk digest.
+static void tree_root(byte const * header_and_digests, size_t length, uchar_sha512_array & out_root) {
+    sha512(header_and_digests, length, out_root.data());
+}
+
+bool write_tree_checksummed_file(std::string const & filename, const byte * bytes, size_t length,
+                                 uint32_t chunk_size, unsigned threads) {
+    if(chunk_size==0) {
+        return false;
+    }
+    uint64_t chunks = tree_chunk_count(length, chunk_size);
+    std::vector<byte> header(tree_fixed_header_size+chunks*SHA512::DIGEST_SIZE);
+    std::copy(tree_magic, tree_magic+4, header.begin());
+    encode_big_endian(header.begin()+4, chunk_size);
+    encode_big_endian64(header.begin()+8, (uint64_t)length);
+    
+    byte * digests = header.data()+tree_fixed_header_size;
+    parallel_for((size_t)chunks, threads, [&](size_t i) {
+        size_t begin = i*(size_t)chunk_size;
+        size_t n = std::min<size_t>(chunk_size, length-begin);
+        SHA512 ctx;
+        ctx.init();
+        ctx.update(bytes+begin, n);
+        ctx.final(digests+i*SHA512::DIGEST_SIZE);
+    });
+    
+    uchar_sha512_array root;
+    tree_root(header.data(), header.size(), root);
+    
+    int fd = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if(fd<0) {
+        return false;
+    }
+    bool success = pwrite_all(fd, root.data(), root.size(), 0)
+                   && pwrite_all(fd, header.data(), header.size(), root.size())
+                   && pwrite_all(fd, bytes, length, root.size()+header.size());
+    return (::close(fd)==0) && success;
+}
+
+bool write_tree_checksummed_file(std::string const & filename, std::vector<byte> const & bytes,
+                                 uint32_t chunk_size, unsigned threads) {
+    return write_tree_checksummed_file(filename, bytes.data(), bytes.size(), chunk_size, threads);
+}
+
+namespace {
+    
+    struct tree_header {
+        uint32_t chunk_size;
+        uint64_t length;
+        uint64_t payload_offset;
+        uchar_sha512_array root;
+        std::vector<byte> digests;
+    };
+    
+}
+
+/**
+ * Open a tree-checksummed file and verify its header and chunk digests
+ * against the stored root. Returns the open descriptor, or -1.
+ */
+
+static int open_tree_checksummed_file(std::string const & filename, tree_header & header) {
+    int fd = ::open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+    if(fd<0) {
+        return -1;
+    }
+    struct stat st;
+    std::array<byte, tree_header_offset+tree_fixed_header_size> fixed;
+    if(::fstat(fd, &st)!=0 || (uint64_t)st.st_size<fixed.size()
+       || !pread_all(fd, fixed.data(), fixed.size(), 0)
+       || !std::equal(tree_magic, tree_magic+4, fixed.begin()+tree_header_offset)) {
+        ::close(fd);
+        return -1;
+    }
+    std::copy(fixed.begin(), fixed.begin()+SHA512::DIGEST_SIZE, header.root.begin());
+    byte const * p = fixed.data()+tree_header_offset+4;
+    header.chunk_size = extract_big_endian(p);
+    p+=4;
+    header.length = extract_big_endian64(p);
+    
+    uint64_t chunks = (header.chunk_size==0) ? 0 : tree_chunk_count(header.length, header.chunk_size);
+    uint64_t digests_size = chunks*SHA512::DIGEST_SIZE;
+    header.payload_offset = fixed.size()+digests_size;
+    if(header.chunk_size==0 || chunks>(uint64_t)st.st_size/SHA512::DIGEST_SIZE
+       || (uint64_t)st.st_size!=header.payload_offset+header.length) {
+        ::close(fd);
+        return -1;
+    }
+    
+    std::vector<byte> covered(tree_fixed_header_size+digests_size);
+    std::copy(fixed.begin()+tree_header_offset, fixed.end(), covered.begin());
+    uchar_sha512_array root;
+    if(!pread_all(fd, covered.data()+tree_fixed_header_size, digests_size, fixed.size())) {
+        ::close(fd);
+        return -1;
+    }
+    tree_root(covered.data(), covered.size(), root);
+    if(!bytes_equal(root, header.root)) {
+        ::close(fd);
+        return -1;
+    }
+    header.digests.assign(covered.begin()+tree_fixed_header_size, covered.end());
+    return fd;
+}
+
+// Read chunks [first, last] into out, which must hold them back to back,
+// verifying each against its stored digest. Runs one chunk per task.
+static bool read_tree_chunks(int fd, tree_header const & header, uint64_t first, uint64_t last,
+                             byte * out, unsigned threads) {
+    std::atomic<bool> valid(true);
+    parallel_for((size_t)(last-first+1), threads, [&](size_t i) {
+        uint64_t chunk = first+i;
+        uint64_t begin = chunk*header.chunk_size;
+        size_t n = (size_t)std::min<uint64_t>(header.chunk_size, header.length-begin);
+        byte * dest = out+i*(size_t)header.chunk_size;
+        uchar_sha512_array d;
+        if(!pread_all(fd, dest, n, header.payload_offset+begin)) {
+            valid = false;
+            return;
+        }
+        SHA512 ctx;
+        ctx.init();
+        ctx.update(dest, n);
+        ctx.final(d.data());
+        if(!std::equal(d.begin(), d.end(), header.digests.begin()+chunk*SHA512::DIGEST_SIZE)) {
+            valid = false;
+        }
+    });
+    return valid;
+}
+
+checksummed_contents read_tree_checksummed_file(std::string const & filename, unsigned threads) {
+    checksummed_contents rv;
+    rv.valid = false;
+    rv.checksum.fill(0);
+    
+    tree_header header;
+    int fd = open_tree_checksummed_file(filename, header);
+    if(fd<0) {
+        return rv;
+    }
+    rv.checksum = header.root;
+    rv.contents.resize((size_t)header.length);
+    if(header.length==0) {
+        rv.valid = true;
+    } else {
+        rv.valid = read_tree_chunks(fd, header, 0, tree_chunk_count(header.length, header.chunk_size)-1,
+                                    rv.contents.data(), threads);
+    }
+    ::close(fd);
+    return rv;
+}
+
+bool read_tree_checksummed_range(std::string const & filename, uint64_t offset, uint64_t length,
+                                 std::vector<byte> & out_contents, unsigned threads) {
+    out_contents.clear();
+    tree_header header;
+    int fd = open_tree_checksummed_file(filename, header);
+    if(fd<0) {
+        return false;
+    }
+    uint64_t end = (length>header.length || offset>header.length-length) ? header.length : offset+length;
+    bool valid = true;
+    if(offset<end) {
+        uint64_t first = offset/header.chunk_size;
+        uint64_t last = (end-1)/header.chunk_size;
+        uint64_t aligned = first*header.chunk_size;
+        out_contents.resize((size_t)(std::min(header.length, (last+1)*header.chunk_size)-aligned));
+        valid = read_tree_chunks(fd, header, first, last, out_contents.data(), threads);
+        out_contents.resize((size_t)(end-aligned));
+        out_contents.erase(out_contents.begin(), out_contents.begin()+(size_t)(offset-aligned));
+    }
+    ::close(fd);
+    if(!valid) {
+        out_contents.clear();
+    }
+    return valid;
+}